@@ -0,0 +1,164 @@
+#ifndef NFS_BENCH_UTIL_H
+#define NFS_BENCH_UTIL_H
+
+// Pieces shared by the benchmarks that run against a mount: latency samples
+// and their percentiles, size and option parsing, JSON string quoting and
+// scratch directory cleanup.
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace bench {
+
+// Brackets the part of an operation that is measured
+class Timer {
+    public:
+        void start() { start_ = std::chrono::steady_clock::now(); }
+        void stop() { elapsed_us_ = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start_).count(); }
+        double elapsedUs() const { return elapsed_us_; }
+
+    private:
+        std::chrono::steady_clock::time_point start_;
+        double elapsed_us_ = 0;
+};
+
+// Latency samples in microseconds. Call sort() once all are in, before
+// asking for percentiles.
+class Samples {
+    public:
+        void add(double us) { values_.push_back(us); }
+        void reserve(size_t count) { values_.reserve(count); }
+        void merge(const Samples& other) { values_.insert(values_.end(), other.values_.begin(), other.values_.end()); }
+        void sort() { std::sort(values_.begin(), values_.end()); }
+
+        size_t count() const { return values_.size(); }
+        double min() const { return values_.empty() ? 0 : values_.front(); }
+        double max() const { return values_.empty() ? 0 : values_.back(); }
+
+        double mean() const {
+            double sum = 0;
+            for (double value : values_) {
+                sum += value;
+            }
+            return values_.empty() ? 0 : sum / values_.size();
+        }
+
+        // Nearest-rank percentile, q in [0, 1]
+        double percentile(double q) const {
+            if (values_.empty()) {
+                return 0;
+            }
+            size_t rank = (size_t)std::ceil(q * values_.size());
+            return values_[std::min(values_.size(), std::max<size_t>(rank, 1)) - 1];
+        }
+
+    private:
+        std::vector<double> values_;
+};
+
+// Parses a byte count with an optional binary suffix: 4096, 4k, 16M, 1g
+inline uint64_t parseSize(const std::string& text) {
+    size_t end = 0;
+    uint64_t value = std::stoull(text, &end);
+    if (end == text.size()) {
+        return value;
+    }
+    if (end + 1 != text.size()) {
+        throw std::invalid_argument(text);
+    }
+    switch (text[end]) {
+        case 'k': case 'K': return value << 10;
+        case 'm': case 'M': return value << 20;
+        case 'g': case 'G': return value << 30;
+        default: throw std::invalid_argument(text);
+    }
+}
+
+// Splits "--name=value" into its parts; false for anything else
+inline bool splitOption(const std::string& arg, std::string* name, std::string* value) {
+    size_t eq = arg.find('=');
+    if (arg.compare(0, 2, "--") != 0 || eq == std::string::npos) {
+        return false;
+    }
+    *name  = arg.substr(2, eq - 2);
+    *value = arg.substr(eq + 1);
+    return true;
+}
+
+// Splits a comma-separated list
+inline std::vector<std::string> splitList(const std::string& text) {
+    std::vector<std::string> items;
+    size_t start = 0;
+    while (start <= text.size()) {
+        size_t comma = text.find(',', start);
+        if (comma == std::string::npos) {
+            comma = text.size();
+        }
+        if (comma > start) {
+            items.push_back(text.substr(start, comma - start));
+        }
+        start = comma + 1;
+    }
+    return items;
+}
+
+// text as a JSON string literal, control characters escaped
+inline std::string jsonString(const std::string& text) {
+    std::string out = "\"";
+    for (char c : text) {
+        switch (c) {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\b': out += "\\b"; break;
+            case '\f': out += "\\f"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if ((unsigned char)c < 0x20) {
+                    char escaped[7];
+                    snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char)c);
+                    out += escaped;
+                } else {
+                    out += c;
+                }
+        }
+    }
+    return out + "\"";
+}
+
+// rm -r, best effort
+inline void removeTree(const std::string& path) {
+    DIR* dir = opendir(path.c_str());
+    if (dir) {
+        while (struct dirent* entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            if (name == "." || name == "..") {
+                continue;
+            }
+            std::string child = path + "/" + name;
+            struct stat st;
+            if (lstat(child.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+                removeTree(child);
+            } else {
+                unlink(child.c_str());
+            }
+        }
+        closedir(dir);
+    }
+    rmdir(path.c_str());
+}
+
+} // namespace bench
+
+#endif // NFS_BENCH_UTIL_H
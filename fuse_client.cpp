@@ -1,201 +1,584 @@
-#include <iostream>
+// Latency benchmark for a mounted FUSE file system. Times getattr, mkdir,
+// rmdir, create, open, read, readdir and unlink against a scratch directory
+// under the mount, with warm caches (the same targets accessed over and
+// over) and cold ones (caches dropped before every timed call), and reports
+// min/mean/p50/p90/p99/max per op as a table, JSON or CSV.
+//
+//   fuse_client [options] <mount_path>
+//   fuse_client --compare <baseline> <candidate> [--threshold=PCT] [--min_delta_us=N]
+//
+// Compare mode diffs two result files written by --format=json or csv and
+// exits with status 1 if any op's p50 or p99 got slower by more than the
+// threshold, so a deploy can be gated on it.
+
+#include <algorithm>
+#include <cerrno>
 #include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
 #include <fcntl.h>
-#include <unistd.h>
 #include <sys/stat.h>
-#include <dirent.h>
-
-// Measure latency of `getattr` operation
-double measureGetattrLatency(const char* filePath) {
-    struct stat st;
-
-    auto start = std::chrono::high_resolution_clock::now();
-    int result = stat(filePath, &st);
-    auto end = std::chrono::high_resolution_clock::now();
+#include <unistd.h>
+#include "bench_util.h"
+
+using namespace std;
+using bench::Timer;
+
+struct BenchOptions {
+    string mount;
+    int    iterations    = 100;
+    int    warmup        = 10;   // Untimed calls before each warm run
+    size_t read_size     = 4096;
+    int    dir_entries   = 100;  // Entries in the directory readdir lists
+    bool   warm          = true;
+    bool   cold          = true;
+    int    cold_delay_ms = 0;    // Wait after dropping caches, to outlast the client's attribute TTL
+    vector<string> ops;          // Empty for all
+    string format        = "text";
+    string output;               // Empty for stdout
+    string label;
+};
+
+// One benchmarked operation. setup and teardown run untimed around each
+// run; all three get the iteration number, so ops that use up their target
+// (rmdir, unlink) or leave one behind (mkdir, create) get a fresh one each
+// time. Each returns 0 or an errno.
+struct Op {
+    string name;
+    function<int(int)> setup;
+    function<int(int, Timer&)> run;
+    function<int(int)> teardown;
+};
+
+// Latency samples of one op in one cache mode
+struct OpResult {
+    string op;
+    string cache;
+    bench::Samples samples;
+    int errors = 0;
+};
+
+static int errnoOf(int result) {
+    return result < 0 ? errno : 0;
+}
 
-    if (result != 0) {
-        std::cerr << "Failed to get attributes for: " << filePath << std::endl;
-        return -1.0;
+static int createFile(const string& path, size_t size) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return errno;
     }
-
-    std::chrono::duration<double, std::milli> latency = end - start;
-    return latency.count();
+    string data(size, 'x');
+    int error = write(fd, data.data(), data.size()) == (ssize_t)data.size() ? 0 : EIO;
+    close(fd);
+    return error;
 }
 
-// Measure latency of `mkdir` operation
-double measureMkdirLatency(const char* dirPath, mode_t mode = 0755) {
-    auto start = std::chrono::high_resolution_clock::now();
-    int result = mkdir(dirPath, mode);
-    auto end = std::chrono::high_resolution_clock::now();
-
-    if (result != 0) {
-        std::cerr << "Failed to create directory: " << dirPath << std::endl;
-        return -1.0;
+// Drops what the kernel caches under the mount: file pages always, dentries
+// and inodes as well when /proc/sys/vm/drop_caches is writable (root)
+static void dropCaches(const vector<string>& files, int delay_ms) {
+    static bool can_drop = true;
+    sync();
+    if (can_drop) {
+        ofstream drop("/proc/sys/vm/drop_caches");
+        drop << "3" << endl;
+        if (!drop) {
+            can_drop = false;
+            cerr << "Cannot write /proc/sys/vm/drop_caches, cold runs only drop file pages" << endl;
+        }
+    }
+    for (const string& file : files) {
+        int fd = open(file.c_str(), O_RDONLY);
+        if (fd >= 0) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+    }
+    if (delay_ms > 0) {
+        this_thread::sleep_for(chrono::milliseconds(delay_ms));
     }
-
-    std::chrono::duration<double, std::milli> latency = end - start;
-    return latency.count();
 }
 
-// Measure latency of `unlink` operation
-double measureUnlinkLatency(const char* filePath) {
-    auto start = std::chrono::high_resolution_clock::now();
-    int result = unlink(filePath);
-    auto end = std::chrono::high_resolution_clock::now();
+static vector<Op> makeOps(const BenchOptions& options, const string& root) {
+    string file = root + "/file";
+    string list = root + "/list";
+    size_t read_size = options.read_size;
+    auto target = [root](const char* prefix, int i) { return root + "/" + prefix + to_string(i); };
+    auto none = [](int) { return 0; };
+
+    vector<Op> ops;
+    ops.push_back({"getattr", none, [file](int, Timer& timer) {
+        struct stat st;
+        timer.start();
+        int result = stat(file.c_str(), &st);
+        timer.stop();
+        return errnoOf(result);
+    }, none});
+
+    ops.push_back({"mkdir", none, [target](int i, Timer& timer) {
+        string path = target("mkdir", i);
+        timer.start();
+        int result = mkdir(path.c_str(), 0755);
+        timer.stop();
+        return errnoOf(result);
+    }, [target](int i) {
+        return errnoOf(rmdir(target("mkdir", i).c_str()));
+    }});
+
+    ops.push_back({"rmdir", [target](int i) {
+        return errnoOf(mkdir(target("rmdir", i).c_str(), 0755));
+    }, [target](int i, Timer& timer) {
+        string path = target("rmdir", i);
+        timer.start();
+        int result = rmdir(path.c_str());
+        timer.stop();
+        return errnoOf(result);
+    }, none});
+
+    ops.push_back({"create", none, [target](int i, Timer& timer) {
+        string path = target("create", i);
+        timer.start();
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+        timer.stop();
+        if (fd < 0) {
+            return errno;
+        }
+        close(fd);
+        return 0;
+    }, [target](int i) {
+        return errnoOf(unlink(target("create", i).c_str()));
+    }});
+
+    ops.push_back({"open", none, [file](int, Timer& timer) {
+        timer.start();
+        int fd = open(file.c_str(), O_RDONLY);
+        timer.stop();
+        if (fd < 0) {
+            return errno;
+        }
+        close(fd);
+        return 0;
+    }, none});
+
+    ops.push_back({"read", none, [file, read_size](int, Timer& timer) {
+        vector<char> buffer(read_size);
+        int fd = open(file.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return errno;
+        }
+        timer.start();
+        ssize_t n = pread(fd, buffer.data(), read_size, 0);
+        timer.stop();
+        int error = n < 0 ? errno : 0;
+        close(fd);
+        return error;
+    }, none});
+
+    ops.push_back({"readdir", none, [list](int, Timer& timer) {
+        timer.start();
+        DIR* dir = opendir(list.c_str());
+        if (!dir) {
+            return errno;
+        }
+        while (readdir(dir) != nullptr) {
+        }
+        closedir(dir);
+        timer.stop();
+        return 0;
+    }, none});
+
+    ops.push_back({"unlink", [target](int i) {
+        return createFile(target("unlink", i), 0);
+    }, [target](int i, Timer& timer) {
+        string path = target("unlink", i);
+        timer.start();
+        int result = unlink(path.c_str());
+        timer.stop();
+        return errnoOf(result);
+    }, none});
+    return ops;
+}
 
-    if (result != 0) {
-        std::cerr << "Failed to unlink file: " << filePath << std::endl;
-        return -1.0;
+// Creates the file the read-only ops use and the directory readdir lists
+static int prepareRoot(const BenchOptions& options, const string& root) {
+    if (mkdir(root.c_str(), 0755) != 0 && errno != EEXIST) {
+        return errno;
     }
-
-    std::chrono::duration<double, std::milli> latency = end - start;
-    return latency.count();
+    int error = createFile(root + "/file", options.read_size);
+    if (error != 0) {
+        return error;
+    }
+    string list = root + "/list";
+    if (mkdir(list.c_str(), 0755) != 0 && errno != EEXIST) {
+        return errno;
+    }
+    for (int i = 0; i < options.dir_entries; i++) {
+        error = createFile(list + "/entry" + to_string(i), 0);
+        if (error != 0) {
+            return error;
+        }
+    }
+    return 0;
 }
 
-// Measure latency of `rmdir` operation
-double measureRmdirLatency(const char* dirPath) {
-    auto start = std::chrono::high_resolution_clock::now();
-    int result = rmdir(dirPath);
-    auto end = std::chrono::high_resolution_clock::now();
-
-    if (result != 0) {
-        std::cerr << "Failed to remove directory: " << dirPath << std::endl;
-        return -1.0;
+static OpResult runOp(const Op& op, const BenchOptions& options, const string& root, bool cold, int* next_index) {
+    OpResult result;
+    result.op    = op.name;
+    result.cache = cold ? "cold" : "warm";
+    vector<string> files = {root + "/file", root + "/list"};
+
+    int rounds = options.iterations + (cold ? 0 : options.warmup);
+    for (int round = 0; round < rounds; round++) {
+        int i = (*next_index)++;
+        int error = op.setup(i);
+        if (error == 0) {
+            if (cold) {
+                dropCaches(files, options.cold_delay_ms);
+            }
+            Timer timer;
+            error = op.run(i, timer);
+            if (error == 0 && round >= rounds - options.iterations) {
+                result.samples.add(timer.elapsedUs());
+            }
+            int cleanup = op.teardown(i);
+            error = error ? error : cleanup;
+        }
+        if (error != 0) {
+            if (result.errors++ == 0) {
+                cerr << op.name << " (" << result.cache << ") failed: " << strerror(error) << endl;
+            }
+        }
     }
-
-    std::chrono::duration<double, std::milli> latency = end - start;
-    return latency.count();
+    result.samples.sort();
+    return result;
 }
 
-// Measure latency of `open` operation
-double measureOpenLatency(const char* filePath) {
-    auto start = std::chrono::high_resolution_clock::now();
-    int fd = open(filePath, O_RDONLY);
-    auto end = std::chrono::high_resolution_clock::now();
-
-    if (fd == -1) {
-        std::cerr << "Failed to open file: " << filePath << std::endl;
-        return -1.0;
+static void writeText(ostream& out, const BenchOptions& options, const vector<OpResult>& results) {
+    out << "Latency in microseconds, " << options.iterations << " iterations per op";
+    if (!options.label.empty()) {
+        out << " (" << options.label << ")";
+    }
+    out << endl;
+    out << left << setw(10) << "op" << setw(6) << "cache" << right;
+    for (const char* column : {"min", "mean", "p50", "p90", "p99", "max"}) {
+        out << setw(11) << column;
+    }
+    out << setw(8) << "errors" << endl;
+    out << fixed << setprecision(1);
+    for (const OpResult& result : results) {
+        out << left << setw(10) << result.op << setw(6) << result.cache << right
+            << setw(11) << result.samples.min() << setw(11) << result.samples.mean() << setw(11) << result.samples.percentile(0.5)
+            << setw(11) << result.samples.percentile(0.9) << setw(11) << result.samples.percentile(0.99) << setw(11) << result.samples.max()
+            << setw(8) << result.errors << endl;
     }
-    close(fd);
-
-    std::chrono::duration<double, std::milli> latency = end - start;
-    return latency.count();
 }
 
-// Measure latency of `read` operation
-double measureReadLatency(const char* filePath, size_t bufferSize) {
-    char buffer[bufferSize];
-
-    int fd = open(filePath, O_RDONLY);
-    if (fd == -1) {
-        std::cerr << "Failed to open file: " << filePath << std::endl;
-        return -1.0;
+// One result per line, which keeps the files diffable and simple to read back
+static void writeJson(ostream& out, const BenchOptions& options, const vector<OpResult>& results) {
+    out << fixed << setprecision(3);
+    out << "{\"label\": " << bench::jsonString(options.label) << ", \"mount\": " << bench::jsonString(options.mount)
+        << ", \"iterations\": " << options.iterations << ", \"read_size\": " << options.read_size << ", \"results\": [" << endl;
+    for (size_t i = 0; i < results.size(); i++) {
+        const OpResult& result = results[i];
+        out << "  {\"op\": " << bench::jsonString(result.op) << ", \"cache\": " << bench::jsonString(result.cache)
+            << ", \"count\": " << result.samples.count() << ", \"errors\": " << result.errors
+            << ", \"min_us\": " << result.samples.min() << ", \"mean_us\": " << result.samples.mean()
+            << ", \"p50_us\": " << result.samples.percentile(0.5) << ", \"p90_us\": " << result.samples.percentile(0.9)
+            << ", \"p99_us\": " << result.samples.percentile(0.99) << ", \"max_us\": " << result.samples.max() << "}"
+            << (i + 1 < results.size() ? "," : "") << endl;
     }
+    out << "]}" << endl;
+}
 
-    auto start = std::chrono::high_resolution_clock::now();
-    ssize_t bytesRead = read(fd, buffer, bufferSize);
-    auto end = std::chrono::high_resolution_clock::now();
-
-    close(fd);
-
-    if (bytesRead < 0) {
-        return -1.0;
+static void writeCsv(ostream& out, const vector<OpResult>& results) {
+    out << fixed << setprecision(3);
+    out << "op,cache,count,errors,min_us,mean_us,p50_us,p90_us,p99_us,max_us" << endl;
+    for (const OpResult& result : results) {
+        out << result.op << "," << result.cache << "," << result.samples.count() << "," << result.errors << ","
+            << result.samples.min() << "," << result.samples.mean() << "," << result.samples.percentile(0.5) << ","
+            << result.samples.percentile(0.9) << "," << result.samples.percentile(0.99) << "," << result.samples.max() << endl;
     }
-
-    std::chrono::duration<double, std::milli> latency = end - start;
-    return latency.count();
 }
 
-// Measure latency of `readdir` operation
-double measureReaddirLatency(const char* dirPath) {
-    auto start = std::chrono::high_resolution_clock::now();
-    DIR* dir = opendir(dirPath);
-    if (!dir) {
-        std::cerr << "Failed to open directory: " << dirPath << std::endl;
-        return -1.0;
+// Reads a results file back as one map of column to value per result,
+// keyed by "op/cache". Accepts what writeJson and writeCsv produce.
+static map<string, map<string, string>> readResults(const string& path) {
+    ifstream in(path);
+    if (!in) {
+        throw runtime_error("cannot read " + path);
     }
-
-    struct dirent* entry;
-    while ((entry = readdir(dir)) != nullptr) {
-        // Process directory entry here if needed
+    map<string, map<string, string>> results;
+    string line;
+    if (in.peek() == '{') {
+        while (getline(in, line)) {
+            size_t open = line.find('{');
+            if (line.find("\"op\"") == string::npos || open == string::npos) {
+                continue;
+            }
+            map<string, string> fields;
+            size_t pos = open + 1;
+            while (true) {
+                size_t key_start = line.find('"', pos);
+                if (key_start == string::npos) {
+                    break;
+                }
+                size_t key_end = line.find('"', key_start + 1);
+                size_t colon = key_end == string::npos ? string::npos : line.find(':', key_end);
+                size_t value_start = colon == string::npos ? string::npos : line.find_first_not_of(' ', colon + 1);
+                if (value_start == string::npos) {
+                    throw runtime_error("malformed result in " + path + ": " + line);
+                }
+                size_t value_end;
+                string value;
+                if (line[value_start] == '"') {
+                    // Escaped characters are kept as written, but never end the string
+                    value_end = value_start + 1;
+                    while (value_end < line.size() && line[value_end] != '"') {
+                        value_end += line[value_end] == '\\' ? 2 : 1;
+                    }
+                    if (value_end >= line.size()) {
+                        throw runtime_error("malformed result in " + path + ": " + line);
+                    }
+                    value = line.substr(value_start + 1, value_end - value_start - 1);
+                    value_end++;
+                } else {
+                    value_end = line.find_first_of(",}", value_start);
+                    value = line.substr(value_start, value_end - value_start);
+                }
+                fields[line.substr(key_start + 1, key_end - key_start - 1)] = value;
+                pos = value_end;
+            }
+            results[fields["op"] + "/" + fields["cache"]] = fields;
+        }
+    } else {
+        vector<string> columns;
+        while (getline(in, line)) {
+            vector<string> cells;
+            stringstream row(line);
+            for (string cell; getline(row, cell, ',');) {
+                cells.push_back(cell);
+            }
+            if (columns.empty()) {
+                columns = cells;
+                continue;
+            }
+            map<string, string> fields;
+            for (size_t i = 0; i < cells.size() && i < columns.size(); i++) {
+                fields[columns[i]] = cells[i];
+            }
+            results[fields["op"] + "/" + fields["cache"]] = fields;
+        }
     }
-    closedir(dir);
+    return results;
+}
 
-    auto end = std::chrono::high_resolution_clock::now();
-    std::chrono::duration<double, std::milli> latency = end - start;
-    return latency.count();
+// Prints how candidate differs from baseline and returns the number of
+// regressions: a p50 or p99 more than threshold_pct slower, by at least
+// min_delta_us so sub-microsecond jitter on fast ops does not count
+// A numeric field of one result, fallback if the file does not have it
+static double resultField(const map<string, string>& fields, const char* name, double fallback) {
+    auto it = fields.find(name);
+    return it == fields.end() ? fallback : atof(it->second.c_str());
 }
 
-// Measure latency of `create` operation
-double measureCreateLatency(const char* filePath, mode_t mode = 0644) {
-    auto start = std::chrono::high_resolution_clock::now();
-    int fd = open(filePath, O_WRONLY | O_CREAT | O_TRUNC, mode);
-    auto end = std::chrono::high_resolution_clock::now();
+// An op that stopped succeeding, or fails more often, regresses whatever its
+// latency did: a run where every call failed reports percentiles of 0
+static int compareResults(const string& baseline_path, const string& candidate_path, double threshold_pct, double min_delta_us) {
+    map<string, map<string, string>> baseline  = readResults(baseline_path);
+    map<string, map<string, string>> candidate = readResults(candidate_path);
 
-    if (fd == -1) {
-        std::cerr << "Failed to create file: " << filePath << std::endl;
-        return -1.0;
+    int regressions = 0;
+    cout << left << setw(16) << "op/cache" << right;
+    for (const char* column : {"base p50", "new p50", "delta", "base p99", "new p99", "delta"}) {
+        cout << setw(11) << column;
     }
-    close(fd);
-
-    std::chrono::duration<double, std::milli> latency = end - start;
-    return latency.count();
+    cout << endl << fixed << setprecision(1);
+    for (const auto& entry : baseline) {
+        auto match = candidate.find(entry.first);
+        if (match == candidate.end()) {
+            cout << left << setw(16) << entry.first << "  missing from " << candidate_path << endl;
+            regressions++;
+            continue;
+        }
+        cout << left << setw(16) << entry.first << right;
+        bool regressed = false;
+        for (const char* metric : {"p50_us", "p99_us"}) {
+            double before = atof(entry.second.at(metric).c_str());
+            double after  = atof(match->second.at(metric).c_str());
+            double delta_pct = before > 0 ? (after - before) * 100 / before : 0;
+            cout << setw(11) << before << setw(11) << after << setw(10) << showpos << delta_pct << noshowpos << "%";
+            if (delta_pct > threshold_pct && after - before >= min_delta_us) {
+                regressed = true;
+            }
+        }
+        double count         = resultField(match->second, "count", 1);
+        double errors_before = resultField(entry.second, "errors", 0);
+        double errors_after  = resultField(match->second, "errors", 0);
+        if (count == 0) {
+            cout << "  no successful calls";
+            regressed = true;
+        } else if (errors_after > errors_before) {
+            cout << "  errors " << setprecision(0) << errors_before << " -> " << errors_after << setprecision(1);
+            regressed = true;
+        }
+        if (regressed) {
+            cout << "  REGRESSION";
+            regressions++;
+        }
+        cout << endl;
+    }
+    for (const auto& entry : candidate) {
+        if (baseline.find(entry.first) == baseline.end()) {
+            cout << left << setw(16) << entry.first << "  new, not in " << baseline_path << endl;
+        }
+    }
+    cout << regressions << " regression(s): latency beyond " << threshold_pct << "%, failed ops or more errors" << endl;
+    return regressions;
 }
 
-int main() {
-    const char* testDirPath = "./mnt/testdir";
-    const char* testExistFilePath = "./mnt/1255";
-    const char* testFilePath = "./mnt/testdir/testfile";
-    const size_t bufferSize = 4096;
+static void usage(const char* program) {
+    cerr << "Usage: " << program << " [--iterations=N] [--warmup=N] [--read_size=BYTES] [--dir_entries=N]"
+         << " [--cache=warm|cold|both] [--cold_delay_ms=N] [--ops=getattr,mkdir,...]"
+         << " [--format=text|json|csv] [--output=FILE] [--label=TEXT] <mount_path>" << endl
+         << "       " << program << " --compare <baseline> <candidate> [--threshold=PCT] [--min_delta_us=N]" << endl;
+}
 
-    // Test getattr
-    double getattrLatency = measureGetattrLatency(testExistFilePath);
-    if (getattrLatency >= 0) {
-        std::cout << "Getattr latency: " << getattrLatency << " ms" << std::endl;
+int main(int argc, char** argv) {
+    BenchOptions options;
+    vector<string> positional;
+    bool compare = false;
+    double threshold_pct = 10;
+    double min_delta_us  = 5;
+
+    try {
+        for (int i = 1; i < argc; i++) {
+            string arg = argv[i];
+            if (arg == "--compare") {
+                compare = true;
+                continue;
+            }
+            if (arg.compare(0, 2, "--") != 0) {
+                positional.push_back(arg);
+                continue;
+            }
+            string name, value;
+            if (!bench::splitOption(arg, &name, &value)) {
+                throw invalid_argument(arg);
+            }
+            if (name == "iterations") {
+                options.iterations = stoi(value);
+            } else if (name == "warmup") {
+                options.warmup = stoi(value);
+            } else if (name == "read_size") {
+                options.read_size = bench::parseSize(value);
+            } else if (name == "dir_entries") {
+                options.dir_entries = stoi(value);
+            } else if (name == "cache") {
+                if (value != "warm" && value != "cold" && value != "both") {
+                    throw invalid_argument(value);
+                }
+                options.warm = value != "cold";
+                options.cold = value != "warm";
+            } else if (name == "cold_delay_ms") {
+                options.cold_delay_ms = stoi(value);
+            } else if (name == "ops") {
+                options.ops = bench::splitList(value);
+            } else if (name == "format") {
+                if (value != "text" && value != "json" && value != "csv") {
+                    throw invalid_argument(value);
+                }
+                options.format = value;
+            } else if (name == "output") {
+                options.output = value;
+            } else if (name == "label") {
+                options.label = value;
+            } else if (name == "threshold") {
+                threshold_pct = stod(value);
+            } else if (name == "min_delta_us") {
+                min_delta_us = stod(value);
+            } else {
+                throw invalid_argument(arg);
+            }
+        }
+    } catch (const exception& e) {
+        cerr << "Bad option: " << e.what() << endl;
+        usage(argv[0]);
+        return 2;
     }
 
-    // Test mkdir
-    double mkdirLatency = measureMkdirLatency(testDirPath);
-    if (mkdirLatency >= 0) {
-        std::cout << "Mkdir latency: " << mkdirLatency << " ms" << std::endl;
+    if (compare) {
+        if (positional.size() != 2) {
+            usage(argv[0]);
+            return 2;
+        }
+        try {
+            return compareResults(positional[0], positional[1], threshold_pct, min_delta_us) > 0 ? 1 : 0;
+        } catch (const exception& e) {
+            cerr << e.what() << endl;
+            return 2;
+        }
     }
 
-    // Test create
-    double createLatency = measureCreateLatency(testFilePath);
-    if (createLatency >= 0) {
-        std::cout << "Create latency: " << createLatency << " ms" << std::endl;
+    if (positional.size() != 1 || options.iterations <= 0) {
+        usage(argv[0]);
+        return 2;
     }
-
-    // Test open
-    double openLatency = measureOpenLatency(testFilePath);
-    if (openLatency >= 0) {
-        std::cout << "Open latency: " << openLatency << " ms" << std::endl;
+    options.mount = positional[0];
+
+    string root = options.mount + "/.fuse_bench." + to_string(getpid());
+    int error = prepareRoot(options, root);
+    if (error != 0) {
+        cerr << "Cannot prepare " << root << ": " << strerror(error) << endl;
+        bench::removeTree(root);
+        return 1;
     }
 
-    // Test read
-    double readLatency = measureReadLatency(testExistFilePath, bufferSize);
-    if (readLatency >= 0) {
-        std::cout << "Read latency: " << readLatency << " ms" << std::endl;
+    vector<OpResult> results;
+    int next_index = 0;
+    for (const Op& op : makeOps(options, root)) {
+        if (!options.ops.empty() && find(options.ops.begin(), options.ops.end(), op.name) == options.ops.end()) {
+            continue;
+        }
+        if (options.warm) {
+            results.push_back(runOp(op, options, root, false, &next_index));
+        }
+        if (options.cold) {
+            results.push_back(runOp(op, options, root, true, &next_index));
+        }
     }
-
-    // Test readdir
-    double readdirLatency = measureReaddirLatency(testDirPath);
-    if (readdirLatency >= 0) {
-        std::cout << "Readdir latency: " << readdirLatency << " ms" << std::endl;
+    bench::removeTree(root);
+
+    ofstream file;
+    if (!options.output.empty()) {
+        file.open(options.output);
+        if (!file) {
+            cerr << "Cannot write " << options.output << endl;
+            return 1;
+        }
     }
-
-    // Test unlink
-    double unlinkLatency = measureUnlinkLatency(testFilePath);
-    if (unlinkLatency >= 0) {
-        std::cout << "Unlink latency: " << unlinkLatency << " ms" << std::endl;
+    ostream& out = options.output.empty() ? cout : file;
+    if (options.format == "json") {
+        writeJson(out, options, results);
+    } else if (options.format == "csv") {
+        writeCsv(out, results);
+    } else {
+        writeText(out, options, results);
     }
 
-    // Test rmdir
-    double rmdirLatency = measureRmdirLatency(testDirPath);
-    if (rmdirLatency >= 0) {
-        std::cout << "Rmdir latency: " << rmdirLatency << " ms" << std::endl;
+    for (const OpResult& result : results) {
+        if (result.errors > 0) {
+            return 1;
+        }
     }
-
     return 0;
 }
@@ -6,8 +6,24 @@
 #include <chrono>
 #include <grpcpp/grpcpp.h>
 #include <fuse3/fuse.h>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
 #include "grpc_service.grpc.pb.h"
+#include "logging.h"
+#include "compression.h"
+#include "histogram.h"
+#include "rpc_limits.h"
 #include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <random>
+#include <unordered_map>
+#include <vector>
 
 using grpc::Channel;
 using grpc::ClientContext;
@@ -15,303 +31,1717 @@ using grpc::Status;
 using namespace grpc_service;
 using namespace std;
 
-#define RUN_SYNC true
+// How nfs_write reaches the server
+enum class WriteMode {
+    Sync,      // One NfsWrite per FUSE write, applied before we return
+    WriteBack, // NfsWriteAsync, buffered on the server until release
+    Stream,    // One NfsWriteStream per open file, committed on flush/release
+};
+
+// How ChannelPool spreads calls over a lane's channels
+enum class ChannelSelect {
+    Thread,      // Each thread sticks to one channel
+    LeastLoaded, // The channel with the fewest calls in flight
+};
+
+// Tunables given on the command line after the server address
+struct ClientOptions {
+    size_t page_cache_bytes = 128 * 1024 * 1024; // 0 disables the page cache
+    size_t page_size        = 64 * 1024;
+    int    attr_ttl_ms      = 1000; // Client and kernel attribute cache lifetime, 0 disables
+    WriteMode write_mode    = WriteMode::Sync;
+    size_t stream_threshold = 1024 * 1024; // Reads this large use NfsReadStream, 0 disables
+    size_t stream_chunk     = 256 * 1024;
+    size_t readahead_max    = 2 * 1024 * 1024; // Largest prefetch window, 0 disables readahead
+    int    readahead_threads = 4;
+    bool   buf_ops          = true; // Register read_buf/write_buf and ask for splice
+    bool   readdir_plus     = true; // List directories with NfsReadDirPlus
+    int    readdir_page     = 1024; // Entries per readdir RPC, 0 for the whole directory at once
+    bool   compound         = true; // Fold metadata calls and their getattr into one NfsCompound
+    bool   handles          = false; // Address entries by NfsLookup directory handle and name
+    int    handle_ttl_ms    = 5000; // Lifetime of a cached directory handle
+    int    data_channels    = 4; // Connections for reads and writes
+    int    metadata_channels = 1; // Connections for everything else
+    ChannelSelect channel_select = ChannelSelect::Thread; // How a call picks its data channel
+    bool   adaptive_deadlines = true; // Size deadlines from observed latency instead of a flat maximum
+    int    deadline_min_ms  = 20;   // Shortest deadline an adaptive call gets
+    int    deadline_max_ms  = 1000; // Deadline before enough latency samples, and the adaptive cap
+    bool   hedge            = false; // Reissue slow getattr, read and readdir calls after their p95
+    int    retry_budget     = 100;  // Tokens of RetryBudget, 0 disables retries
+    nfscompress::Policy compression; // Algorithm and limits for read and write payloads, off by default
+};
+
+// Block-granular cache of file contents shared by all open files. Pages have a
+// fixed size and are evicted least-recently-used once the byte budget is
+// exceeded. A file's pages are kept across opens only while the size and mtime
+// the server reports at open time are unchanged (NFS close-to-open semantics).
+// A file's entry goes with its last page, so only files with cached data cost
+// memory; fills are checked against a cache-wide epoch, which outlives them.
+class PageCache {
+    private:
+        struct Page {
+            string   path;
+            uint64_t index;
+            string   data; // Shorter than a page only at end of file
+        };
+        using PageList = list<Page>;
+
+        struct FileEntry {
+            int64_t  size       = -1;
+            int64_t  mtime_ns   = -1;
+            uint64_t invalidated = 0; // epoch_ at the last invalidation; fills begun before it are dropped
+            unordered_map<uint64_t, PageList::iterator> pages;
+        };
+
+        size_t budget_;
+        size_t page_size_;
+        size_t used_ = 0;
+        PageList lru_; // Most recently used at the front
+        unordered_map<string, FileEntry> files_;
+        uint64_t epoch_     = 0; // Counts invalidations, generations are values of it
+        uint64_t forgotten_ = 0; // Latest invalidation of an erased entry
+        mutex mutex_;
+        atomic<uint64_t> hits_{0};
+        atomic<uint64_t> misses_{0};
+
+        void erasePage(FileEntry& entry, unordered_map<uint64_t, PageList::iterator>::iterator it) {
+            used_ -= it->second->data.size();
+            lru_.erase(it->second);
+            entry.pages.erase(it);
+        }
+
+        void dropPages(FileEntry& entry) {
+            for (auto& page : entry.pages) {
+                used_ -= page.second->data.size();
+                lru_.erase(page.second);
+            }
+            entry.pages.clear();
+            entry.invalidated = ++epoch_;
+        }
+
+        // With no entry to check, a fill must not predate any erased one's invalidation
+        void eraseFile(unordered_map<string, FileEntry>::iterator file) {
+            forgotten_ = max(forgotten_, file->second.invalidated);
+            files_.erase(file);
+        }
+
+        void evictToBudget() {
+            while (used_ > budget_ && !lru_.empty()) {
+                Page& victim = lru_.back();
+                auto file = files_.find(victim.path);
+                used_ -= victim.data.size();
+                file->second.pages.erase(victim.index);
+                lru_.pop_back();
+                if (file->second.pages.empty()) {
+                    eraseFile(file);
+                }
+            }
+        }
+
+    public:
+        PageCache(size_t budget_bytes, size_t page_size) : budget_(budget_bytes), page_size_(page_size) {}
+
+        bool enabled() const { return budget_ > 0 && page_size_ > 0; }
+        size_t pageSize() const { return page_size_; }
+        uint64_t hits() const { return hits_.load(); }
+        uint64_t misses() const { return misses_.load(); }
+
+        // Called on open with the server's current view of the file
+        void revalidate(const string& path, int64_t size, int64_t mtime_ns) {
+            lock_guard<mutex> lock(mutex_);
+            FileEntry& entry = files_[path];
+            if (entry.size != size || entry.mtime_ns != mtime_ns) {
+                dropPages(entry);
+                entry.size     = size;
+                entry.mtime_ns = mtime_ns;
+            }
+            // Files opened and never read leave pageless entries. Sweep them
+            // once they far outnumber the pages, which keeps the sweeps to
+            // O(1) per open on average.
+            if (files_.size() > lru_.size() * 2 + 1024) {
+                for (auto it = files_.begin(); it != files_.end();) {
+                    auto following = next(it);
+                    if (it->second.pages.empty() && it->first != path) {
+                        eraseFile(it);
+                    }
+                    it = following;
+                }
+            }
+        }
+
+        // Take before fetching data to fill with
+        uint64_t generation() {
+            lock_guard<mutex> lock(mutex_);
+            return epoch_;
+        }
+
+        // Copies [offset, offset + size) into buf if every page it touches is
+        // cached. Returns the bytes copied (short at end of file) or -1 on a miss.
+        ssize_t read(const string& path, char* buf, size_t size, off_t offset) {
+            if (size == 0) {
+                return 0;
+            }
+            lock_guard<mutex> lock(mutex_);
+            auto file = files_.find(path);
+            if (file == files_.end()) {
+                misses_++;
+                return -1;
+            }
+            FileEntry& entry = file->second;
+
+            uint64_t first = offset / page_size_;
+            uint64_t last  = (offset + size - 1) / page_size_;
+            for (uint64_t index = first; index <= last; index++) {
+                auto it = entry.pages.find(index);
+                if (it == entry.pages.end()) {
+                    misses_++;
+                    return -1;
+                }
+                if (it->second->data.size() < page_size_) {
+                    last = index; // End of file, later pages cannot exist
+                }
+            }
+
+            size_t copied = 0;
+            for (uint64_t index = first; index <= last && copied < size; index++) {
+                PageList::iterator page = entry.pages[index];
+                lru_.splice(lru_.begin(), lru_, page);
+
+                size_t in_page = (offset + copied) - index * page_size_;
+                if (in_page >= page->data.size()) {
+                    break;
+                }
+                size_t n = min(size - copied, page->data.size() - in_page);
+                memcpy(buf + copied, page->data.data() + in_page, n);
+                copied += n;
+            }
+            hits_++;
+            return copied;
+        }
+
+        // True if every page of [offset, offset + size) is cached. Does not
+        // count as a hit or touch the LRU order.
+        bool cached(const string& path, off_t offset, size_t size) {
+            lock_guard<mutex> lock(mutex_);
+            auto file = files_.find(path);
+            if (file == files_.end()) {
+                return false;
+            }
+            uint64_t last = (offset + max<size_t>(size, 1) - 1) / page_size_;
+            for (uint64_t index = offset / page_size_; index <= last; index++) {
+                auto it = file->second.pages.find(index);
+                if (it == file->second.pages.end()) {
+                    return false;
+                }
+                if (it->second->data.size() < page_size_) {
+                    return true; // End of file
+                }
+            }
+            return true;
+        }
+
+        // Stores data read from a page-aligned offset. A short tail marks end of
+        // file. Dropped if the file was invalidated since generation was taken.
+        void fill(const string& path, uint64_t generation, off_t offset, const string& data) {
+            fill(path, generation, offset, data.data(), data.size());
+        }
+
+        void fill(const string& path, uint64_t generation, off_t offset, const char* data, size_t size) {
+            lock_guard<mutex> lock(mutex_);
+            auto file = files_.find(path);
+            if ((file == files_.end() ? forgotten_ : file->second.invalidated) > generation) {
+                return;
+            }
+            FileEntry& entry = file == files_.end() ? files_[path] : file->second;
+
+            uint64_t index = offset / page_size_;
+            size_t pos = 0;
+            do {
+                size_t n = min(page_size_, size - pos);
+                auto existing = entry.pages.find(index);
+                if (existing != entry.pages.end()) {
+                    erasePage(entry, existing);
+                }
+                lru_.push_front(Page{path, index, string(data + pos, n)});
+                entry.pages[index] = lru_.begin();
+                used_ += n;
+                pos += n;
+                index++;
+                if (n < page_size_) {
+                    break; // Short page is the end of file
+                }
+            } while (pos < size);
+            evictToBudget();
+        }
+
+        // Drops pages overlapping a local write, plus the end-of-file page since
+        // the write may have extended the file past it
+        void invalidateRange(const string& path, off_t offset, size_t size) {
+            lock_guard<mutex> lock(mutex_);
+            auto file = files_.find(path);
+            if (file == files_.end()) {
+                return;
+            }
+            FileEntry& entry = file->second;
+            uint64_t first = offset / page_size_;
+            uint64_t last  = (offset + max<size_t>(size, 1) - 1) / page_size_;
+            for (auto it = entry.pages.begin(); it != entry.pages.end();) {
+                auto following = next(it);
+                if ((it->first >= first && it->first <= last) || it->second->data.size() < page_size_) {
+                    erasePage(entry, it);
+                }
+                it = following;
+            }
+            entry.invalidated = ++epoch_;
+            if (entry.pages.empty()) {
+                eraseFile(file);
+            }
+        }
+
+        void invalidate(const string& path) {
+            lock_guard<mutex> lock(mutex_);
+            auto file = files_.find(path);
+            if (file != files_.end()) {
+                dropPages(file->second);
+                eraseFile(file);
+            }
+        }
+};
+
+// Per-path cache of successful getattr results, valid for a fixed TTL. Entries
+// are dropped early by our own operations that change a file or directory.
+class AttrCache {
+    private:
+        static constexpr size_t kShards = 16;
+
+        struct Entry {
+            struct stat st;
+            chrono::steady_clock::time_point expires;
+        };
+
+        struct Shard {
+            mutex lock;
+            unordered_map<string, Entry> entries;
+        };
+
+        Shard shards_[kShards];
+        chrono::milliseconds ttl_;
+        atomic<uint64_t> hits_{0};
+        atomic<uint64_t> misses_{0};
+
+        Shard& shardFor(const string& path) { return shards_[hash<string>()(path) % kShards]; }
+
+    public:
+        explicit AttrCache(chrono::milliseconds ttl) : ttl_(ttl) {}
+
+        bool enabled() const { return ttl_.count() > 0; }
+        chrono::milliseconds ttl() const { return ttl_; }
+        uint64_t hits() const { return hits_.load(); }
+        uint64_t misses() const { return misses_.load(); }
+
+        bool lookup(const string& path, struct stat* stbuf) {
+            Shard& shard = shardFor(path);
+            lock_guard<mutex> guard(shard.lock);
+            auto it = shard.entries.find(path);
+            if (it == shard.entries.end() || it->second.expires < chrono::steady_clock::now()) {
+                if (it != shard.entries.end()) {
+                    shard.entries.erase(it);
+                }
+                misses_++;
+                return false;
+            }
+            *stbuf = it->second.st;
+            hits_++;
+            return true;
+        }
+
+        void store(const string& path, const struct stat& st) {
+            Shard& shard = shardFor(path);
+            lock_guard<mutex> guard(shard.lock);
+            shard.entries[path] = Entry{st, chrono::steady_clock::now() + ttl_};
+        }
+
+        void invalidate(const string& path) {
+            Shard& shard = shardFor(path);
+            lock_guard<mutex> guard(shard.lock);
+            shard.entries.erase(path);
+        }
+
+        // Creating or removing an entry also changes its directory's nlink/mtime
+        void invalidateWithParent(const string& path) {
+            invalidate(path);
+            size_t slash = path.find_last_of('/');
+            invalidate(slash == 0 || slash == string::npos ? "/" : path.substr(0, slash));
+        }
+};
+
+// Directory handles from NfsLookup by path, for the handle protocol. They
+// live as long as the kernel is told to cache entries, so a directory renamed
+// behind our back is seen no later than the kernel would see it.
+class LookupCache {
+    private:
+        struct Entry {
+            string handle;
+            chrono::steady_clock::time_point expires;
+        };
+
+        mutex lock_;
+        unordered_map<string, Entry> entries_;
+        chrono::milliseconds ttl_;
+        atomic<uint64_t> hits_{0};
+        atomic<uint64_t> misses_{0};
+
+    public:
+        explicit LookupCache(chrono::milliseconds ttl) : ttl_(ttl) {}
+
+        uint64_t hits() const { return hits_.load(); }
+        uint64_t misses() const { return misses_.load(); }
+
+        bool lookup(const string& dir, string* handle) {
+            lock_guard<mutex> guard(lock_);
+            auto it = entries_.find(dir);
+            if (it == entries_.end() || it->second.expires < chrono::steady_clock::now()) {
+                if (it != entries_.end()) {
+                    entries_.erase(it);
+                }
+                misses_++;
+                return false;
+            }
+            *handle = it->second.handle;
+            hits_++;
+            return true;
+        }
+
+        void store(const string& dir, const string& handle) {
+            lock_guard<mutex> guard(lock_);
+            entries_[dir] = Entry{handle, chrono::steady_clock::now() + ttl_};
+        }
+
+        // Drops dir and every directory below it
+        void invalidateTree(const string& dir) {
+            string prefix = dir == "/" ? dir : dir + "/";
+            lock_guard<mutex> guard(lock_);
+            for (auto it = entries_.begin(); it != entries_.end();) {
+                if (it->first == dir || it->first.compare(0, prefix.size(), prefix) == 0) {
+                    it = entries_.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+};
+
+// Detects sequential reads per open file and prefetches ahead of them into the
+// page cache on a small worker pool. Like the Linux readahead algorithm the
+// window starts at a few times the request size and grows up to the maximum
+// while reads stay sequential; the next window is issued as soon as the reader
+// enters the previous one, so one window is always in flight. A seek drops the
+// window and any prefetches still queued for the file.
+class Readahead {
+    public:
+        // Fetches [offset, offset + size), returns 0 or a negative errno
+        using Fetcher = function<int(const string& path, struct fuse_file_info *fi, off_t offset, size_t size, string *data)>;
+
+    private:
+        struct FileState {
+            string  path;
+            struct fuse_file_info fi;
+            int64_t file_size  = -1; // From NfsOpen, prefetches stop at end of file
+            off_t   prev_end   = 0;  // End of the furthest read so far
+            off_t   marker     = 0;  // Start of the last window, reaching it triggers the next
+            off_t   issued_end = 0;  // End of everything prefetched or queued
+            size_t  window     = 0;  // Current window, 0 until reads look sequential
+            vector<pair<off_t, off_t>> in_flight; // Ranges being fetched right now
+        };
+
+        struct Job {
+            uint64_t fh;
+            string   path;
+            struct fuse_file_info fi;
+            off_t    offset;
+            size_t   size;
+            uint64_t generation;
+        };
+
+        PageCache& cache_;
+        Fetcher fetch_;
+        size_t max_window_;
+        int thread_count_;
+        mutex mutex_;
+        condition_variable work_cv_; // Job queued or stopping
+        condition_variable done_cv_; // A fetch finished
+        deque<Job> queue_;
+        unordered_map<uint64_t, FileState> files_; // Keyed by server handle
+        vector<thread> workers_;
+        bool stopping_ = false;
+        atomic<uint64_t> windows_{0};
+        atomic<uint64_t> prefetched_bytes_{0};
+        atomic<uint64_t> seeks_{0};
+
+        static bool overlaps(off_t start, off_t end, off_t offset, size_t size) {
+            return start < offset + (off_t)size && offset < end;
+        }
+
+        off_t pageRoundUp(off_t offset) const {
+            off_t page = cache_.pageSize();
+            return (offset + page - 1) / page * page;
+        }
+
+        // Windows are whole pages, at least one
+        size_t roundToPages(size_t bytes) const {
+            return max(cache_.pageSize(), (size_t)pageRoundUp(bytes));
+        }
+
+        // Linux get_init_ra_size(): small reads get 4x, medium 2x, large the maximum
+        size_t initialWindow(size_t request) const {
+            size_t window = 1;
+            while (window < request) {
+                window <<= 1;
+            }
+            if (window <= max_window_ / 32) {
+                window *= 4;
+            } else if (window <= max_window_ / 4) {
+                window *= 2;
+            } else {
+                window = max_window_;
+            }
+            return roundToPages(min(window, max_window_));
+        }
+
+        // Linux get_next_ra_size(): ramp up quickly while the window is small
+        size_t nextWindow(size_t current) const {
+            size_t window = current < max_window_ / 16 ? current * 4 : current * 2;
+            return roundToPages(min(window, max_window_));
+        }
+
+        // Queues the next window of file, starting no earlier than the reader
+        void scheduleLocked(uint64_t fh, FileState& file) {
+            off_t start = max(file.issued_end, pageRoundUp(file.prev_end));
+            size_t size = file.window;
+            if (file.file_size >= 0) {
+                if (start >= file.file_size) {
+                    return; // Nothing left to prefetch
+                }
+                size = min<int64_t>(size, pageRoundUp(file.file_size) - start);
+            }
+            queue_.push_back(Job{fh, file.path, file.fi, start, size, cache_.generation()});
+            file.marker     = start;
+            file.issued_end = start + size;
+            windows_++;
+            work_cv_.notify_one();
+        }
+
+        void cancelLocked(uint64_t fh) {
+            for (auto it = queue_.begin(); it != queue_.end();) {
+                it = it->fh == fh ? queue_.erase(it) : next(it);
+            }
+        }
+
+        // Fetches job with mutex_ released, then publishes it to the page cache
+        void runLocked(unique_lock<mutex>& lock, Job& job) {
+            auto file = files_.find(job.fh);
+            if (file == files_.end()) {
+                return;
+            }
+            file->second.in_flight.emplace_back(job.offset, job.offset + job.size);
+            lock.unlock();
+
+            if (!cache_.cached(job.path, job.offset, job.size)) {
+                string data;
+                if (fetch_(job.path, &job.fi, job.offset, job.size, &data) == 0) {
+                    cache_.fill(job.path, job.generation, job.offset, data);
+                    prefetched_bytes_ += data.size();
+                }
+            }
+
+            lock.lock();
+            // close() waits for in-flight fetches, so the state is still there
+            vector<pair<off_t, off_t>>& in_flight = files_[job.fh].in_flight;
+            in_flight.erase(find(in_flight.begin(), in_flight.end(), make_pair(job.offset, job.offset + (off_t)job.size)));
+            done_cv_.notify_all();
+        }
+
+        void worker() {
+            unique_lock<mutex> lock(mutex_);
+            while (true) {
+                work_cv_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+                if (stopping_) {
+                    return;
+                }
+                Job job = move(queue_.front());
+                queue_.pop_front();
+                runLocked(lock, job);
+            }
+        }
+
+    public:
+        Readahead(PageCache& cache, Fetcher fetch, size_t max_window, int threads)
+            : cache_(cache), fetch_(move(fetch)), max_window_(max_window), thread_count_(threads) {}
+
+        ~Readahead() {
+            {
+                lock_guard<mutex> lock(mutex_);
+                stopping_ = true;
+            }
+            work_cv_.notify_all();
+            for (thread& worker : workers_) {
+                worker.join();
+            }
+        }
+
+        // Prefetched data lives in the page cache, so readahead needs it enabled
+        bool enabled() const { return max_window_ > 0 && thread_count_ > 0 && cache_.enabled(); }
+        uint64_t windows() const { return windows_.load(); }
+        uint64_t prefetchedBytes() const { return prefetched_bytes_.load(); }
+        uint64_t seeks() const { return seeks_.load(); }
+
+        // Called from FUSE init, after fuse_main has daemonized
+        void start() {
+            if (!enabled() || !workers_.empty()) {
+                return;
+            }
+            for (int i = 0; i < thread_count_; i++) {
+                workers_.emplace_back(&Readahead::worker, this);
+            }
+        }
+
+        void open(uint64_t fh, const string& path, const struct fuse_file_info& fi, int64_t size) {
+            if (!enabled() || fh == 0) {
+                return;
+            }
+            lock_guard<mutex> lock(mutex_);
+            FileState& file = files_[fh];
+            file.path      = path;
+            file.fi        = fi;
+            file.file_size = size;
+        }
+
+        // Drops queued prefetches for fh and waits out the ones in flight, so
+        // nothing touches the server handle after release
+        void close(uint64_t fh) {
+            unique_lock<mutex> lock(mutex_);
+            auto file = files_.find(fh);
+            if (file == files_.end()) {
+                return;
+            }
+            cancelLocked(fh);
+            done_cv_.wait(lock, [&] { return files_[fh].in_flight.empty(); });
+            files_.erase(fh);
+        }
+
+        // Feeds one read into the access pattern and queues the next window
+        // when the reader is sequential
+        void onRead(uint64_t fh, off_t offset, size_t size) {
+            if (size == 0) {
+                return;
+            }
+            lock_guard<mutex> lock(mutex_);
+            auto it = files_.find(fh);
+            if (it == files_.end()) {
+                return;
+            }
+            FileState& file = it->second;
+            off_t end = offset + size;
+
+            // The kernel may deliver neighbouring reads slightly out of order,
+            // anything between the last window and the prefetched end still counts
+            bool sequential = offset == file.prev_end ||
+                (file.window > 0 && offset >= file.marker - (off_t)file.window && offset <= file.issued_end);
+            if (!sequential) {
+                if (file.window > 0) {
+                    cancelLocked(fh);
+                    seeks_++;
+                }
+                file.window     = 0;
+                file.marker     = 0;
+                file.issued_end = 0;
+                file.prev_end   = end;
+                return;
+            }
+
+            file.prev_end = max(file.prev_end, end);
+            if (file.window == 0) {
+                file.window     = initialWindow(size);
+                file.issued_end = pageRoundUp(end);
+                scheduleLocked(fh, file);
+            } else if (end > file.marker) {
+                file.window = nextWindow(file.window);
+                scheduleLocked(fh, file);
+            }
+        }
+
+        // Called on a page cache miss. If a prefetch covering the range is in
+        // flight, waits for it; if one is still queued, runs it on this thread.
+        // Returns true if the cache is worth checking again.
+        bool await(uint64_t fh, off_t offset, size_t size) {
+            unique_lock<mutex> lock(mutex_);
+            auto file = files_.find(fh);
+            if (file == files_.end()) {
+                return false;
+            }
+
+            for (auto it = queue_.begin(); it != queue_.end(); it++) {
+                if (it->fh == fh && overlaps(it->offset, it->offset + it->size, offset, size)) {
+                    Job job = move(*it);
+                    queue_.erase(it);
+                    runLocked(lock, job);
+                    return true;
+                }
+            }
+
+            auto pending = [&] {
+                for (const auto& range : files_[fh].in_flight) {
+                    if (overlaps(range.first, range.second, offset, size)) {
+                        return true;
+                    }
+                }
+                return false;
+            };
+            if (!pending()) {
+                return false;
+            }
+            done_cv_.wait(lock, [&] { return !pending(); });
+            return true;
+        }
+};
+
+// Listing state behind an open directory handle. Keeps the last page fetched
+// from the server so the kernel's small readdir calls do not each cost an RPC.
+struct DirHandle {
+    struct Entry {
+        string name;
+        struct stat st;
+        bool has_attr;   // st is valid, from NfsReadDirPlus
+        uint64_t cookie; // Server cookie that resumes after this entry
+    };
+
+    mutex lock;
+    vector<Entry> entries;     // The buffered page
+    uint64_t start_cookie = 0; // Cookie the page was fetched from
+    uint64_t next_cookie  = 0; // Cookie for the page after it
+    bool eof    = false;       // No pages after this one
+    bool loaded = false;
+
+    void setPage(uint64_t start, uint64_t next, bool at_end) {
+        start_cookie = start;
+        next_cookie  = next;
+        eof          = at_end;
+        loaded       = true;
+    }
+
+    // Finds where a listing resumed at cookie continues in the buffered page
+    bool locate(uint64_t cookie, size_t* index) const {
+        if (!loaded) {
+            return false;
+        }
+        if (cookie == start_cookie) {
+            *index = 0;
+            return true;
+        }
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (entries[i].cookie == cookie) {
+                *index = i + 1;
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// Connections to the server, in two lanes. Reads, writes and their streams
+// are spread over a pool of data channels, so parallel transfers do not
+// share one HTTP/2 connection and its flow-control windows; everything else
+// goes over separate metadata channels, so a getattr never queues behind
+// multi-MiB transfers. Each channel gets a distinct channel argument, which
+// keeps gRPC from folding them onto one shared subchannel.
+class ChannelPool {
+    private:
+        struct Lane {
+            vector<unique_ptr<GrpcService::Stub>> stubs;
+            unique_ptr<atomic<int>[]> in_flight;
+            atomic<unsigned> next{0};
+        };
+
+        Lane data_;
+        Lane metadata_;
+        ChannelSelect select_;
+        atomic<unsigned> next_thread_{0};
+
+        void build(Lane& lane, int count, int first_index, const string& target, const grpc::ChannelArguments& base) {
+            count = max(count, 1);
+            lane.in_flight.reset(new atomic<int>[count]);
+            for (int i = 0; i < count; i++) {
+                grpc::ChannelArguments args = base;
+                args.SetInt("nfs.channel_index", first_index + i);
+                args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+                lane.stubs.push_back(GrpcService::NewStub(grpc::CreateCustomChannel(target, grpc::InsecureChannelCredentials(), args)));
+                lane.in_flight[i] = 0;
+            }
+        }
+
+    public:
+        // Counts as a call in flight on its channel until destroyed
+        class Lease {
+            private:
+                GrpcService::Stub* stub_ = nullptr;
+                atomic<int>* in_flight_  = nullptr;
+
+            public:
+                Lease() {}
+                Lease(GrpcService::Stub* stub, atomic<int>* in_flight) : stub_(stub), in_flight_(in_flight) {
+                    in_flight_->fetch_add(1, memory_order_relaxed);
+                }
+                Lease(Lease&& other) : stub_(other.stub_), in_flight_(other.in_flight_) {
+                    other.in_flight_ = nullptr;
+                }
+                Lease& operator=(Lease&& other) {
+                    if (this != &other) {
+                        if (in_flight_) {
+                            in_flight_->fetch_sub(1, memory_order_relaxed);
+                        }
+                        stub_  = other.stub_;
+                        in_flight_ = other.in_flight_;
+                        other.in_flight_ = nullptr;
+                    }
+                    return *this;
+                }
+                ~Lease() {
+                    if (in_flight_) {
+                        in_flight_->fetch_sub(1, memory_order_relaxed);
+                    }
+                }
+
+                GrpcService::Stub* operator->() const { return stub_; }
+                GrpcService::Stub* get() const { return stub_; }
+
+                friend class ChannelPool;
+        };
+
+        ChannelPool(const string& target, const grpc::ChannelArguments& args, int data_channels, int metadata_channels, ChannelSelect select)
+            : select_(select) {
+            build(data_, data_channels, 0, target, args);
+            build(metadata_, metadata_channels, data_channels, target, args);
+        }
+
+        Lease data() { return pick(data_); }
+        Lease metadata() { return pick(metadata_); }
+
+        // Another channel of the lane busy was taken from, or the same one
+        // if the lane has only one, for a hedged second attempt
+        Lease sibling(const Lease& busy) {
+            Lane& lane = busy.in_flight_ >= &data_.in_flight[0] && busy.in_flight_ < &data_.in_flight[0] + data_.stubs.size()
+                ? data_ : metadata_;
+            size_t index = (busy.in_flight_ - &lane.in_flight[0] + 1) % lane.stubs.size();
+            return Lease(lane.stubs[index].get(), &lane.in_flight[index]);
+        }
+
+    private:
+        Lease pick(Lane& lane) {
+            size_t count = lane.stubs.size();
+            size_t index;
+            if (count == 1) {
+                index = 0;
+            } else if (select_ == ChannelSelect::Thread) {
+                static thread_local unsigned slot = next_thread_++;
+                index = slot % count;
+            } else {
+                // Start the scan at a rotating channel so ties spread out
+                size_t start = lane.next++ % count;
+                index = start;
+                int lowest = lane.in_flight[start].load(memory_order_relaxed);
+                for (size_t i = 1; i < count && lowest > 0; i++) {
+                    size_t candidate = (start + i) % count;
+                    int load = lane.in_flight[candidate].load(memory_order_relaxed);
+                    if (load < lowest) {
+                        lowest = load;
+                        index  = candidate;
+                    }
+                }
+            }
+            return Lease(lane.stubs[index].get(), &lane.in_flight[index]);
+        }
+};
+
+// Every RPC type the client issues, for per-call latency tracking
+enum class RpcOp {
+    Ping, Lookup, GetAttr, Compound, Open, Release, Write, Read, ReadStream,
+    ReadDir, ReadDirPlus, Unlink, Rmdir, Create, Utimens, Mkdir, Count,
+};
+
+static const char* const kRpcOpNames[] = {
+    "Ping", "NfsLookup", "NfsGetAttr", "NfsCompound", "NfsOpen", "NfsRelease", "NfsWrite", "NfsRead",
+    "NfsReadStream", "NfsReadDir", "NfsReadDirPlus", "NfsUnlink", "NfsRmdir", "NfsCreate", "NfsUtimens", "NfsMkdir",
+};
+
+// Extended attribute of the mount root that holds the RPC statistics
+static const char kStatsXattr[] = "user.nfs.rpc_stats";
+
+// What the client has seen of each RPC type: latency, attempts, bytes and
+// how calls failed. The deadlines, hedge delays and retry backoff of every
+// call are derived from it, so a retried call waits tens of milliseconds
+// rather than seconds, and its deadline tracks what the server usually takes
+// instead of a flat second.
+class RpcStats {
+    private:
+        static const uint64_t kMinSamples  = 100; // Before this many, fall back to the fixed maximum
+        static const int kDeadlineSlack    = 4;   // Deadline is this many times the op's p99.9
+        static const size_t kMinBytesPerMs = 64 * 1024; // Transfer allowance, about 64 MB/s
+        static const int kStatusCodes      = grpc::StatusCode::UNAUTHENTICATED + 1;
+        static const int kMaxErrno         = 134; // Past the last Linux errno
+
+        struct Op {
+            nfsmetrics::LatencyHistogram latency; // Calls the server answered
+            atomic<uint64_t> attempts{0};
+            atomic<uint64_t> retries{0};
+            atomic<uint64_t> hedges{0};
+            atomic<uint64_t> hedge_wins{0};
+            atomic<uint64_t> bytes_out{0};
+            atomic<uint64_t> bytes_in{0};
+            atomic<uint64_t> compressed{0}; // Calls whose payload was sent or asked for compressed
+            atomic<uint64_t> status_codes[kStatusCodes]; // Failed attempts by gRPC code
+            atomic<uint64_t> errnos[kMaxErrno];          // Answered calls the server failed, by errno
+
+            Op() {
+                for (auto& count : status_codes) {
+                    count = 0;
+                }
+                for (auto& count : errnos) {
+                    count = 0;
+                }
+            }
+        };
+
+        Op ops_[(int)RpcOp::Count];
+        bool adaptive_;
+        chrono::milliseconds min_;
+        chrono::milliseconds max_;
+
+    public:
+        static const int kInitialBackoffMs = 25;
+        static const int kMaxBackoffMs     = 800;
+
+        RpcStats(bool adaptive, int min_ms, int max_ms)
+            : adaptive_(adaptive), min_(min_ms), max_(std::max(min_ms, max_ms)) {}
+
+        // One attempt that sent bytes_out and got back bytes_in. Only answered
+        // attempts count towards latency, timeouts would feed back into the deadline.
+        void record(RpcOp op, chrono::steady_clock::time_point started, const Status& status, size_t bytes_out, size_t bytes_in) {
+            Op& stats = ops_[(int)op];
+            stats.attempts.fetch_add(1, memory_order_relaxed);
+            stats.bytes_out.fetch_add(bytes_out, memory_order_relaxed);
+            if (status.ok()) {
+                stats.latency.record(chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - started).count());
+                stats.bytes_in.fetch_add(bytes_in, memory_order_relaxed);
+            } else {
+                stats.status_codes[min((int)status.error_code(), kStatusCodes - 1)].fetch_add(1, memory_order_relaxed);
+            }
+        }
+
+        void recordRetry(RpcOp op) { ops_[(int)op].retries.fetch_add(1, memory_order_relaxed); }
+        void recordCompressed(RpcOp op) { ops_[(int)op].compressed.fetch_add(1, memory_order_relaxed); }
+
+        void recordErrno(RpcOp op, int error) {
+            if (error > 0) {
+                ops_[(int)op].errnos[min(error, kMaxErrno - 1)].fetch_add(1, memory_order_relaxed);
+            }
+        }
+
+        void recordHedge(RpcOp op, bool won) {
+            ops_[(int)op].hedges.fetch_add(1, memory_order_relaxed);
+            if (won) {
+                ops_[(int)op].hedge_wins.fetch_add(1, memory_order_relaxed);
+            }
+        }
+
+        // Deadline for attempt (from 0) of op carrying bytes of payload either way.
+        // Each retry doubles the allowance, so a slow but healthy server still gets through.
+        chrono::system_clock::time_point deadline(RpcOp op, int attempt, size_t bytes = 0) const {
+            chrono::microseconds budget = max_;
+            const nfsmetrics::LatencyHistogram& histogram = ops_[(int)op].latency;
+            if (adaptive_ && histogram.count() >= kMinSamples) {
+                budget = chrono::microseconds(histogram.percentile(0.999) * kDeadlineSlack);
+                budget = min<chrono::microseconds>(std::max<chrono::microseconds>(budget, min_), max_);
+            }
+            budget *= 1 << min(attempt, 4);
+            budget += chrono::milliseconds(bytes / kMinBytesPerMs);
+            return chrono::system_clock::now() + budget;
+        }
+
+        // How long to wait for the first reply before hedging, 0 if too few samples
+        chrono::microseconds hedgeDelay(RpcOp op) const {
+            const nfsmetrics::LatencyHistogram& histogram = ops_[(int)op].latency;
+            if (histogram.count() < kMinSamples) {
+                return chrono::microseconds(0);
+            }
+            return chrono::microseconds(histogram.percentile(0.95));
+        }
+
+        // Sleeps a random time in [backoff_ms / 2, backoff_ms], then doubles backoff_ms
+        static void sleepBackoff(int& backoff_ms) {
+            static thread_local minstd_rand random(random_device{}());
+            uniform_int_distribution<int> jitter(backoff_ms / 2, backoff_ms);
+            this_thread::sleep_for(chrono::milliseconds(jitter(random)));
+            backoff_ms = min(backoff_ms * 2, (int)kMaxBackoffMs);
+        }
+
+        // One line per RPC type that was used, for the log and the stats xattr
+        string format() const {
+            ostringstream out;
+            for (int i = 0; i < (int)RpcOp::Count; i++) {
+                const Op& stats = ops_[i];
+                uint64_t attempts = stats.attempts.load(memory_order_relaxed);
+                if (attempts == 0) {
+                    continue;
+                }
+                const nfsmetrics::LatencyHistogram& latency = stats.latency;
+                out << kRpcOpNames[i] << ": " << latency.count() << " ok of " << attempts << " attempts, "
+                    << stats.retries.load(memory_order_relaxed) << " retries, "
+                    << stats.hedges.load(memory_order_relaxed) << " hedged (" << stats.hedge_wins.load(memory_order_relaxed) << " won), "
+                    << stats.bytes_out.load(memory_order_relaxed) << " bytes out, " << stats.bytes_in.load(memory_order_relaxed) << " bytes in, "
+                    << stats.compressed.load(memory_order_relaxed) << " compressed; "
+                    << "latency us mean " << latency.mean() << " p50 " << latency.percentile(0.5) << " p90 " << latency.percentile(0.9)
+                    << " p99 " << latency.percentile(0.99) << " p99.9 " << latency.percentile(0.999) << " max " << latency.max();
+                for (int code = 1; code < kStatusCodes; code++) {
+                    uint64_t count = stats.status_codes[code].load(memory_order_relaxed);
+                    if (count > 0) {
+                        out << "; grpc " << code << " x" << count;
+                    }
+                }
+                for (int error = 1; error < kMaxErrno; error++) {
+                    uint64_t count = stats.errnos[error].load(memory_order_relaxed);
+                    if (count > 0) {
+                        out << "; " << strerror(error) << " x" << count;
+                    }
+                }
+                out << '\n';
+            }
+            return out.str();
+        }
+
+        void report() const {
+            istringstream lines(format());
+            for (string line; getline(lines, line);) {
+                LOG_INFO(line);
+            }
+        }
+};
+
+// Token bucket shared by every call, after gRPC's retry throttling: a failed
+// attempt spends a token and a success earns back a tenth of one, and retries
+// stop while half the tokens or fewer remain. An overloaded server then sees
+// about one retry per ten successes rather than a retry storm.
+class RetryBudget {
+    private:
+        atomic<int> milli_tokens_;
+        int max_;
+
+    public:
+        explicit RetryBudget(int tokens) : milli_tokens_(tokens * 1000), max_(tokens * 1000) {}
+
+        // Spends a token for a failed attempt; true if it may be retried
+        bool tryRetry() {
+            int tokens = milli_tokens_.load(memory_order_relaxed);
+            while (!milli_tokens_.compare_exchange_weak(tokens, std::max(tokens - 1000, 0), memory_order_relaxed)) {
+            }
+            return tokens - 1000 > max_ / 2;
+        }
+
+        void onSuccess() {
+            int tokens = milli_tokens_.load(memory_order_relaxed);
+            while (tokens < max_ && !milli_tokens_.compare_exchange_weak(tokens, min(tokens + 100, max_), memory_order_relaxed)) {
+            }
+        }
+};
+
+// An open NfsWriteStream for one file handle. Writes are pushed as they
+// arrive; the server's byte count comes back when the stream is finished.
+struct WriteStream {
+    mutex lock; // ClientWriter allows one writer at a time
+    string path;
+    ChannelPool::Lease channel; // Held for the life of the stream
+    ClientContext context;
+    TransferStatus status;
+    unique_ptr<grpc::ClientWriter<DataChunk>> writer;
+    int64_t bytes_sent = 0;
+};
+
+// What to compress on one call: the request, with gRPC's per-call
+// algorithm, and the reply, by asking the server for it in metadata
+struct CallCompression {
+    grpc_compression_algorithm request = GRPC_COMPRESS_NONE;
+    grpc_compression_algorithm reply   = GRPC_COMPRESS_NONE;
+
+    void apply(ClientContext* context) const {
+        if (request != GRPC_COMPRESS_NONE) {
+            context->set_compression_algorithm(request);
+        }
+        if (reply != GRPC_COMPRESS_NONE) {
+            context->AddMetadata(nfscompress::kMetadataKey, nfscompress::algorithmName(reply));
+        }
+    }
+};
 
 class FuseGrpcClient {
     private:
-        unique_ptr<GrpcService::Stub> stub_;
+        ChannelPool channels_;
         static FuseGrpcClient* instance_;
+        PageCache page_cache_;
+        AttrCache attr_cache_;
+        Readahead readahead_;
+        WriteMode write_mode_;
+        mutex write_streams_mutex_;
+        unordered_map<uint64_t, shared_ptr<WriteStream>> write_streams_; // Keyed by server handle
+        size_t stream_threshold_;
+        size_t stream_chunk_;
+        bool buf_ops_;
+        bool readdir_plus_;
+        int readdir_page_;
+        atomic<bool> compound_; // Cleared if the server has no NfsCompound
+        LookupCache lookups_;
+        atomic<bool> handles_; // Cleared if the server has no NfsLookup
+        RpcStats rpc_stats_;
+        static int stats_pipe_[2]; // SIGUSR1 handler to the thread that logs rpc_stats_
+        RetryBudget retry_budget_;
+        bool hedge_;
+        nfscompress::Policy compression_;
 
     public:
-        FuseGrpcClient(shared_ptr<Channel> channel, const string& target) {
-            stub_     = GrpcService::NewStub(channel);
+        FuseGrpcClient(const string& target, const grpc::ChannelArguments& args, const ClientOptions& options = ClientOptions())
+            : channels_(target, args, options.data_channels, options.metadata_channels, options.channel_select),
+              page_cache_(options.page_cache_bytes, options.page_size),
+              attr_cache_(chrono::milliseconds(options.attr_ttl_ms)),
+              readahead_(page_cache_,
+                         [](const string& path, struct fuse_file_info *fi, off_t offset, size_t size, string *data) {
+                             return fetchRange(path.c_str(), fi, offset, size, data);
+                         },
+                         options.readahead_max, options.readahead_threads),
+              write_mode_(options.write_mode),
+              stream_threshold_(options.stream_threshold),
+              stream_chunk_(options.stream_chunk),
+              buf_ops_(options.buf_ops),
+              readdir_plus_(options.readdir_plus),
+              readdir_page_(options.readdir_page),
+              compound_(options.compound),
+              lookups_(chrono::milliseconds(options.handle_ttl_ms)),
+              handles_(options.handles),
+              rpc_stats_(options.adaptive_deadlines, options.deadline_min_ms, options.deadline_max_ms),
+              retry_budget_(options.retry_budget),
+              hedge_(options.hedge),
+              compression_(options.compression) {
             instance_ = this;
 
             // Pings server
-            ClientContext context;
             PingRequest request;
             PingResponse response;
 
             request.set_message("Ping");
-            Status status = stub_->Ping(&context, request, &response);
+            Status status = invoke(RpcOp::Ping, &ChannelPool::metadata, &GrpcService::Stub::Ping, request, &response);
 
             if (status.ok()) {
-                cout << "Ping successful: " << response.message() << endl;
+                LOG_INFO("Ping successful: " << response.message());
             } else {
-                cerr << "Ping failed: " << status.error_code() << " - " << status.error_message() << endl;
+                LOG_ERROR("Ping failed: " << status.error_code() << " - " << status.error_message());
+            }
+        }
+
+        static const int kMaxAttempts = 3; // First try and retries of a failing RPC
+
+        // Every unary RPC goes through here. Each attempt gets a fresh context
+        // and a deadline from the op's latency so far, is timed and counted,
+        // and is retried with jittered backoff on DEADLINE_EXCEEDED or
+        // UNAVAILABLE while the retry budget allows. bytes is the payload size
+        // the deadline must allow for. Returns the last attempt's status; the
+        // server's own errors come back in the response as usual.
+        template <class Request, class Response>
+        static Status invoke(RpcOp op, ChannelPool::Lease (ChannelPool::*lane)(),
+                             Status (GrpcService::Stub::*call)(ClientContext*, const Request&, Response*),
+                             const Request& request, Response* response, size_t bytes = 0,
+                             const CallCompression& compression = CallCompression()) {
+            return invokeWith<Request, Response>(op, lane, call, nullptr, request, response, bytes, compression);
+        }
+
+        // invoke() for idempotent ops, which --hedge may send twice
+        template <class Request, class Response>
+        static Status invokeIdempotent(RpcOp op, ChannelPool::Lease (ChannelPool::*lane)(),
+                                       Status (GrpcService::Stub::*call)(ClientContext*, const Request&, Response*),
+                                       unique_ptr<grpc::ClientAsyncResponseReader<Response>> (GrpcService::Stub::*prepare)(ClientContext*, const Request&, grpc::CompletionQueue*),
+                                       const Request& request, Response* response, size_t bytes = 0,
+                                       const CallCompression& compression = CallCompression()) {
+            return invokeWith<Request, Response>(op, lane, call, prepare, request, response, bytes, compression);
+        }
+
+        // After attempt (from 0) of op failed with status: whether to try
+        // again, having slept the backoff. Shared by invoke() and the streams.
+        static bool retryAfter(RpcOp op, const Status& status, int attempt, int& backoff_ms) {
+            const char* name = kRpcOpNames[(int)op];
+            LOG_WARN(name << " gRPC communication failed: " << status.error_code() << " - " << status.error_message());
+            if (status.error_code() != grpc::StatusCode::DEADLINE_EXCEEDED &&
+                status.error_code() != grpc::StatusCode::UNAVAILABLE) {
+                return false; // Other errors, don't retry
+            }
+            if (attempt + 1 >= kMaxAttempts) {
+                LOG_ERROR(name << " failed after " << kMaxAttempts << " attempts.");
+                return false;
+            }
+            if (!instance_->retry_budget_.tryRetry()) {
+                LOG_ERROR(name << " not retried, the retry budget is spent.");
+                return false;
+            }
+            instance_->rpc_stats_.recordRetry(op);
+            LOG_WARN("Retrying " << name << " " << attempt + 1 << "/" << kMaxAttempts - 1 << " within " << backoff_ms << " ms...");
+            RpcStats::sleepBackoff(backoff_ms);
+            return true;
+        }
+
+    private:
+        template <class Request, class Response>
+        static Status invokeWith(RpcOp op, ChannelPool::Lease (ChannelPool::*lane)(),
+                                 Status (GrpcService::Stub::*call)(ClientContext*, const Request&, Response*),
+                                 unique_ptr<grpc::ClientAsyncResponseReader<Response>> (GrpcService::Stub::*prepare)(ClientContext*, const Request&, grpc::CompletionQueue*),
+                                 const Request& request, Response* response, size_t bytes, const CallCompression& compression) {
+            int backoff_ms = RpcStats::kInitialBackoffMs;
+            for (int attempt = 0;; attempt++) {
+                ClientContext context;
+                context.set_deadline(instance_->rpc_stats_.deadline(op, attempt, bytes));
+                compression.apply(&context);
+                Status status = attemptCall(op, lane, call, prepare, compression, &context, request, response);
+                if (status.ok()) {
+                    instance_->retry_budget_.onSuccess();
+                    instance_->rpc_stats_.recordErrno(op, errnoOf(*response, 0));
+                    return status;
+                }
+                if (!retryAfter(op, status, attempt, backoff_ms)) {
+                    return status;
+                }
             }
         }
 
+        // The errno of a failed response, 0 for success or messages without one
+        template <class Response>
+        static auto errnoOf(const Response& response, int) -> decltype(response.errorcode()) {
+            return response.success() ? 0 : response.errorcode();
+        }
+
+        template <class Response>
+        static int errnoOf(const Response&, long) {
+            return 0;
+        }
+
+        // One attempt on a channel from lane. With hedging on and a prepare
+        // method given, a call still unanswered after the op's p95 latency is
+        // sent again on a sibling channel and the first reply wins; the other
+        // is cancelled. context carries the deadline for both, compression
+        // is applied to the hedge as it was to context.
+        template <class Request, class Response>
+        static Status attemptCall(RpcOp op, ChannelPool::Lease (ChannelPool::*lane)(),
+                                  Status (GrpcService::Stub::*call)(ClientContext*, const Request&, Response*),
+                                  unique_ptr<grpc::ClientAsyncResponseReader<Response>> (GrpcService::Stub::*prepare)(ClientContext*, const Request&, grpc::CompletionQueue*),
+                                  const CallCompression& compression, ClientContext* context,
+                                  const Request& request, Response* response) {
+            RpcStats& stats = instance_->rpc_stats_;
+            auto started = chrono::steady_clock::now();
+            ChannelPool::Lease primary = (instance_->channels_.*lane)();
+            chrono::microseconds delay = prepare && instance_->hedge_ ? stats.hedgeDelay(op) : chrono::microseconds(0);
+            if (delay.count() == 0) {
+                Status status = (primary.get()->*call)(context, request, response);
+                stats.record(op, started, status, request.ByteSizeLong(), status.ok() ? response->ByteSizeLong() : 0);
+                return status;
+            }
+
+            grpc::CompletionQueue cq;
+            Status statuses[2];
+            ClientContext hedge_context;
+            Response hedge_response;
+            ChannelPool::Lease hedge;
+            unique_ptr<grpc::ClientAsyncResponseReader<Response>> readers[2];
+            readers[0] = (primary.get()->*prepare)(context, request, &cq);
+            readers[0]->StartCall();
+            readers[0]->Finish(response, &statuses[0], (void*)0);
+
+            void* tag;
+            bool ok;
+            int started_calls = 1;
+            if (cq.AsyncNext(&tag, &ok, chrono::system_clock::now() + delay) != grpc::CompletionQueue::GOT_EVENT) {
+                hedge = instance_->channels_.sibling(primary);
+                hedge_context.set_deadline(context->deadline());
+                compression.apply(&hedge_context);
+                readers[1] = (hedge.get()->*prepare)(&hedge_context, request, &cq);
+                readers[1]->StartCall();
+                readers[1]->Finish(&hedge_response, &statuses[1], (void*)1);
+                started_calls = 2;
+                cq.Next(&tag, &ok);
+            }
+            int winner = (int)(intptr_t)tag;
+            if (started_calls == 2) {
+                (winner == 0 ? hedge_context : *context).TryCancel();
+                cq.Next(&tag, &ok); // The loser, cancelled or not
+                stats.recordHedge(op, winner == 1);
+            }
+            cq.Shutdown();
+            while (cq.Next(&tag, &ok)) {
+            }
+
+            if (winner == 1) {
+                response->Swap(&hedge_response);
+            }
+            Status& status = statuses[winner];
+            stats.record(op, started, status, request.ByteSizeLong() * started_calls, status.ok() ? response->ByteSizeLong() : 0);
+            return status;
+        }
+
+    public:
+
+        static string parentOf(const string& path) {
+            size_t slash = path.find_last_of('/');
+            return slash == 0 || slash == string::npos ? "/" : path.substr(0, slash);
+        }
+
+        // Returns the handle of directory dir, looking up only the part of
+        // the path below its nearest cached ancestor. 0 or a negative errno.
+        static int lookupDir(const string& dir, string* handle) {
+            LookupCache& cache = instance_->lookups_;
+            if (cache.lookup(dir, handle)) {
+                return 0;
+            }
+
+            string base;
+            string ancestor;
+            string rest = dir;
+            for (string up = dir; up != "/";) {
+                up = parentOf(up);
+                if (cache.lookup(up, &base)) {
+                    ancestor = up;
+                    rest = dir.substr(up == "/" ? 1 : up.size() + 1);
+                    break;
+                }
+            }
+
+            NfsLookupRequest request;
+            NfsLookupResponse response;
+            for (;;) {
+                request.set_dir(base);
+                request.set_path(rest);
+
+                Status status = invoke(RpcOp::Lookup, &ChannelPool::metadata, &GrpcService::Stub::NfsLookup, request, &response);
+                if (!status.ok()) {
+                    if (status.error_code() == grpc::StatusCode::UNIMPLEMENTED) {
+                        LOG_INFO("Server has no NfsLookup, sending full paths");
+                        instance_->handles_.store(false, memory_order_relaxed);
+                        return -ENOSYS;
+                    }
+                    return -EIO;
+                }
+
+                if (response.success()) {
+                    *handle = response.handle();
+                    cache.store(dir, *handle);
+                    return 0;
+                }
+                if (response.errorcode() == ESTALE && !base.empty()) {
+                    // The ancestor went stale, walk from the root instead
+                    cache.invalidateTree(ancestor);
+                    base.clear();
+                    rest = dir;
+                    continue;
+                }
+                LOG_DEBUG("gRPC NfsLookup failed: " << response.message());
+                return -response.errorcode();
+            }
+        }
+
+        // Points request at path: as its name inside the parent directory's
+        // handle in handle mode, as the full path otherwise or if the parent
+        // cannot be looked up (the request then fails the usual way)
+        template <typename Request>
+        static void setTarget(Request& request, const char *path) {
+            string dir;
+            if (instance_->handles_.load(memory_order_relaxed)) {
+                string target = path;
+                if (target == "/") {
+                    if (lookupDir("/", &dir) == 0) {
+                        request.set_dir(dir);
+                        request.set_path("");
+                        return;
+                    }
+                } else if (lookupDir(parentOf(target), &dir) == 0) {
+                    request.set_dir(dir);
+                    request.set_path(target.substr(target.find_last_of('/') + 1));
+                    return;
+                }
+            }
+            request.clear_dir();
+            request.set_path(path);
+        }
+
+        // True if a request for path failed only because its directory
+        // handle went stale; the handle is dropped so a retry looks it up again
+        static bool staleHandle(const char *path, int errorcode) {
+            if (errorcode != ESTALE || !instance_->handles_.load(memory_order_relaxed)) {
+                return false;
+            }
+            string target = path;
+            instance_->lookups_.invalidateTree(target == "/" ? target : parentOf(target));
+            return true;
+        }
+
         static int nfs_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
-            cout << "Getting attributes for path: " << path << endl;
+            LOG_DEBUG("Getting attributes for path: " << path);
             memset(stbuf, 0, sizeof(struct stat));
 
-            int max_retries = 3;  // Set the maximum number of retries
-            int retry_count = 0;  // Initialize retry count
-            int backoff_time = 1; // Initial backoff time in seconds
+            AttrCache& cache = instance_->attr_cache_;
+            if (cache.enabled() && cache.lookup(path, stbuf)) {
+                return 0; // Served from the attribute cache
+            }
+
+            // The size must include data still in flight on a write stream
+            finishWriteStreamsFor(path);
+
+            NfsGetAttrRequest request;
+            NfsGetAttrResponse response;
+            for (int attempt = 0;; attempt++) {
+                setTarget(request, path);
 
-            while (retry_count < max_retries) {
-                // Create gRPC client context and request/response objects
-                ClientContext context;
-                NfsGetAttrRequest request;
-                NfsGetAttrResponse response;
+                Status status = invokeIdempotent(RpcOp::GetAttr, &ChannelPool::metadata, &GrpcService::Stub::NfsGetAttr,
+                                                 &GrpcService::Stub::PrepareAsyncNfsGetAttr, request, &response);
+                if (!status.ok()) {
+                    return -EIO; // invoke() already retried what could be retried
+                }
 
-                // Set timeout for the request
-                auto deadline = chrono::system_clock::now() + chrono::seconds(1);
-                context.set_deadline(deadline);
+                if (response.success()) {
+                    statFromAttr(response, stbuf);
+                    if (cache.enabled()) {
+                        cache.store(path, *stbuf);
+                    }
+                    return 0; // Operation successful
+                }
+                LOG_DEBUG("gRPC NfsGetAttr failed: " << response.message());
+                if (attempt == 0 && staleHandle(path, response.errorcode())) {
+                    continue; // Retry with the directory looked up again
+                }
+                return -response.errorcode(); // Map the errno from server to FUSE error code
+            }
+        }
 
-                // Prepare the request
-                request.set_path(path);
+        static void statFromAttr(const NfsGetAttrResponse& attr, struct stat *stbuf) {
+            stbuf->st_mode = attr.mode();
+            stbuf->st_nlink = attr.nlink();
+            stbuf->st_size = attr.size();
+            stbuf->st_ino = attr.ino();
+            stbuf->st_uid = attr.uid();
+            stbuf->st_gid = attr.gid();
+            stbuf->st_blocks = attr.blocks();
+            stbuf->st_atim = nsToTimespec(attr.atime_ns());
+            stbuf->st_mtim = nsToTimespec(attr.mtime_ns());
+            stbuf->st_ctim = nsToTimespec(attr.ctime_ns());
+        }
 
-                // Make the gRPC call
-                Status status = instance_->stub_->NfsGetAttr(&context, request, &response);
+        // Sends the ops in request followed by a getattr of path as one
+        // NfsCompound, so the attributes the kernel asks for right after a
+        // create, open or mkdir are already cached. Returns 0 if the first op
+        // succeeded, its negative errno if it failed, or -ENOSYS if the caller
+        // should fall back to the single RPC.
+        static int compoundWithAttr(const char *what, const char *path, NfsCompoundRequest& request, NfsCompoundResponse *response) {
+            if (!instance_->compound_.load(memory_order_relaxed)) {
+                return -ENOSYS;
+            }
+            setTarget(*request.add_ops()->mutable_getattr(), path);
+
+            Status status = invoke(RpcOp::Compound, &ChannelPool::metadata, &GrpcService::Stub::NfsCompound, request, response);
+            if (!status.ok()) {
+                if (status.error_code() == grpc::StatusCode::UNIMPLEMENTED) {
+                    LOG_INFO("Server has no NfsCompound, using single RPCs");
+                    instance_->compound_.store(false, memory_order_relaxed);
+                    return -ENOSYS;
+                }
+                LOG_ERROR(what << " failed: " << status.error_message());
+                return -EIO;
+            }
 
-                if (status.ok()) {
-                    if (response.success()) {
-                        stbuf->st_mode = response.mode();
-                        stbuf->st_nlink = response.nlink();
-                        stbuf->st_size = response.size();
-                        return 0; // Operation successful
-                    } else {
-                        cerr << "gRPC NfsGetAttr failed: " << response.message() << endl;
-                        return -response.errorcode(); // Map the errno from server to FUSE error code
-                    }
-                } else {
-                    cerr << "nfs_getattr gRPC communication failed: " << status.error_code() << " - " << status.error_message() << endl;
-
-                    if (status.error_code() == grpc::StatusCode::DEADLINE_EXCEEDED ||
-                        status.error_code() == grpc::StatusCode::UNAVAILABLE) {
-                        retry_count++;
-                        cout << "Retrying " << retry_count << "/" << max_retries << " after " << backoff_time << " second(s)..." << endl;
-
-                        // Wait for a backoff period before retrying
-                        this_thread::sleep_for(chrono::seconds(backoff_time));
-
-                        // Increase backoff time for the next retry
-                        backoff_time *= 2;
-
-                        // Reconnect if UNAVAILABLE
-                        // if (status.error_code() == grpc::StatusCode::UNAVAILABLE) {
-                        //     cout << "Re-establishing gRPC connection..." << endl;
-                        //     instance_->channel_ = grpc::CreateChannel(instance_->target_, grpc::InsecureChannelCredentials());
-                        //     instance_->stub_ = GrpcService::NewStub(instance_->channel_);
-                        // }
-                    } else {
-                        // Other errors, don't retry
-                        return -EIO;
-                    }
+            if (response->failed_op() == 0) {
+                if (staleHandle(path, response->errorcode())) {
+                    return -ENOSYS; // The single RPC looks the directory up again
                 }
+                LOG_DEBUG("gRPC NfsCompound " << what << " failed: " << response->message());
+                return -response->errorcode(); // Return the error code from server to FUSE as a negative value
             }
+            return 0; // A failed trailing getattr only costs the cache entry
+        }
 
-            cerr << "Failed to get attributes after " << max_retries << " retries." << endl;
-            return -EIO; // Input/output error for failed retries
+        // Caches the trailing getattr of a compound sent by compoundWithAttr
+        static void cacheCompoundAttr(const char *path, const NfsCompoundResponse& response) {
+            AttrCache& cache = instance_->attr_cache_;
+            if (!cache.enabled() || !response.success() || response.results_size() == 0) {
+                return;
+            }
+            const CompoundResult& last = response.results(response.results_size() - 1);
+            if (last.has_getattr()) {
+                struct stat st;
+                memset(&st, 0, sizeof(st));
+                statFromAttr(last.getattr(), &st);
+                cache.store(path, st);
+            }
         }
 
-        static int nfs_release(const char *path, struct fuse_file_info *fi) {
-            cout << "Releasing file: " << path << endl;
+        // Pushes one FUSE write down the handle's NfsWriteStream, opening the
+        // stream on first use. content is moved into the chunk. Returns the
+        // size written, or a negative errno if the stream has already failed.
+        static int streamWrite(const char *path, string& content, off_t offset, struct fuse_file_info *fi) {
+            size_t size = content.size();
+            shared_ptr<WriteStream> stream;
+            bool first_chunk = false;
+            {
+                lock_guard<mutex> lock(instance_->write_streams_mutex_);
+                shared_ptr<WriteStream>& slot = instance_->write_streams_[fi->fh];
+                if (!slot) {
+                    slot = make_shared<WriteStream>();
+                    slot->path   = path;
+                    slot->channel = instance_->channels_.data();
+                    if (instance_->compression_.enabled()) {
+                        slot->context.set_compression_algorithm(instance_->compression_.algorithm);
+                    }
+                    slot->writer  = slot->channel->NfsWriteStream(&slot->context, &slot->status);
+                    first_chunk  = true;
+                }
+                stream = slot;
+            }
 
-            int max_retries = 3;  // Set the maximum number of retries
-            int retry_count = 0;  // Initialize retry count
-            int backoff_time = 1; // Initial backoff time in seconds
+            DataChunk chunk;
+            chunk.mutable_data()->swap(content);
+            chunk.set_offset(offset);
+            if (first_chunk) {
+                chunk.set_path(path);
+                chunk.set_fh(fi->fh);
+                chunk.set_flags(fi->flags);
+            }
 
-            while (retry_count < max_retries) {
-                // Create gRPC client context and request/response objects
-                ClientContext context;
-                NfsReleaseRequest request;
-                NfsReleaseResponse response;
+            // The stream is compressed, chunks that fail the probe are sent as they are
+            grpc::WriteOptions write_options;
+            if (!instance_->compression_.worthIt(chunk.data().data(), size)) {
+                write_options.set_no_compression();
+            }
 
-                // Set timeout for the request
-                auto deadline = chrono::system_clock::now() + chrono::seconds(1);
-                context.set_deadline(deadline);
+            bool sent;
+            {
+                lock_guard<mutex> lock(stream->lock);
+                sent = stream->writer->Write(chunk, write_options);
+                if (sent) {
+                    stream->bytes_sent += size;
+                }
+            }
 
-                // Prepare the request
-                request.set_path(path);
+            instance_->page_cache_.invalidateRange(path, offset, size);
+            instance_->attr_cache_.invalidate(path);
+            if (!sent) {
+                // The server ended the stream early, collect its error
+                int result = finishWriteStream(fi->fh);
+                return result < 0 ? result : -EIO;
+            }
+            return size;
+        }
 
-                // Make the gRPC call
-                Status status;
-                if (RUN_SYNC) {
-                    status = instance_->stub_->NfsRelease(&context, request, &response);
-                } else {
-                    status = instance_->stub_->NfsReleaseAsync(&context, request, &response);
+        // Closes fh's write stream, if any, and waits for the server to commit
+        // it. Returns 0 or a negative errno.
+        static int finishWriteStream(uint64_t fh) {
+            shared_ptr<WriteStream> stream;
+            {
+                lock_guard<mutex> lock(instance_->write_streams_mutex_);
+                auto it = instance_->write_streams_.find(fh);
+                if (it == instance_->write_streams_.end()) {
+                    return 0;
                 }
+                stream = it->second;
+                instance_->write_streams_.erase(it);
+            }
 
-                if (status.ok()) {
-                    if (response.success()) {
-                        cout << "File released successfully: " << path << endl;
-                        return 0; // Operation successful
-                    } else {
-                        cerr << "gRPC NfsRelease failed: " << response.message() << endl;
-                        return -response.errorcode(); // Map the errno from server to FUSE error code
-                    }
-                } else {
-                    cerr << "nfs_release gRPC communication failed: " << status.error_code() << " - " << status.error_message() << endl;
-
-                    // Retry on timeout or transient error
-                    if (status.error_code() == grpc::StatusCode::DEADLINE_EXCEEDED ||
-                        status.error_code() == grpc::StatusCode::UNAVAILABLE) {
-                        retry_count++;
-                        cout << "Retrying " << retry_count << "/" << max_retries << " after " << backoff_time << " second(s)..." << endl;
-
-                        // Wait for a backoff period before retrying
-                        this_thread::sleep_for(chrono::seconds(backoff_time));
-
-                        // Increase backoff time for the next retry
-                        backoff_time *= 2;
-
-                        // Reconnect if UNAVAILABLE
-                        // if (status.error_code() == grpc::StatusCode::UNAVAILABLE) {
-                        //     cout << "Re-establishing gRPC connection..." << endl;
-                        //     instance_->channel_ = grpc::CreateChannel(instance_->target_, grpc::InsecureChannelCredentials());
-                        //     instance_->stub_ = GrpcService::NewStub(instance_->channel_);
-                        // }
-                    } else {
-                        // Other errors, don't retry
-                        return -EIO;
+            lock_guard<mutex> lock(stream->lock);
+            stream->writer->WritesDone();
+            Status status = stream->writer->Finish();
+            if (!status.ok()) {
+                LOG_WARN("NfsWriteStream gRPC communication failed: " << status.error_code() << " - " << status.error_message());
+                return -EIO;
+            }
+            if (!stream->status.success()) {
+                LOG_DEBUG("gRPC NfsWriteStream failed: " << stream->status.message());
+                return -stream->status.errorcode();
+            }
+            if (stream->status.bytes_received() != stream->bytes_sent) {
+                LOG_ERROR("NfsWriteStream committed " << stream->status.bytes_received() << " of "
+                     << stream->bytes_sent << " bytes for: " << stream->path);
+                return -EIO;
+            }
+            LOG_DEBUG("Write stream committed " << stream->bytes_sent << " bytes to: " << stream->path);
+            return 0;
+        }
+
+        static void finishWriteStreamsFor(const char *path) {
+            vector<uint64_t> handles;
+            {
+                lock_guard<mutex> lock(instance_->write_streams_mutex_);
+                for (const auto& entry : instance_->write_streams_) {
+                    if (entry.second->path == path) {
+                        handles.push_back(entry.first);
                     }
                 }
             }
+            for (uint64_t fh : handles) {
+                finishWriteStream(fh);
+            }
+        }
 
-            cerr << "Failed to release file after " << max_retries << " retries." << endl;
-            return -EIO; // Input/output error for failed retries
+        // close() reports write stream errors here, before release
+        static int nfs_flush(const char *path, struct fuse_file_info *fi) {
+            return finishWriteStream(fi->fh);
         }
 
-        static int nfs_open(const char *path, struct fuse_file_info *fi) {
-            cout << "Opening file: " << path << endl;
+        static int nfs_release(const char *path, struct fuse_file_info *fi) {
+            LOG_DEBUG("Releasing file: " << path);
 
-            int max_retries = 3;  // Set the maximum number of retries
-            int retry_count = 0;  // Initialize retry count
-            int backoff_time = 1; // Initial backoff time in seconds
+            int stream_result = finishWriteStream(fi->fh);
+            if (stream_result < 0) {
+                LOG_ERROR("Write stream for " << path << " failed on release");
+            }
+            instance_->readahead_.close(fi->fh);
+
+            NfsReleaseRequest request;
+            NfsReleaseResponse response;
+            request.set_path(path);
+            request.set_fh(fi->fh);
+
+            // Write-back mode has the server flush its buffered writes on release
+            Status status = invoke(RpcOp::Release, &ChannelPool::metadata,
+                                   instance_->write_mode_ != WriteMode::WriteBack ? &GrpcService::Stub::NfsRelease : &GrpcService::Stub::NfsReleaseAsync,
+                                   request, &response);
+            if (!status.ok()) {
+                return -EIO; // invoke() already retried what could be retried
+            }
 
-            while (retry_count < max_retries) {
-                // Create gRPC client context and request/response objects
-                ClientContext context;
-                NfsOpenRequest request;
-                NfsOpenResponse response;
+            if (response.success()) {
+                LOG_DEBUG("File released successfully: " << path);
+                return stream_result; // Operation successful unless the write stream failed
+            }
+            LOG_DEBUG("gRPC NfsRelease failed: " << response.message());
+            return -response.errorcode(); // Map the errno from server to FUSE error code
+        }
 
-                // Set timeout for the request (e.g., 1 second)
-                auto deadline = chrono::system_clock::now() + chrono::seconds(1);
-                context.set_deadline(deadline);
+        static int nfs_open(const char *path, struct fuse_file_info *fi) {
+            LOG_DEBUG("Opening file: " << path);
+
+            NfsCompoundRequest compound;
+            NfsOpenRequest *open = compound.add_ops()->mutable_open();
+            setTarget(*open, path);
+            open->set_flags(fi->flags);
+            NfsCompoundResponse compound_response;
+            int result = compoundWithAttr("nfs_open", path, compound, &compound_response);
+            if (result != -ENOSYS) {
+                if (result < 0) {
+                    return result;
+                }
+                const NfsOpenResponse& response = compound_response.results(0).open();
+                fi->fh = response.fh(); // Server handle for read/write/release
+                if (instance_->page_cache_.enabled()) {
+                    instance_->page_cache_.revalidate(path, response.size(), response.mtime_ns());
+                }
+                instance_->readahead_.open(fi->fh, path, *fi, response.size());
+                cacheCompoundAttr(path, compound_response);
+                return 0;
+            }
 
-                // Prepare the request
-                request.set_path(path);
-                request.set_flags(fi->flags);
+            NfsOpenRequest request;
+            NfsOpenResponse response;
+            request.set_flags(fi->flags);
+            for (int attempt = 0;; attempt++) {
+                setTarget(request, path);
 
-                // Make the gRPC call
-                Status status = instance_->stub_->NfsOpen(&context, request, &response);
+                Status status = invoke(RpcOp::Open, &ChannelPool::metadata, &GrpcService::Stub::NfsOpen, request, &response);
+                if (!status.ok()) {
+                    return -EIO; // invoke() already retried what could be retried
+                }
 
-                if (status.ok()) {
-                    if (response.success()) {
-                        fi->fh = -1;
-                        return 0; // File opened successfully
-                    } else {
-                        cerr << "gRPC NfsOpen failed: " << response.message() << endl;
-                        return -response.errorcode(); // Return the error code from server to FUSE as a negative value
-                    }
-                } else {
-                    cerr << "nfs_open gRPC communication failed: " << status.error_code() << " - " << status.error_message() << endl;
-
-                    // Retry on timeout or transient error
-                    if (status.error_code() == grpc::StatusCode::DEADLINE_EXCEEDED ||
-                        status.error_code() == grpc::StatusCode::UNAVAILABLE) {
-                        retry_count++;
-                        cout << "Retrying " << retry_count << "/" << max_retries << " after " << backoff_time << " second(s)..." << endl;
-
-                        // Wait for a backoff period before retrying
-                        this_thread::sleep_for(chrono::seconds(backoff_time));
-
-                        // Increase backoff time for the next retry
-                        backoff_time *= 2;
-
-                        // Reconnect if UNAVAILABLE
-                        // if (status.error_code() == grpc::StatusCode::UNAVAILABLE) {
-                        //     cout << "Re-establishing gRPC connection..." << endl;
-                        //     instance_->channel_ = grpc::CreateChannel(instance_->target_, grpc::InsecureChannelCredentials());
-                        //     instance_->stub_ = GrpcService::NewStub(instance_->channel_);
-                        // }
-                    } else {
-                        // Other errors, don't retry
-                        return -EIO;
+                if (response.success()) {
+                    fi->fh = response.fh(); // Server handle for read/write/release
+                    if (instance_->page_cache_.enabled()) {
+                        instance_->page_cache_.revalidate(path, response.size(), response.mtime_ns());
                     }
+                    instance_->readahead_.open(fi->fh, path, *fi, response.size());
+                    return 0; // File opened successfully
                 }
+                LOG_DEBUG("gRPC NfsOpen failed: " << response.message());
+                if (attempt == 0 && staleHandle(path, response.errorcode())) {
+                    continue; // Retry with the directory looked up again
+                }
+                return -response.errorcode(); // Return the error code from server to FUSE as a negative value
             }
-
-            cerr << "Failed to open file after " << max_retries << " retries." << endl;
-            return -EIO; // Input/output error for failed retries
         }
     
         // Write should return exactly the number of bytes requested except on error
         static int nfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-            cout << "Write to file: " << path << endl;
-            cout << "Buffer content to write: " << string(buf, size) << endl; // Log the buffer content
+            LOG_DEBUG("Write to file: " << path);
+            string content(buf, size);
+            return writeRange(path, content, offset, fi);
+        }
 
-            int max_retries = 3;  // Set the maximum number of retries
-            int retry_count = 0;  // Initialize retry count
-            int backoff_time = 1; // Initial backoff time in seconds
+        // Like nfs_write, but FUSE hands over its buffer vector so data that
+        // arrives in a spliced pipe is read straight into the request instead
+        // of through an intermediate buffer
+        static int nfs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+            LOG_DEBUG("Write to file: " << path);
+            size_t size = fuse_buf_size(buf);
+            string content;
+            content.resize(size);
+
+            struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+            dst.buf[0].mem = &content[0];
+            ssize_t copied = fuse_buf_copy(&dst, buf, (enum fuse_buf_copy_flags)0);
+            if (copied < 0) {
+                LOG_WARN("fuse_buf_copy failed for: " << path << " - " << strerror(-copied));
+                return copied;
+            }
+            content.resize(copied);
+            return writeRange(path, content, offset, fi);
+        }
 
+        // Sends content to the server at offset through the configured write
+        // mode. content is moved into the request and may be left empty.
+        static int writeRange(const char *path, string& content, off_t offset, struct fuse_file_info *fi) {
+            LOG_PAYLOAD("Buffer content to write: " << content); // Log the buffer content
+            size_t size = content.size();
 
-            while (retry_count < max_retries) {
-                // Create gRPC client context and request/response objects
-                ClientContext context;
-                NfsWriteRequest request;
-                NfsWriteResponse response;
-
-                // Set timeout for the request (e.g., 1 second)
-                auto deadline = chrono::system_clock::now() + chrono::seconds(1);
-                context.set_deadline(deadline);
-
-                // Prepare the request
-                request.set_path(path);
-                request.set_content(buf);
-                request.set_size(size);
-                request.set_offset(offset);
-                request.set_flags(fi->flags);
-
-                // Make the gRPC call
-                Status status;
-                if (RUN_SYNC) {
-                    status = instance_->stub_->NfsWrite(&context, request, &response);
-                } else {
-                    status = instance_->stub_->NfsWriteAsync(&context, request, &response);
-                }
+            if (instance_->write_mode_ == WriteMode::Stream && fi->fh != 0) {
+                return streamWrite(path, content, offset, fi);
+            }
 
-                if (status.ok()) {
-                    if (response.success()) {
-                        int64_t len = response.bytes_written();
-                        return len; // Operation successful, return bytes written
-                    } else {
-                        cerr << "gRPC NfsWrite failed: " << response.message() << endl;
-                        return -response.errorcode(); // Map the errno from server to FUSE error code
-                    }
-                } else {
-                    cerr << "nfs_write gRPC communication failed: " << status.error_code() << " - " << status.error_message() << endl;
-
-                    // Retry on timeout or transient error
-                    if (status.error_code() == grpc::StatusCode::DEADLINE_EXCEEDED ||
-                        status.error_code() == grpc::StatusCode::UNAVAILABLE) {
-                        retry_count++;
-                        cout << "Retrying " << retry_count << "/" << max_retries << " after " << backoff_time << " second(s)..." << endl;
-
-                        // Wait for a backoff period before retrying
-                        this_thread::sleep_for(chrono::seconds(backoff_time));
-
-                        // Increase backoff time for the next retry
-                        backoff_time *= 2;
-
-                        // Reconnect if UNAVAILABLE
-                        // if (status.error_code() == grpc::StatusCode::UNAVAILABLE) {
-                        //     cout << "Re-establishing gRPC connection..." << endl;
-                        //     instance_->channel_ = grpc::CreateChannel(instance_->target_, grpc::InsecureChannelCredentials());
-                        //     instance_->stub_ = GrpcService::NewStub(instance_->channel_);
-                        // }
-                    } else {
-                        // Other errors, don't retry
-                        return -EIO;
-                    }
-                }
+            // The content goes back to the caller after the call
+            NfsWriteRequest request;
+            NfsWriteResponse response;
+            request.set_path(path);
+            request.mutable_content()->swap(content);
+            request.set_size(size);
+            request.set_offset(offset);
+            request.set_flags(fi->flags);
+            request.set_fh(fi->fh);
+
+            CallCompression compression;
+            if (instance_->compression_.worthIt(request.content().data(), size)) {
+                compression.request = instance_->compression_.algorithm;
+                instance_->rpc_stats_.recordCompressed(RpcOp::Write);
+            }
+
+            Status status = invoke(RpcOp::Write, &ChannelPool::data,
+                                   instance_->write_mode_ != WriteMode::WriteBack ? &GrpcService::Stub::NfsWrite : &GrpcService::Stub::NfsWriteAsync,
+                                   request, &response, size, compression);
+            content.swap(*request.mutable_content());
+            if (!status.ok()) {
+                return -EIO; // invoke() already retried what could be retried
             }
 
-            cerr << "Failed to write to file after " << max_retries << " retries." << endl;
-            return -EIO; // Input/output error for failed retries
+            if (response.success()) {
+                int64_t len = response.bytes_written();
+                instance_->page_cache_.invalidateRange(path, offset, size);
+                instance_->attr_cache_.invalidate(path);
+                return len; // Operation successful, return bytes written
+            }
+            LOG_DEBUG("gRPC NfsWrite failed: " << response.message());
+            return -response.errorcode(); // Map the errno from server to FUSE error code
         }
 
         // static int nfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
@@ -412,480 +1842,745 @@ class FuseGrpcClient {
         //     return -EIO; // Input/output error for failed retries
         // }
 
-        static int nfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-            cout << "Reading file: " << path << endl;
+        // Fetches [offset, offset + size) into data with one unary NfsRead.
+        // Returns 0 or a negative errno; data is short at end of file.
+        static int readUnary(const char *path, struct fuse_file_info *fi, off_t offset, size_t size, string *data) {
+            NfsReadRequest request;
+            NfsReadResponse response;
+            request.set_path(path);
+            request.set_offset(offset);
+            request.set_flags(fi->flags);
+            request.set_size(size);
+            request.set_fh(fi->fh);
+
+            // The server compresses the reply only if the data passes its probe
+            CallCompression compression;
+            if (instance_->compression_.sizeQualifies(size)) {
+                compression.reply = instance_->compression_.algorithm;
+                instance_->rpc_stats_.recordCompressed(RpcOp::Read);
+            }
+
+            Status status = invokeIdempotent(RpcOp::Read, &ChannelPool::data, &GrpcService::Stub::NfsRead,
+                                             &GrpcService::Stub::PrepareAsyncNfsRead, request, &response, size, compression);
+            if (!status.ok()) {
+                return -EIO; // invoke() already retried what could be retried
+            }
 
-            int max_retries = 3;  // Set the maximum number of retries
-            int retry_count = 0;  // Initialize retry count
-            int backoff_time = 1; // Initial backoff time in seconds
+            if (!response.success()) {
+                LOG_DEBUG("gRPC NfsRead failed: " << response.message());
+                data->clear();
+                return -response.errorcode(); // Return the error code from server to FUSE as a negative value
+            }
+            int64_t len = response.size();
+            if (len > (int64_t)size) {
+                LOG_ERROR("Error: Read size (" << len << ") exceeds buffer size (" << size << ").");
+                return -EFBIG; // Return an error indicating that the file is too large
+            }
+            LOG_DEBUG("Read " << len << " bytes from file: " << path); // Log the length of content read
+            LOG_PAYLOAD("Content: " << response.content()); // Log the content read
+            data->swap(*response.mutable_content());
+            data->resize(len);
+            return 0; // Successfully read bytes
+        }
 
+        // Fetches [offset, offset + size) over a server stream, so large ranges
+        // flow as a pipeline of chunks instead of one giant message. Chunks are
+        // copied straight into dest, which holds size bytes. Returns the bytes
+        // read (short at end of file) or a negative errno.
+        static ssize_t readStream(const char *path, struct fuse_file_info *fi, off_t offset, size_t size, char *dest) {
+            NfsReadStreamRequest request;
+            request.set_path(path);
+            request.set_fh(fi->fh);
+            request.set_flags(fi->flags);
+            request.set_offset(offset);
+            request.set_size(size);
+            request.set_chunk_size(instance_->stream_chunk_);
+
+            CallCompression compression;
+            if (instance_->compression_.sizeQualifies(size)) {
+                compression.reply = instance_->compression_.algorithm;
+                instance_->rpc_stats_.recordCompressed(RpcOp::ReadStream);
+            }
 
-            while (retry_count < max_retries) {
-                // Create gRPC client context and request/response objects
+            // Same deadline, accounting and retry policy as invoke(), around the whole stream
+            int backoff_ms = RpcStats::kInitialBackoffMs;
+            for (int attempt = 0;; attempt++) {
                 ClientContext context;
-                NfsReadRequest request;
-                NfsReadResponse response;
+                DataChunk chunk;
+
+                // The deadline covers the whole transfer, so it grows with size
+                context.set_deadline(instance_->rpc_stats_.deadline(RpcOp::ReadStream, attempt, size));
+                compression.apply(&context);
+
+                size_t received = 0;
+                auto started = chrono::steady_clock::now();
+                ChannelPool::Lease channel = instance_->channels_.data();
+                unique_ptr<grpc::ClientReader<DataChunk>> reader = channel->NfsReadStream(&context, request);
+                bool in_order = true;
+                while (reader->Read(&chunk)) {
+                    if (chunk.offset() != offset + (off_t)received || received + chunk.data().size() > size) {
+                        in_order = false;
+                        context.TryCancel();
+                        break;
+                    }
+                    memcpy(dest + received, chunk.data().data(), chunk.data().size());
+                    received += chunk.data().size();
+                }
+                Status status = reader->Finish();
+                instance_->rpc_stats_.record(RpcOp::ReadStream, started, status, request.ByteSizeLong(), received);
 
-                // Set timeout for the request (e.g., 1 second)
-                auto deadline = chrono::system_clock::now() + chrono::seconds(1);
-                context.set_deadline(deadline);
+                if (!in_order) {
+                    LOG_ERROR("nfs_read stream returned an unexpected chunk for: " << path);
+                    return -EIO;
+                }
+                if (status.ok()) {
+                    instance_->retry_budget_.onSuccess();
+                    LOG_DEBUG("Streamed " << received << " bytes from file: " << path);
+                    return received;
+                }
+                if (!status.error_details().empty()) {
+                    LOG_DEBUG("gRPC NfsReadStream failed: " << status.error_message());
+                    int error = atoi(status.error_details().c_str()); // errno from the server
+                    instance_->rpc_stats_.recordErrno(RpcOp::ReadStream, error);
+                    return -error;
+                }
+                if (!retryAfter(RpcOp::ReadStream, status, attempt, backoff_ms)) {
+                    return -EIO;
+                }
+            }
+        }
 
-                // Prepare the request
-                request.set_path(path);
-                request.set_offset(offset);
-                request.set_flags(fi->flags);
-                request.set_size(size);
+        // readUnary for any size: ranges larger than the server accepts in
+        // one NfsRead are fetched as several, stopping at end of file
+        static int readUnarySplit(const char *path, struct fuse_file_info *fi, off_t offset, size_t size, string *data) {
+            if (size <= nfslimits::kMaxReadBytes) {
+                return readUnary(path, fi, offset, size, data);
+            }
+            data->clear();
+            data->reserve(size);
+            string part;
+            while (data->size() < size) {
+                size_t want = min(size - data->size(), nfslimits::kMaxReadBytes);
+                int result = readUnary(path, fi, offset + data->size(), want, &part);
+                if (result < 0) {
+                    return result;
+                }
+                data->append(part);
+                if (part.size() < want) {
+                    break;
+                }
+            }
+            return 0;
+        }
 
-                // Make the gRPC call
-                Status status = instance_->stub_->NfsRead(&context, request, &response);
+        static bool useReadStream(size_t size) {
+            size_t threshold = instance_->stream_threshold_;
+            return threshold > 0 && size >= threshold;
+        }
 
-                if (status.ok()) {
-                    if (response.success()) {
-                        int64_t len = response.size();
-
-                        if (len <= size) {
-                            size = len;
-                            cout << "Read " << len << " bytes from file: " << path << endl; // Log the length of content read
-                            cout << "Content: " << response.content() << endl; // Log the content read
-                            memcpy(buf, response.content().data(), size);
-                            return size; // Successfully read bytes
-                        } else {
-                            cerr << "Error: Read size (" << len << ") exceeds buffer size (" << size << ")." << endl;
-                            return -EFBIG; // Return an error indicating that the file is too large
-                        }
-                    } else {
-                        cerr << "gRPC NfsRead failed: " << response.message() << endl;
-                        return -response.errorcode(); // Return the error code from server to FUSE as a negative value
-                    }
-                } else {
-                    cerr << "nfs_read gRPC communication failed: " << status.error_code() << " - " << status.error_message() << endl;
-
-                    // Retry on timeout or transient error
-                    if (status.error_code() == grpc::StatusCode::DEADLINE_EXCEEDED ||
-                        status.error_code() == grpc::StatusCode::UNAVAILABLE) {
-                        retry_count++;
-                        cout << "Retrying " << retry_count << "/" << max_retries << " after " << backoff_time << " second(s)..." << endl;
-
-                        // Wait for a backoff period before retrying
-                        this_thread::sleep_for(chrono::seconds(backoff_time));
-
-                        // Increase backoff time for the next retry
-                        backoff_time *= 2;
-
-                        // Reconnect if UNAVAILABLE
-                        // if (status.error_code() == grpc::StatusCode::UNAVAILABLE) {
-                        //     cout << "Re-establishing gRPC connection..." << endl;
-                        //     instance_->channel_ = grpc::CreateChannel(instance_->target_, grpc::InsecureChannelCredentials());
-                        //     instance_->stub_ = GrpcService::NewStub(instance_->channel_);
-                        // }
-                    } else {
-                        // Other errors, don't retry
-                        return -EIO;
-                    }
-                }
+        // Large ranges go over the stream, everything else is one unary call.
+        // Returns 0 or a negative errno; data is short at end of file.
+        static int fetchRange(const char *path, struct fuse_file_info *fi, off_t offset, size_t size, string *data) {
+            if (useReadStream(size)) {
+                data->resize(size);
+                ssize_t received = readStream(path, fi, offset, size, &(*data)[0]);
+                data->resize(max<ssize_t>(received, 0));
+                return received < 0 ? received : 0;
             }
+            return readUnarySplit(path, fi, offset, size, data);
+        }
 
-            cerr << "Failed to read after " << max_retries << " retries." << endl;
-            return -EIO; // Input/output error for failed retries
+        // fetchRange into a caller buffer of size bytes. Streamed chunks land
+        // in dest directly. Returns the bytes read or a negative errno.
+        static ssize_t fetchInto(const char *path, struct fuse_file_info *fi, off_t offset, size_t size, char *dest) {
+            if (useReadStream(size)) {
+                return readStream(path, fi, offset, size, dest);
+            }
+            string data;
+            int result = readUnarySplit(path, fi, offset, size, &data);
+            if (result < 0) {
+                return result;
+            }
+            memcpy(dest, data.data(), data.size());
+            return data.size();
         }
 
-        static int nfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
-            cout << "Reading directory: " << path << endl;
+        static int nfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+            LOG_DEBUG("Reading file: " << path);
+
+            // Reads must observe everything written through this handle so far
+            int stream_result = finishWriteStream(fi->fh);
+            if (stream_result < 0) {
+                return stream_result;
+            }
 
-            int max_retries = 3;  // Set the maximum number of retries
-            int retry_count = 0;  // Initialize retry count
-            int backoff_time = 1; // Initial backoff time in seconds
+            // Queue readahead first so it overlaps with a synchronous fetch below
+            Readahead& readahead = instance_->readahead_;
+            readahead.onRead(fi->fh, offset, size);
+
+            PageCache& cache = instance_->page_cache_;
+            off_t    fetch_offset = offset;
+            size_t   fetch_size   = size;
+            uint64_t generation   = 0;
+            if (cache.enabled()) {
+                ssize_t cached = cache.read(path, buf, size, offset);
+                if (cached < 0 && readahead.await(fi->fh, offset, size)) {
+                    cached = cache.read(path, buf, size, offset); // Filled by readahead
+                }
+                if (cached >= 0) {
+                    return cached; // Served from the page cache
+                }
 
-            while (retry_count < max_retries) {
-                // Create gRPC client context and request/response objects
-                ClientContext context;
-                NfsReadDirRequest request;
-                NfsReadDirResponse response;
+                // Miss: fetch every page the request touches so neighbours hit next time
+                size_t page  = cache.pageSize();
+                fetch_offset = (offset / page) * page;
+                fetch_size   = ((offset + size + page - 1) / page) * page - fetch_offset;
+                generation   = cache.generation();
+            }
 
-                // Set timeout for the request (e.g., 1 second)
-                auto deadline = chrono::system_clock::now() + chrono::seconds(1);
-                context.set_deadline(deadline);
+            string data;
+            int result = fetchRange(path, fi, fetch_offset, fetch_size, &data);
+            if (result < 0) {
+                return result;
+            }
+            if (cache.enabled()) {
+                cache.fill(path, generation, fetch_offset, data);
+            }
 
-                // Prepare the request
-                request.set_path(path);
+            // Hand back only the part of the fetched range that was asked for
+            size_t skip = offset - fetch_offset;
+            if (data.size() <= skip) {
+                return 0;
+            }
+            size = min(size, data.size() - skip);
+            memcpy(buf, data.data() + skip, size);
+            return size; // Successfully read bytes
+        }
 
-                // Make the gRPC call
-                Status status = FuseGrpcClient::instance_->stub_->NfsReadDir(&context, request, &response);
+        // Like nfs_read, but the reply buffer is ours: streamed chunks and cache
+        // hits are written into it once and FUSE sends it (spliced when the
+        // kernel allows) without copying it into a buffer of its own
+        static int nfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+            LOG_DEBUG("Reading file: " << path);
 
-                if (status.ok()) {
-                    if (response.success()) {
-                        // Add files from the response
-                        for (const auto& file : response.files()) {
-                            cout << file.c_str() << endl;
-                            filler(buf, file.c_str(), NULL, 0, FUSE_FILL_DIR_PLUS);
-                        }
-                        return 0; // Operation successful
-                    } else {
-                        cerr << "gRPC NfsReadDir failed: " << response.message() << endl;
-                        return -response.errorcode(); // Return the error code from server to FUSE as a negative value
-                    }
-                } else {
-                    cerr << "nfs_readdir gRPC communication failed: " << status.error_code() << " - " << status.error_message() << endl;
-
-                    // Retry on timeout or transient error
-                    if (status.error_code() == grpc::StatusCode::DEADLINE_EXCEEDED ||
-                        status.error_code() == grpc::StatusCode::UNAVAILABLE) {
-                        retry_count++;
-                        cout << "Retrying " << retry_count << "/" << max_retries << " after " << backoff_time << " second(s)..." << endl;
-
-                        // Wait for a backoff period before retrying
-                        this_thread::sleep_for(chrono::seconds(backoff_time));
-
-                        // Increase backoff time for the next retry
-                        backoff_time *= 2;
-
-                        // Reconnect if UNAVAILABLE
-                        // if (status.error_code() == grpc::StatusCode::UNAVAILABLE) {
-                        //     cout << "Re-establishing gRPC connection..." << endl;
-                        //     instance_->channel_ = grpc::CreateChannel(instance_->target_, grpc::InsecureChannelCredentials());
-                        //     instance_->stub_ = GrpcService::NewStub(instance_->channel_);
-                        // }
-                    } else {
-                        // Other errors, don't retry
-                        return -EIO;
-                    }
+            int stream_result = finishWriteStream(fi->fh);
+            if (stream_result < 0) {
+                return stream_result;
+            }
+
+            Readahead& readahead = instance_->readahead_;
+            readahead.onRead(fi->fh, offset, size);
+
+            PageCache& cache = instance_->page_cache_;
+            off_t    fetch_offset = offset;
+            size_t   fetch_size   = size;
+            uint64_t generation   = 0;
+            if (cache.enabled()) {
+                size_t page  = cache.pageSize();
+                fetch_offset = (offset / page) * page;
+                fetch_size   = ((offset + size + page - 1) / page) * page - fetch_offset;
+                generation   = cache.generation();
+            }
+
+            // FUSE frees both the vector and its memory with free() once it has replied
+            struct fuse_bufvec *bufvec = (struct fuse_bufvec *)malloc(sizeof(struct fuse_bufvec));
+            char *mem = (char *)malloc(max<size_t>(fetch_size, 1));
+            if (bufvec == nullptr || mem == nullptr) {
+                free(bufvec);
+                free(mem);
+                return -ENOMEM;
+            }
+            *bufvec = FUSE_BUFVEC_INIT(0);
+            bufvec->buf[0].mem = mem;
+
+            if (cache.enabled()) {
+                ssize_t cached = cache.read(path, mem, size, offset);
+                if (cached < 0 && readahead.await(fi->fh, offset, size)) {
+                    cached = cache.read(path, mem, size, offset); // Filled by readahead
                 }
+                if (cached >= 0) {
+                    bufvec->buf[0].size = cached;
+                    *bufp = bufvec;
+                    return 0; // Served from the page cache
+                }
+            }
+
+            ssize_t received = fetchInto(path, fi, fetch_offset, fetch_size, mem);
+            if (received < 0) {
+                free(mem);
+                free(bufvec);
+                return received;
+            }
+            if (cache.enabled()) {
+                cache.fill(path, generation, fetch_offset, mem, received);
             }
 
-            cerr << "Failed to read directory after " << max_retries << " retries." << endl;
-            return -EIO; // Input/output error for failed retries
+            // The reply has to start at the allocation FUSE will free, so a
+            // read that does not begin on a page boundary is shifted down
+            size_t skip = offset - fetch_offset;
+            size_t len  = (size_t)received > skip ? min(size, received - skip) : 0;
+            if (skip > 0 && len > 0) {
+                memmove(mem, mem + skip, len);
+            }
+            bufvec->buf[0].size = len;
+            *bufp = bufvec;
+            return 0;
         }
 
-        static int nfs_unlink(const char *path) {
-            cout << "Unlinking file: " << path << endl;
+        static struct timespec nsToTimespec(int64_t ns) {
+            struct timespec ts;
+            ts.tv_sec  = ns / 1000000000LL;
+            ts.tv_nsec = ns % 1000000000LL;
+            return ts;
+        }
 
-            int max_retries = 3;  // Set the maximum number of retries
-            int retry_count = 0;  // Initialize retry count
-            int backoff_time = 1; // Initial backoff time in seconds
+        // Fetches the page of names starting at cookie into dir
+        static int readDirPage(const char *path, uint64_t cookie, DirHandle *dir) {
+            NfsReadDirRequest request;
+            NfsReadDirResponse response;
+            request.set_cookie(cookie);
+            request.set_max_entries(instance_->readdir_page_);
+            for (int attempt = 0;; attempt++) {
+                setTarget(request, path);
+
+                Status status = invokeIdempotent(RpcOp::ReadDir, &ChannelPool::metadata, &GrpcService::Stub::NfsReadDir,
+                                                 &GrpcService::Stub::PrepareAsyncNfsReadDir, request, &response);
+                if (!status.ok()) {
+                    return -EIO; // invoke() already retried what could be retried
+                }
 
-            while (retry_count < max_retries) {
-                // Create gRPC client context and request/response objects
-                ClientContext context;
-                NfsUnlinkRequest request;
-                NfsUnlinkResponse response;
+                if (!response.success()) {
+                    LOG_DEBUG("gRPC NfsReadDir failed: " << response.message());
+                    if (attempt == 0 && staleHandle(path, response.errorcode())) {
+                        continue; // Retry with the directory looked up again
+                    }
+                    return -response.errorcode(); // Return the error code from server to FUSE as a negative value
+                }
 
-                // Set timeout for the request (e.g., 1 second)
-                auto deadline = chrono::system_clock::now() + chrono::seconds(1);
-                context.set_deadline(deadline);
+                dir->entries.clear();
+                for (int i = 0; i < response.files_size(); i++) {
+                    LOG_TRACE(response.files(i));
+                    DirHandle::Entry entry;
+                    entry.name     = response.files(i);
+                    entry.has_attr = false;
+                    entry.cookie   = i < response.cookies_size() ? response.cookies(i) : 0;
+                    dir->entries.push_back(move(entry));
+                }
+                dir->setPage(cookie, response.next_cookie(), response.eof());
+                return 0; // Operation successful
+            }
+        }
 
-                // Prepare the request
-                request.set_path(path);
+        // Fetches the page of entries with attributes starting at cookie into
+        // dir, and primes the attribute cache with them so the kernel and we
+        // need no per-entry getattr
+        static int readDirPlusPage(const char *path, uint64_t cookie, DirHandle *dir) {
+            string prefix = path;
+            if (prefix.empty() || prefix.back() != '/') {
+                prefix += '/';
+            }
 
-                // Make the gRPC call
-                Status status = instance_->stub_->NfsUnlink(&context, request, &response);
+            NfsReadDirRequest request;
+            NfsReadDirPlusResponse response;
+            request.set_cookie(cookie);
+            request.set_max_entries(instance_->readdir_page_);
+            for (int attempt = 0;; attempt++) {
+                setTarget(request, path);
+
+                Status status = invokeIdempotent(RpcOp::ReadDirPlus, &ChannelPool::metadata, &GrpcService::Stub::NfsReadDirPlus,
+                                                 &GrpcService::Stub::PrepareAsyncNfsReadDirPlus, request, &response);
+                if (!status.ok()) {
+                    return -EIO; // invoke() already retried what could be retried
+                }
 
-                if (status.ok()) {
-                    if (response.success()) {
-                        cout << "File unlinked successfully: " << path << endl;
-                        return 0; // File unlinked successfully
-                    } else {
-                        cerr << "gRPC NfsUnlink failed: " << response.message() << endl;
-                        return -response.errorcode(); // Return the error code from server to FUSE as a negative value
+                if (!response.success()) {
+                    LOG_DEBUG("gRPC NfsReadDirPlus failed: " << response.message());
+                    if (attempt == 0 && staleHandle(path, response.errorcode())) {
+                        continue; // Retry with the directory looked up again
                     }
-                } else {
-                    cerr << "nfs_unlink gRPC communication failed: " << status.error_code() << " - " << status.error_message() << endl;
-
-                    // Retry on timeout or transient error
-                    if (status.error_code() == grpc::StatusCode::DEADLINE_EXCEEDED ||
-                        status.error_code() == grpc::StatusCode::UNAVAILABLE) {
-                        retry_count++;
-                        cout << "Retrying " << retry_count << "/" << max_retries << " after " << backoff_time << " second(s)..." << endl;
-
-                        // Wait for a backoff period before retrying
-                        this_thread::sleep_for(chrono::seconds(backoff_time));
-
-                        // Increase backoff time for the next retry
-                        backoff_time *= 2;
-
-                        // Reconnect if UNAVAILABLE
-                        // if (status.error_code() == grpc::StatusCode::UNAVAILABLE) {
-                        //     cout << "Re-establishing gRPC connection..." << endl;
-                        //     instance_->channel_ = grpc::CreateChannel(instance_->target_, grpc::InsecureChannelCredentials());
-                        //     instance_->stub_ = GrpcService::NewStub(instance_->channel_);
-                        // }
-                    } else {
-                        // Other errors, don't retry
-                        return -EIO;
+                    return -response.errorcode(); // Return the error code from server to FUSE as a negative value
+                }
+
+                AttrCache& cache = instance_->attr_cache_;
+                dir->entries.clear();
+                for (const auto& attr : response.entries()) {
+                    LOG_TRACE(attr.name());
+                    DirHandle::Entry entry;
+                    entry.name     = attr.name();
+                    entry.has_attr = true;
+                    entry.cookie   = attr.cookie();
+                    struct stat& st = entry.st;
+                    memset(&st, 0, sizeof(st));
+                    st.st_mode   = attr.mode();
+                    st.st_nlink  = attr.nlink();
+                    st.st_size   = attr.size();
+                    st.st_ino    = attr.ino();
+                    st.st_uid    = attr.uid();
+                    st.st_gid    = attr.gid();
+                    st.st_blocks = attr.blocks();
+                    st.st_atim   = nsToTimespec(attr.atime_ns());
+                    st.st_mtim   = nsToTimespec(attr.mtime_ns());
+                    st.st_ctim   = nsToTimespec(attr.ctime_ns());
+                    if (cache.enabled() && entry.name != "." && entry.name != "..") {
+                        cache.store(prefix + entry.name, st);
                     }
+                    dir->entries.push_back(move(entry));
                 }
+                dir->setPage(cookie, response.next_cookie(), response.eof());
+                return 0;
             }
-
-            cerr << "Failed to unlink file after " << max_retries << " retries." << endl;
-            return -EIO; // Input/output error for failed retries
         }
 
-        static int nfs_rmdir(const char *path) {
-            cout << "Removing directory: " << path << endl;
+        static int fetchDirPage(const char *path, uint64_t cookie, DirHandle *dir) {
+            if (instance_->readdir_plus_) {
+                return readDirPlusPage(path, cookie, dir);
+            }
+            return readDirPage(path, cookie, dir);
+        }
 
-            int max_retries = 3;  // Set the maximum number of retries
-            int retry_count = 0;  // Initialize retry count
-            int backoff_time = 1; // Initial backoff time in seconds
+        static int nfs_opendir(const char *path, struct fuse_file_info *fi) {
+            fi->fh = reinterpret_cast<uint64_t>(new DirHandle());
+            return 0;
+        }
 
-            while (retry_count < max_retries) {
-                // Create gRPC client context and request/response objects
-                ClientContext context;
-                NfsRmdirRequest request;
-                NfsRmdirResponse response;
+        static int nfs_releasedir(const char *path, struct fuse_file_info *fi) {
+            delete reinterpret_cast<DirHandle *>(fi->fh);
+            fi->fh = 0;
+            return 0;
+        }
 
-                // Set timeout for the request (e.g., 1 second)
-                auto deadline = chrono::system_clock::now() + chrono::seconds(1);
-                context.set_deadline(deadline);
+        // Streams the listing to the kernel a page at a time. Every entry is
+        // filled with its cookie as the offset, so when the kernel's buffer is
+        // full FUSE comes back with the cookie of the last entry it took and we
+        // resume there, from the buffered page when possible.
+        static int nfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
+            LOG_DEBUG("Reading directory: " << path << " from cookie " << offset);
 
-                // Prepare the request
-                request.set_path(path);
+            DirHandle *dir = reinterpret_cast<DirHandle *>(fi->fh);
+            unique_ptr<DirHandle> one_shot;
+            if (dir == nullptr) {
+                one_shot.reset(new DirHandle());
+                dir = one_shot.get();
+            }
+            lock_guard<mutex> guard(dir->lock);
 
-                // Make the gRPC call
-                Status status = instance_->stub_->NfsRmdir(&context, request, &response);
+            size_t index;
+            if (!dir->locate(offset, &index)) {
+                int result = fetchDirPage(path, offset, dir);
+                if (result < 0) {
+                    return result;
+                }
+                index = 0;
+            }
 
-                if (status.ok()) {
-                    if (response.success()) {
-                        cout << "Directory removed successfully: " << path << endl;
-                        return 0; // Directory removed successfully
-                    } else {
-                        cerr << "gRPC NfsRmdir failed: " << response.message() << endl;
-                        return -response.errorcode(); // Return the error code from server to FUSE as a negative value
-                    }
-                } else {
-                    cerr << "nfs_rmdir gRPC communication failed: " << status.error_code() << " - " << status.error_message() << endl;
-
-                    // Retry on timeout or transient error
-                    if (status.error_code() == grpc::StatusCode::DEADLINE_EXCEEDED ||
-                        status.error_code() == grpc::StatusCode::UNAVAILABLE) {
-                        retry_count++;
-                        cout << "Retrying " << retry_count << "/" << max_retries << " after " << backoff_time << " second(s)..." << endl;
-
-                        // Wait for a backoff period before retrying
-                        this_thread::sleep_for(chrono::seconds(backoff_time));
-
-                        // Increase backoff time for the next retry
-                        backoff_time *= 2;
-
-                        // Reconnect if UNAVAILABLE
-                        // if (status.error_code() == grpc::StatusCode::UNAVAILABLE) {
-                        //     cout << "Re-establishing gRPC connection..." << endl;
-                        //     instance_->channel_ = grpc::CreateChannel(instance_->target_, grpc::InsecureChannelCredentials());
-                        //     instance_->stub_ = GrpcService::NewStub(instance_->channel_);
-                        // }
-                    } else {
-                        // Other errors, don't retry
-                        return -EIO;
+            while (true) {
+                for (; index < dir->entries.size(); index++) {
+                    const DirHandle::Entry& entry = dir->entries[index];
+                    enum fuse_fill_dir_flags fill_flags = entry.has_attr ? FUSE_FILL_DIR_PLUS : (enum fuse_fill_dir_flags)0;
+                    if (filler(buf, entry.name.c_str(), entry.has_attr ? &entry.st : nullptr, entry.cookie, fill_flags) != 0) {
+                        return 0; // Kernel buffer is full, it will ask again from this entry's offset
                     }
                 }
+                if (dir->eof) {
+                    return 0;
+                }
+                int result = fetchDirPage(path, dir->next_cookie, dir);
+                if (result < 0) {
+                    return result;
+                }
+                index = 0;
+                if (dir->entries.empty() && dir->eof) {
+                    return 0;
+                }
             }
-
-            cerr << "Failed to remove directory after " << max_retries << " retries." << endl;
-            return -EIO; // Input/output error for failed retries
         }
 
-        static int nfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
-            cout << "Creating file: " << path << " with mode: " << oct << mode << endl;
+        static int nfs_unlink(const char *path) {
+            LOG_DEBUG("Unlinking file: " << path);
 
-            if (mode == 0) {
-                mode = 0666;
-            }
+            NfsUnlinkRequest request;
+            NfsUnlinkResponse response;
+            for (int attempt = 0;; attempt++) {
+                setTarget(request, path);
 
-            int max_retries = 3;  // Set the maximum number of retries
-            int retry_count = 0;  // Initialize retry count
-            int backoff_time = 1; // Initial backoff time in seconds
+                Status status = invoke(RpcOp::Unlink, &ChannelPool::metadata, &GrpcService::Stub::NfsUnlink, request, &response);
+                if (!status.ok()) {
+                    return -EIO; // invoke() already retried what could be retried
+                }
 
-            while (retry_count < max_retries) {
-                // Create gRPC client context and request/response objects
-                ClientContext context;
-                NfsCreateRequest request;
-                NfsCreateResponse response;
+                if (response.success()) {
+                    instance_->page_cache_.invalidate(path);
+                    instance_->attr_cache_.invalidateWithParent(path);
+                    LOG_DEBUG("File unlinked successfully: " << path);
+                    return 0; // File unlinked successfully
+                }
+                LOG_DEBUG("gRPC NfsUnlink failed: " << response.message());
+                if (attempt == 0 && staleHandle(path, response.errorcode())) {
+                    continue; // Retry with the directory looked up again
+                }
+                return -response.errorcode(); // Return the error code from server to FUSE as a negative value
+            }
+        }
 
-                // Set timeout for the request (e.g., 1 second)
-                auto deadline = chrono::system_clock::now() + chrono::seconds(1);
-                context.set_deadline(deadline);
+        static int nfs_rmdir(const char *path) {
+            LOG_DEBUG("Removing directory: " << path);
 
-                // Prepare the request
-                request.set_path(path);
-                request.set_mode(mode);
+            NfsRmdirRequest request;
+            NfsRmdirResponse response;
+            for (int attempt = 0;; attempt++) {
+                setTarget(request, path);
 
-                // Make the gRPC call
-                Status status = instance_->stub_->NfsCreate(&context, request, &response);
+                Status status = invoke(RpcOp::Rmdir, &ChannelPool::metadata, &GrpcService::Stub::NfsRmdir, request, &response);
+                if (!status.ok()) {
+                    return -EIO; // invoke() already retried what could be retried
+                }
 
-                if (status.ok()) {
-                    if (response.success()) {
-                        cout << "File created successfully: " << path << endl;
-                        fi->fh = -1;
-                        return 0; // File created successfully
-                    } else {
-                        cerr << "gRPC NfsCreate failed: " << response.message() << endl;
-                        return -response.errorcode(); // Return the error code from server to FUSE as a negative value
-                    }
-                } else {
-                    cerr << "nfs_create gRPC communication failed: " << status.error_code() << " - " << status.error_message() << endl;
-
-                    // Retry on timeout or transient error
-                    if (status.error_code() == grpc::StatusCode::DEADLINE_EXCEEDED ||
-                        status.error_code() == grpc::StatusCode::UNAVAILABLE) {
-                        retry_count++;
-                        cout << "Retrying " << retry_count << "/" << max_retries << " after " << backoff_time << " second(s)..." << endl;
-
-                        // Wait for a backoff period before retrying
-                        this_thread::sleep_for(chrono::seconds(backoff_time));
-
-                        // Increase backoff time for the next retry
-                        backoff_time *= 2;
-
-                        // Reconnect if UNAVAILABLE
-                        // if (status.error_code() == grpc::StatusCode::UNAVAILABLE) {
-                        //     cout << "Re-establishing gRPC connection..." << endl;
-                        //     instance_->channel_ = grpc::CreateChannel(instance_->target_, grpc::InsecureChannelCredentials());
-                        //     instance_->stub_ = GrpcService::NewStub(instance_->channel_);
-                        // }
-                    } else {
-                        // Other errors, don't retry
-                        return -EIO;
-                    }
+                if (response.success()) {
+                    instance_->attr_cache_.invalidateWithParent(path);
+                    instance_->lookups_.invalidateTree(path);
+                    LOG_DEBUG("Directory removed successfully: " << path);
+                    return 0; // Directory removed successfully
+                }
+                LOG_DEBUG("gRPC NfsRmdir failed: " << response.message());
+                if (attempt == 0 && staleHandle(path, response.errorcode())) {
+                    continue; // Retry with the directory looked up again
                 }
+                return -response.errorcode(); // Return the error code from server to FUSE as a negative value
             }
-
-            cerr << "Failed to create file after " << max_retries << " retries." << endl;
-            return -EIO; // Input/output error for failed retries
         }
 
-        static int nfs_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi) {
-            cout << "Updating timestamps for path: " << path << endl;
+        static int nfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+            LOG_DEBUG("Creating file: " << path << " with mode: " << oct << mode);
 
-            int max_retries = 3;  // Set the maximum number of retries
-            int retry_count = 0;  // Initialize retry count
-            int backoff_time = 1; // Initial backoff time in seconds
+            if (mode == 0) {
+                mode = 0666;
+            }
 
-            while (retry_count < max_retries) {
-                // Create gRPC client context and request/response objects
-                ClientContext context;
-                NfsUtimensRequest request;
-                NfsUtimensResponse response;
+            NfsCompoundRequest compound;
+            NfsCreateRequest *create = compound.add_ops()->mutable_create();
+            setTarget(*create, path);
+            create->set_mode(mode);
+            create->set_flags(fi->flags);
+            NfsCompoundResponse compound_response;
+            int result = compoundWithAttr("nfs_create", path, compound, &compound_response);
+            if (result != -ENOSYS) {
+                if (result < 0) {
+                    return result;
+                }
+                fi->fh = compound_response.results(0).create().fh(); // Server handle for read/write/release
+                instance_->page_cache_.invalidate(path);
+                instance_->attr_cache_.invalidateWithParent(path);
+                cacheCompoundAttr(path, compound_response);
+                return 0;
+            }
 
-                // Set timeout for the request (e.g., 1 second)
-                auto deadline = chrono::system_clock::now() + chrono::seconds(1);
-                context.set_deadline(deadline);
+            NfsCreateRequest request;
+            NfsCreateResponse response;
+            request.set_mode(mode);
+            request.set_flags(fi->flags);
+            for (int attempt = 0;; attempt++) {
+                setTarget(request, path);
 
-                // Prepare the request
-                request.set_path(path);
-                request.set_atime(tv[0].tv_sec);  // Set access time from tv[0]
-                request.set_mtime(tv[1].tv_sec);  // Set modification time from tv[1]
+                Status status = invoke(RpcOp::Create, &ChannelPool::metadata, &GrpcService::Stub::NfsCreate, request, &response);
+                if (!status.ok()) {
+                    return -EIO; // invoke() already retried what could be retried
+                }
 
-                // Make the gRPC call
-                Status status = instance_->stub_->NfsUtimens(&context, request, &response);
+                if (response.success()) {
+                    LOG_DEBUG("File created successfully: " << path);
+                    fi->fh = response.fh(); // Server handle for read/write/release
+                    instance_->page_cache_.invalidate(path);
+                    instance_->attr_cache_.invalidateWithParent(path);
+                    return 0; // File created successfully
+                }
+                LOG_DEBUG("gRPC NfsCreate failed: " << response.message());
+                if (attempt == 0 && staleHandle(path, response.errorcode())) {
+                    continue; // Retry with the directory looked up again
+                }
+                return -response.errorcode(); // Return the error code from server to FUSE as a negative value
+            }
+        }
 
-                if (status.ok()) {
-                    if (response.success()) {
-                        cout << "Timestamps updated successfully for path: " << path << endl;
-                        return 0; // Success
-                    } else {
-                        cerr << "gRPC NfsUtimens failed: " << response.errorcode() << " - " << response.message() << endl;
-                        return -response.errorcode(); // Return the error code from server
-                    }
-                } else {
-                    cerr << "nfs_utimens gRPC communication failed: " << status.error_code() << " - " << status.error_message() << endl;
-
-                    // Retry on timeout or transient error
-                    if (status.error_code() == grpc::StatusCode::DEADLINE_EXCEEDED ||
-                        status.error_code() == grpc::StatusCode::UNAVAILABLE) {
-                        retry_count++;
-                        cout << "Retrying " << retry_count << "/" << max_retries << " after " << backoff_time << " second(s)..." << endl;
-
-                        // Wait for a backoff period before retrying
-                        this_thread::sleep_for(chrono::seconds(backoff_time));
-
-                        // Increase backoff time for the next retry
-                        backoff_time *= 2;
-
-                        // Reconnect if UNAVAILABLE
-                        // if (status.error_code() == grpc::StatusCode::UNAVAILABLE) {
-                        //     cout << "Re-establishing gRPC connection..." << endl;
-                        //     instance_->channel_ = grpc::CreateChannel(instance_->target_, grpc::InsecureChannelCredentials());
-                        //     instance_->stub_ = GrpcService::NewStub(instance_->channel_);
-                        // }
-                    } else {
-                        // Other errors, don't retry
-                        return -EIO;
-                    }
+        static int nfs_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi) {
+            LOG_DEBUG("Updating timestamps for path: " << path);
+
+            NfsCompoundRequest compound;
+            NfsUtimensRequest *utimens = compound.add_ops()->mutable_utimens();
+            setTarget(*utimens, path);
+            utimens->set_atime(tv[0].tv_sec);
+            utimens->set_mtime(tv[1].tv_sec);
+            NfsCompoundResponse compound_response;
+            int result = compoundWithAttr("nfs_utimens", path, compound, &compound_response);
+            if (result != -ENOSYS) {
+                if (result == 0) {
+                    instance_->attr_cache_.invalidate(path);
+                    cacheCompoundAttr(path, compound_response);
                 }
+                return result;
             }
 
-            cerr << "Failed to update timestamps after " << max_retries << " retries." << endl;
-            return -EIO; // Input/output error for failed retries
+            NfsUtimensRequest request;
+            NfsUtimensResponse response;
+            request.set_atime(tv[0].tv_sec);  // Set access time from tv[0]
+            request.set_mtime(tv[1].tv_sec);  // Set modification time from tv[1]
+            for (int attempt = 0;; attempt++) {
+                setTarget(request, path);
+
+                Status status = invoke(RpcOp::Utimens, &ChannelPool::metadata, &GrpcService::Stub::NfsUtimens, request, &response);
+                if (!status.ok()) {
+                    return -EIO; // invoke() already retried what could be retried
+                }
+
+                if (response.success()) {
+                    instance_->attr_cache_.invalidate(path);
+                    LOG_DEBUG("Timestamps updated successfully for path: " << path);
+                    return 0; // Success
+                }
+                LOG_DEBUG("gRPC NfsUtimens failed: " << response.errorcode() << " - " << response.message());
+                if (attempt == 0 && staleHandle(path, response.errorcode())) {
+                    continue; // Retry with the directory looked up again
+                }
+                return -response.errorcode(); // Return the error code from server
+            }
         }
 
         static int nfs_mkdir(const char *path, mode_t mode) {
             if (mode == 0) {
                 mode = 0755;
             }
-            cout << "Creating directory: " << path << " with mode: " << mode << endl;
+            LOG_DEBUG("Creating directory: " << path << " with mode: " << mode);
+
+            NfsCompoundRequest compound;
+            NfsMkdirRequest *mkdir = compound.add_ops()->mutable_mkdir();
+            setTarget(*mkdir, path);
+            mkdir->set_mode(mode);
+            NfsCompoundResponse compound_response;
+            int result = compoundWithAttr("nfs_mkdir", path, compound, &compound_response);
+            if (result != -ENOSYS) {
+                if (result == 0) {
+                    instance_->attr_cache_.invalidateWithParent(path);
+                    cacheCompoundAttr(path, compound_response);
+                }
+                return result;
+            }
 
-            int max_retries = 3;  // Set the maximum number of retries
-            int retry_count = 0;  // Initialize retry count
-            int backoff_time = 1; // Initial backoff time in seconds
+            NfsMkdirRequest request;
+            NfsMkdirResponse response;
+            request.set_mode(mode);
+            for (int attempt = 0;; attempt++) {
+                setTarget(request, path);
 
-            while (retry_count < max_retries) {
-                // Create gRPC client context and request/response objects
-                ClientContext context;
-                NfsMkdirRequest request;
-                NfsMkdirResponse response;
+                Status status = invoke(RpcOp::Mkdir, &ChannelPool::metadata, &GrpcService::Stub::NfsMkdir, request, &response);
+                if (!status.ok()) {
+                    return -EIO; // invoke() already retried what could be retried
+                }
 
-                // Set timeout for the request (e.g., 1 second)
-                auto deadline = chrono::system_clock::now() + chrono::seconds(1);
-                context.set_deadline(deadline);
+                if (response.success()) {
+                    instance_->attr_cache_.invalidateWithParent(path);
+                    LOG_DEBUG("Directory created successfully: " << path);
+                    return 0; // Success
+                }
+                LOG_DEBUG("gRPC NfsMkdir failed with error code: " << response.errorcode() << " - " << response.message());
+                if (attempt == 0 && staleHandle(path, response.errorcode())) {
+                    continue; // Retry with the directory looked up again
+                }
+                return -response.errorcode(); // Return the error code from the server
+            }
+        }
 
-                // Prepare the request
-                request.set_path(path);
-                request.set_mode(mode);
+        static int nfs_truncate(const char *path, off_t size, struct fuse_file_info *fi) {
+            LOG_DEBUG("Truncate called on file: " << path << " with size: " << size);
+            instance_->page_cache_.invalidate(path);
+            instance_->attr_cache_.invalidate(path);
+            return 0; // Indicate success
+        }
 
-                // Make the gRPC call
-                Status status = instance_->stub_->NfsMkdir(&context, request, &response);
+        // Lets the kernel cache attributes and lookups for as long as we do
+        static void* nfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+            double timeout = instance_->attr_cache_.ttl().count() / 1000.0;
+            cfg->attr_timeout  = timeout;
+            cfg->entry_timeout = timeout;
+            if (instance_->buf_ops_) {
+                // Let FUSE move request and reply data through pipes instead of copying
+                conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+            }
+            instance_->readahead_.start();
+            startStatsDumper();
+            return instance_;
+        }
 
-                if (status.ok()) {
-                    if (response.success()) {
-                        cout << "Directory created successfully: " << path << endl;
-                        return 0; // Success
-                    } else {
-                        cerr << "gRPC NfsMkdir failed with error code: " << response.errorcode() << " - " << response.message() << endl;
-                        return -response.errorcode(); // Return the error code from the server
-                    }
-                } else {
-                    cerr << "nfs_mkdir gRPC communication failed: " << status.error_code() << " - " << status.error_message() << endl;
-
-                    // Retry on timeout or transient error
-                    if (status.error_code() == grpc::StatusCode::DEADLINE_EXCEEDED ||
-                        status.error_code() == grpc::StatusCode::UNAVAILABLE) {
-                        retry_count++;
-                        cout << "Retrying " << retry_count << "/" << max_retries << " after " << backoff_time << " second(s)..." << endl;
-
-                        // Wait for a backoff period before retrying
-                        this_thread::sleep_for(chrono::seconds(backoff_time));
-
-                        // Increase backoff time for the next retry
-                        backoff_time *= 2;
-
-                        // Reconnect if UNAVAILABLE
-                        // if (status.error_code() == grpc::StatusCode::UNAVAILABLE) {
-                        //     cout << "Re-establishing gRPC connection..." << endl;
-                        //     instance_->channel_ = grpc::CreateChannel(instance_->target_, grpc::InsecureChannelCredentials());
-                        //     instance_->stub_ = GrpcService::NewStub(instance_->channel_);
-                        // }
-                    } else {
-                        // Other errors, don't retry
-                        return -EIO;
-                    }
+        // SIGUSR1 logs the RPC statistics. The handler only writes a byte to
+        // a pipe; a thread started here, after FUSE has daemonized, reads it
+        // and does the formatting.
+        static void startStatsDumper() {
+            if (pipe2(stats_pipe_, O_CLOEXEC) != 0) {
+                LOG_WARN("No SIGUSR1 statistics dump: " << strerror(errno));
+                return;
+            }
+            thread([] {
+                char byte;
+                while (read(stats_pipe_[0], &byte, 1) > 0) {
+                    instance_->rpc_stats_.report();
                 }
+            }).detach();
+
+            struct sigaction action;
+            memset(&action, 0, sizeof(action));
+            action.sa_handler = [](int) {
+                char byte = 0;
+                ssize_t written = write(stats_pipe_[1], &byte, 1);
+                (void)written; // Nothing to do about a full pipe, a dump is already pending
+            };
+            sigemptyset(&action.sa_mask);
+            action.sa_flags = SA_RESTART;
+            sigaction(SIGUSR1, &action, nullptr);
+        }
+
+        // The RPC statistics, as text, are the kStatsXattr attribute of the
+        // mount root. Nothing else has extended attributes.
+        static int nfs_getxattr(const char *path, const char *name, char *value, size_t size) {
+            if (strcmp(path, "/") != 0 || strcmp(name, kStatsXattr) != 0) {
+                return -ENODATA;
+            }
+            string text = instance_->rpc_stats_.format();
+            if (size == 0) {
+                return text.size();
+            }
+            if (size < text.size()) {
+                return -ERANGE;
             }
+            memcpy(value, text.data(), text.size());
+            return text.size();
+        }
 
-            cerr << "Failed to create directory after " << max_retries << " retries." << endl;
-            return -EIO; // Input/output error for failed retries
+        static int nfs_listxattr(const char *path, char *list, size_t size) {
+            if (strcmp(path, "/") != 0) {
+                return 0;
+            }
+            size_t length = strlen(kStatsXattr) + 1;
+            if (size == 0) {
+                return length;
+            }
+            if (size < length) {
+                return -ERANGE;
+            }
+            memcpy(list, kStatsXattr, length);
+            return length;
         }
 
-        static int nfs_truncate(const char *path, off_t size, struct fuse_file_info *fi) {
-            cout << "Truncate called on file: " << path << " with size: " << size << endl;
-            return 0; // Indicate success
+        static void nfs_destroy(void *private_data) {
+            LOG_INFO("Attribute cache: " << instance_->attr_cache_.hits() << " hits, "
+                 << instance_->attr_cache_.misses() << " misses");
+            LOG_INFO("Page cache: " << instance_->page_cache_.hits() << " hits, "
+                 << instance_->page_cache_.misses() << " misses");
+            LOG_INFO("Readahead: " << instance_->readahead_.windows() << " windows, "
+                 << instance_->readahead_.prefetchedBytes() << " bytes prefetched, "
+                 << instance_->readahead_.seeks() << " seeks");
+            if (instance_->handles_) {
+                LOG_INFO("Directory handles: " << instance_->lookups_.hits() << " hits, "
+                     << instance_->lookups_.misses() << " misses");
+            }
+            instance_->rpc_stats_.report();
         }
 
         void run_fuse_main(int argc, char** argv)
@@ -899,35 +2594,160 @@ class FuseGrpcClient {
                 .open    = nfs_open,
                 .read    = nfs_read,
                 .write   = nfs_write,
+                .flush   = nfs_flush,
                 .release = nfs_release,
+                .getxattr = nfs_getxattr,
+                .listxattr = nfs_listxattr,
+                .opendir = nfs_opendir,
                 .readdir = nfs_readdir,
+                .releasedir = nfs_releasedir,
+                .init    = nfs_init,
+                .destroy = nfs_destroy,
                 .create  = nfs_create,
                 .utimens = nfs_utimens,
+                .write_buf = nfs_write_buf,
+                .read_buf  = nfs_read_buf,
             };
+            if (!buf_ops_) {
+                // Plain read/write callbacks, FUSE copies through its own buffers
+                nfs_oper.write_buf = nullptr;
+                nfs_oper.read_buf  = nullptr;
+            }
 
             fuse_main(argc, argv, &nfs_oper, NULL);
         }
 };
 
 FuseGrpcClient* FuseGrpcClient::instance_ = nullptr;
+int FuseGrpcClient::stats_pipe_[2] = {-1, -1};
+
+// Pulls our --name=value options out of argv (after the server address) so
+// that only FUSE arguments are left behind. Returns false on a bad value.
+bool parseClientOptions(int& argc, char** argv, ClientOptions& options) {
+    int kept = 2;
+    for (int i = 2; i < argc; i++) {
+        string arg = argv[i];
+        size_t eq = arg.find('=');
+        if (arg.compare(0, 2, "--") != 0 || eq == string::npos) {
+            argv[kept++] = argv[i];
+            continue;
+        }
+
+        string name  = arg.substr(2, eq - 2);
+        string value = arg.substr(eq + 1);
+        try {
+            if (name == "page_cache_mb") {
+                options.page_cache_bytes = stoull(value) * 1024 * 1024;
+            } else if (name == "page_size_kb") {
+                options.page_size = stoull(value) * 1024;
+            } else if (name == "attr_ttl_ms") {
+                options.attr_ttl_ms = stoi(value);
+            } else if (name == "write_mode") {
+                if (value == "sync") {
+                    options.write_mode = WriteMode::Sync;
+                } else if (value == "async") {
+                    options.write_mode = WriteMode::WriteBack;
+                } else if (value == "stream") {
+                    options.write_mode = WriteMode::Stream;
+                } else {
+                    throw invalid_argument(value);
+                }
+            } else if (name == "stream_read_kb") {
+                options.stream_threshold = stoull(value) * 1024;
+            } else if (name == "stream_chunk_kb") {
+                options.stream_chunk = stoull(value) * 1024;
+            } else if (name == "readahead_kb") {
+                options.readahead_max = stoull(value) * 1024;
+            } else if (name == "readahead_threads") {
+                options.readahead_threads = stoi(value);
+            } else if (name == "readdir_page") {
+                options.readdir_page = stoi(value);
+            } else if (name == "readdir_plus") {
+                options.readdir_plus = stoi(value) != 0;
+            } else if (name == "compound") {
+                options.compound = stoi(value) != 0;
+            } else if (name == "handles") {
+                options.handles = stoi(value) != 0;
+            } else if (name == "handle_ttl_ms") {
+                options.handle_ttl_ms = stoi(value);
+            } else if (name == "adaptive_deadlines") {
+                options.adaptive_deadlines = stoi(value) != 0;
+            } else if (name == "deadline_min_ms") {
+                options.deadline_min_ms = stoi(value);
+            } else if (name == "deadline_max_ms") {
+                options.deadline_max_ms = stoi(value);
+            } else if (name == "hedge") {
+                options.hedge = stoi(value) != 0;
+            } else if (name == "retry_budget") {
+                options.retry_budget = stoi(value);
+            } else if (name == "compression") {
+                if (!nfscompress::parseAlgorithm(value, &options.compression.algorithm)) {
+                    throw invalid_argument(value);
+                }
+            } else if (name == "compress_min_kb") {
+                options.compression.min_bytes = stoull(value) * 1024;
+            } else if (name == "compress_max_entropy") {
+                options.compression.max_entropy = stod(value);
+            } else if (name == "channels") {
+                options.data_channels = stoi(value);
+            } else if (name == "meta_channels") {
+                options.metadata_channels = stoi(value);
+            } else if (name == "channel_select") {
+                if (value == "thread") {
+                    options.channel_select = ChannelSelect::Thread;
+                } else if (value == "least") {
+                    options.channel_select = ChannelSelect::LeastLoaded;
+                } else {
+                    throw invalid_argument(value);
+                }
+            } else if (name == "fuse_buf") {
+                options.buf_ops = stoi(value) != 0;
+            } else if (name == "log_level") {
+                int level;
+                if (!nfslog::Logger::parseLevel(value, level)) {
+                    throw invalid_argument(value);
+                }
+                nfslog::Logger::instance().setLevel(level);
+            } else if (name == "log_payload") {
+                nfslog::Logger::instance().setPayload(stoi(value) != 0);
+            } else {
+                argv[kept++] = argv[i]; // Not ours, leave it for FUSE
+            }
+        } catch (const exception&) {
+            LOG_ERROR("Invalid value for --" << name << ": " << value);
+            return false;
+        }
+    }
+    argc = kept;
+    argv[argc] = nullptr;
+    return true;
+}
 
 int main(int argc, char** argv) {
     // Check if the first argument is provided
     if (argc < 2) {
-        cerr << "Usage: " << argv[0] << " <server_ip:port> [additional_arguments]" << endl;
+        LOG_ERROR("Usage: " << argv[0] << " <server_ip:port> [--page_cache_mb=N] [--page_size_kb=N] [--attr_ttl_ms=N] [--write_mode=sync|async|stream]"
+             << " [--stream_read_kb=N] [--stream_chunk_kb=N] [--readahead_kb=N] [--readahead_threads=N] [--fuse_buf=0|1] [--readdir_plus=0|1] [--readdir_page=N] [--compound=0|1]"
+             << " [--handles=0|1] [--handle_ttl_ms=N] [--channels=N] [--meta_channels=N] [--channel_select=thread|least]"
+             << " [--adaptive_deadlines=0|1] [--deadline_min_ms=N] [--deadline_max_ms=N] [--hedge=0|1] [--retry_budget=N]"
+             << " [--compression=none|gzip|deflate] [--compress_min_kb=N] [--compress_max_entropy=BITS]"
+             << " [--log_level=trace|debug|info|warn|error|off] [--log_payload=0|1] [fuse_arguments]");
         return 1;
     }
 
     string target_str = argv[1]; // Expecting server ip address:port
 
+    ClientOptions options;
+    if (!parseClientOptions(argc, argv, options)) {
+        return 1;
+    }
+
     grpc::ChannelArguments args;
     args.SetInt(GRPC_ARG_MAX_RECONNECT_BACKOFF_MS, 5000);
     args.SetInt(GRPC_ARG_MIN_RECONNECT_BACKOFF_MS, 1000);
 
-    auto channel = grpc::CreateCustomChannel(target_str, grpc::InsecureChannelCredentials(), args);
-
-    // Create the gRPC client
-    FuseGrpcClient client(channel, target_str);
+    // Create the gRPC client, which opens its own pool of channels with these arguments
+    FuseGrpcClient client(target_str, args, options);
     // FuseGrpcClient client(grpc::CreateChannel(target_str, grpc::InsecureChannelCredentials()), target_str);
     
     // Pass the rest of the arguments to run_fuse_main
@@ -3,6 +3,10 @@
 #include <string>   
 #include <grpcpp/grpcpp.h>
 #include "grpc_service.grpc.pb.h"
+#include "logging.h"
+#include "compression.h"
+#include "histogram.h"
+#include "rpc_limits.h"
 
 // For getting the server IP
 #include <ifaddrs.h>
@@ -12,10 +16,32 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <fcntl.h> // For open and pread
+#include <climits> // For PATH_MAX
+#include <sys/uio.h> // For pwritev
 #include <cstring> // For memset
+#include <pthread.h> // For pinning pollers to cores
+#include <sched.h>
+
+// Handle table and write-back buffering
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 // Directory Manipulating
 #include <dirent.h>
+#include <poll.h>
+#include <sys/inotify.h> // For metadata cache invalidation
 
 using grpc::Status;
 using grpc::ServerContext;
@@ -26,25 +52,1843 @@ using grpc::ServerWriter;
 using grpc::InsecureServerCredentials;
 using namespace std;
 
-struct WriteCommand {
-    off_t offset;
-    size_t size;
-    std::string content;
+// Which server implementation RunServer starts
+enum class ServerEngine {
+    Sync,  // gRPC's synchronous server, handlers run on its thread pool
+    Async, // Completion queue per core plus an I/O worker pool
 };
 
+// Tunables given on the command line after the storage directory
+struct ServerOptions {
+    size_t                    max_open_handles      = 1024;
+    std::chrono::milliseconds handle_idle           = std::chrono::seconds(60);
+    size_t                    write_back_high_water = 64 * 1024 * 1024;
+    std::chrono::milliseconds write_back_interval   = std::chrono::seconds(5);
+    ServerEngine              engine                = ServerEngine::Sync;
+    int                       sync_max_threads      = 0;    // Cap on gRPC sync threads, 0 for the gRPC default
+    int                       completion_queues     = 0;    // Async engine, 0 for one per core
+    bool                      pin_pollers           = true; // Pin each completion queue's poller to a core
+    int                       io_threads            = 0;    // Async engine, 0 for two per core
+    size_t                    io_queue_depth        = 1024; // Queued handlers before pollers block
+    size_t                    md_cache_entries      = 64 * 1024; // Cached stats and listings, 0 disables
+    std::chrono::milliseconds md_cache_ttl          = std::chrono::seconds(30);
+    size_t                    max_dir_handles       = 4096; // Directories held open for NfsLookup handles
+    std::string               metrics_file;                 // Prometheus text dump, empty for none
+    std::chrono::milliseconds metrics_interval      = std::chrono::seconds(10);
+    bool                      compress_replies      = true; // Compress read replies for clients that ask
+    size_t                    compress_min_bytes    = 32 * 1024;
+    double                    compress_max_entropy  = 7.0;  // Bits per byte, see compression.h
+};
+
+static int64_t steadyNowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Time this thread has spent in syscalls run through timedSyscall, -1 if it
+// made none since the last reset. RpcScope resets it when an RPC starts and
+// records it when the RPC ends; outside an RPC nothing reads it.
+static thread_local int64_t thread_syscall_ns = -1;
+
+// Runs call, a file system syscall, and adds its time to thread_syscall_ns.
+// Leaves errno as the syscall set it.
+template <typename Call>
+static auto timedSyscall(Call call) -> decltype(call()) {
+    int64_t start = steadyNowNs();
+    auto result = call();
+    thread_syscall_ns = std::max<int64_t>(thread_syscall_ns, 0) + steadyNowNs() - start;
+    return result;
+}
+
+static int64_t timespecNs(const struct timespec& ts) {
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+// A file held open on behalf of a client handle. The descriptor is closed when
+// the last reference drops, so evicting a handle never pulls the fd out from
+// under a read or write that is still using it.
+struct OpenFile {
+    int fd;
+    std::string path;
+    int64_t flags;
+    std::atomic<int64_t> last_used_ns;
+
+    OpenFile(int fd, const std::string& path, int64_t flags)
+        : fd(fd), path(path), flags(flags), last_used_ns(steadyNowNs()) {}
+
+    ~OpenFile() {
+        if (fd >= 0 && close(fd) != 0) {
+            LOG_ERROR("Failed to close file descriptor: " << fd << ", error: " << strerror(errno));
+        }
+    }
+};
+
+// Server-issued file handles backed by real descriptors, so reads and writes
+// stop paying open()+close() per call. Handles carry a per-process epoch in
+// the upper 32 bits; a handle from an earlier server instance, or one that was
+// evicted, is transparently reopened from the path and flags sent alongside it
+// and re-registered under the same number.
+class FileHandleTable {
+    private:
+        static constexpr size_t kShards = 16;
+
+        struct Shard {
+            std::mutex mutex;
+            std::unordered_map<uint64_t, std::shared_ptr<OpenFile>> files;
+        };
+
+        Shard shards_[kShards];
+        std::atomic<size_t> open_count_{0};
+        std::atomic<uint32_t> next_id_{1};
+        uint64_t epoch_;
+        size_t max_open_;
+        std::chrono::milliseconds max_idle_;
+
+        std::mutex reaper_mutex_;
+        std::condition_variable reaper_cv_;
+        bool stopping_ = false;
+        std::thread reaper_;
+
+        Shard& shardFor(uint64_t fh) { return shards_[fh % kShards]; }
+
+        // Reopening must never recreate or truncate the file again
+        static int64_t reopenFlags(int64_t flags) {
+            return flags & ~(O_CREAT | O_EXCL | O_TRUNC);
+        }
+
+        void insert(uint64_t fh, const std::shared_ptr<OpenFile>& file) {
+            {
+                Shard& shard = shardFor(fh);
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                if (!shard.files.emplace(fh, file).second) {
+                    shard.files[fh] = file; // Lost a reopen race, keep the newest
+                    return;
+                }
+            }
+            if (++open_count_ > max_open_) {
+                evictLeastRecentlyUsed();
+            }
+        }
+
+        void evictLeastRecentlyUsed() {
+            uint64_t victim = 0;
+            int64_t oldest = std::numeric_limits<int64_t>::max();
+            for (Shard& shard : shards_) {
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                for (const auto& entry : shard.files) {
+                    int64_t used = entry.second->last_used_ns.load(std::memory_order_relaxed);
+                    if (used < oldest) {
+                        oldest = used;
+                        victim = entry.first;
+                    }
+                }
+            }
+            if (victim != 0 && release(victim)) {
+                LOG_DEBUG("Evicted file handle " << victim << " (open handle cap " << max_open_ << " reached)");
+            }
+        }
+
+        void evictIdle() {
+            int64_t cutoff = steadyNowNs() -
+                std::chrono::duration_cast<std::chrono::nanoseconds>(max_idle_).count();
+            for (Shard& shard : shards_) {
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                for (auto it = shard.files.begin(); it != shard.files.end();) {
+                    if (it->second->last_used_ns.load(std::memory_order_relaxed) < cutoff) {
+                        it = shard.files.erase(it);
+                        --open_count_;
+                    } else {
+                        ++it;
+                    }
+                }
+            }
+        }
+
+        void reapLoop() {
+            std::unique_lock<std::mutex> lock(reaper_mutex_);
+            while (!reaper_cv_.wait_for(lock, max_idle_ / 2, [this] { return stopping_; })) {
+                lock.unlock();
+                evictIdle();
+                lock.lock();
+            }
+        }
+
+    public:
+        FileHandleTable(size_t max_open, std::chrono::milliseconds max_idle)
+            : max_open_(max_open), max_idle_(max_idle) {
+            std::random_device rd;
+            epoch_   = static_cast<uint64_t>(rd()) << 32;
+            reaper_  = std::thread(&FileHandleTable::reapLoop, this);
+        }
+
+        ~FileHandleTable() {
+            {
+                std::lock_guard<std::mutex> lock(reaper_mutex_);
+                stopping_ = true;
+            }
+            reaper_cv_.notify_all();
+            reaper_.join();
+        }
+
+        // Opens full_path and registers it under a fresh handle. Returns 0 and
+        // leaves errno set on failure.
+        uint64_t open(const std::string& full_path, int64_t flags, mode_t mode = 0,
+                      std::shared_ptr<OpenFile>* opened = nullptr) {
+            return openAt(AT_FDCWD, full_path.c_str(), full_path, flags, mode, opened);
+        }
+
+        // open() for a name relative to dir_fd; full_path is what stale
+        // handles are reopened from
+        uint64_t openAt(int dir_fd, const char* name, const std::string& full_path, int64_t flags, mode_t mode = 0,
+                        std::shared_ptr<OpenFile>* opened = nullptr) {
+            int fd = ::openat(dir_fd, name, flags, mode);
+            if (fd < 0) {
+                return 0;
+            }
+            uint32_t id = next_id_++;
+            if (id == 0) {
+                id = next_id_++;
+            }
+            uint64_t fh = epoch_ | id;
+            auto file = std::make_shared<OpenFile>(fd, full_path, reopenFlags(flags));
+            insert(fh, file);
+            if (opened) {
+                *opened = file;
+            }
+            return fh;
+        }
+
+        // Returns the open file behind fh, reopening it if the handle is
+        // unknown or refers to a different path. fh == 0 yields a one-shot
+        // descriptor that is not registered. Returns nullptr with errno set.
+        std::shared_ptr<OpenFile> acquire(uint64_t fh, const std::string& full_path, int64_t flags) {
+            if (fh != 0) {
+                Shard& shard = shardFor(fh);
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                auto it = shard.files.find(fh);
+                if (it != shard.files.end() && it->second->path == full_path) {
+                    it->second->last_used_ns.store(steadyNowNs(), std::memory_order_relaxed);
+                    return it->second;
+                }
+            }
+
+            int fd = ::open(full_path.c_str(), reopenFlags(flags));
+            if (fd < 0) {
+                return nullptr;
+            }
+            auto file = std::make_shared<OpenFile>(fd, full_path, reopenFlags(flags));
+            if (fh != 0) {
+                LOG_INFO("Reopened stale file handle " << fh << " for: " << full_path);
+                insert(fh, file);
+            }
+            return file;
+        }
+
+        // Drops the handle; the descriptor closes once in-flight users finish
+        bool release(uint64_t fh) {
+            Shard& shard = shardFor(fh);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            if (shard.files.erase(fh) == 0) {
+                return false;
+            }
+            --open_count_;
+            return true;
+        }
+
+        size_t size() const { return open_count_.load(); }
+};
+
+// A directory held open with O_PATH for the handle protocol
+struct DirNode {
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    const std::string path; // Full path it was looked up by, for the path-keyed caches
+    std::string handle;     // What clients send back, set before the node is published
+    std::atomic<int64_t> last_used_ns;
+
+    // Read without a lock, so nothing changes once the node is in the table;
+    // a new name for the directory gets a new node
+    DirNode(int fd, dev_t dev, ino_t ino, const std::string& path)
+        : fd(fd), dev(dev), ino(ino), path(path), last_used_ns(steadyNowNs()) {}
+
+    ~DirNode() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+};
+
+// Directory handles for clients that resolve each path once with NfsLookup
+// and then address entries as (directory handle, name), so a request costs a
+// single-component *at() lookup however deep the tree is. A handle holds the
+// directory's device and inode and, where the file system supports it, its
+// kernel file handle from name_to_handle_at(). The O_PATH descriptor behind
+// a live handle pins the inode, so it cannot be reused under the client; an
+// evicted handle or one from an earlier server instance is recovered with
+// open_by_handle_at() when the server has CAP_DAC_READ_SEARCH, and is
+// answered with ESTALE otherwise, which makes the client look it up again.
+//
+//   handle = u64 id | u64 dev | u64 ino | i32 handle_type | f_handle bytes
+class DirHandleTable {
+    private:
+        struct Header {
+            uint64_t id;
+            uint64_t dev;
+            uint64_t ino;
+        };
+
+        std::mutex mutex_;
+        std::unordered_map<uint64_t, std::shared_ptr<DirNode>> nodes_;
+        std::map<std::pair<dev_t, ino_t>, uint64_t> ids_;
+        std::atomic<uint32_t> next_id_{1};
+        uint64_t epoch_;
+        size_t max_nodes_;
+        int root_fd_;           // Export root, mount reference for open_by_handle_at
+        std::string root_path_; // directory_path_ as requests spell it
+        std::string root_real_; // Its canonical form, as /proc reports recovered paths
+
+        static std::string joinPath(const std::string& dir, const std::string& name) {
+            if (name.empty()) {
+                return dir;
+            }
+            return (!dir.empty() && dir.back() == '/') ? dir + name : dir + "/" + name;
+        }
+
+        static std::string encode(const Header& header, const struct file_handle* kernel) {
+            std::string out(reinterpret_cast<const char*>(&header), sizeof(header));
+            if (kernel != nullptr) {
+                int32_t type = kernel->handle_type;
+                out.append(reinterpret_cast<const char*>(&type), sizeof(type));
+                out.append(reinterpret_cast<const char*>(kernel->f_handle), kernel->handle_bytes);
+            }
+            return out;
+        }
+
+        // Caller holds mutex_
+        void evictLocked() {
+            while (nodes_.size() >= max_nodes_) {
+                auto victim = nodes_.begin();
+                for (auto it = nodes_.begin(); it != nodes_.end(); ++it) {
+                    if (it->second->last_used_ns.load(std::memory_order_relaxed) <
+                        victim->second->last_used_ns.load(std::memory_order_relaxed)) {
+                        victim = it;
+                    }
+                }
+                ids_.erase(std::make_pair(victim->second->dev, victim->second->ino));
+                nodes_.erase(victim);
+            }
+        }
+
+        // Registers fd, an O_PATH directory, under id (0 for a fresh one).
+        // Returns the node, which may be an existing one for the same inode.
+        std::shared_ptr<DirNode> adopt(int fd, const std::string& path, uint64_t id) {
+            struct stat st;
+            if (timedSyscall([&] { return fstat(fd, &st); }) != 0) {
+                int error = errno;
+                close(fd);
+                errno = error;
+                return nullptr;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto known = ids_.find(std::make_pair(st.st_dev, st.st_ino));
+            if (known != ids_.end()) {
+                std::shared_ptr<DirNode>& slot = nodes_[known->second];
+                if (slot->path == path) {
+                    close(fd);
+                    slot->last_used_ns.store(steadyNowNs(), std::memory_order_relaxed);
+                    return slot;
+                }
+                // Reached by another name, after a rename or spelled differently:
+                // the same handle, but a node that carries the latest name.
+                // Requests still holding the old node keep its old path.
+                auto renamed = std::make_shared<DirNode>(fd, st.st_dev, st.st_ino, path);
+                renamed->handle = slot->handle;
+                slot = renamed;
+                return renamed;
+            }
+
+            auto node = std::make_shared<DirNode>(fd, st.st_dev, st.st_ino, path);
+            if (id == 0) {
+                uint32_t counter = next_id_++;
+                if (counter == 0) {
+                    counter = next_id_++;
+                }
+                id = epoch_ | counter;
+            }
+            Header header = {id, (uint64_t)st.st_dev, (uint64_t)st.st_ino};
+            union {
+                struct file_handle kernel;
+                char space[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+            } buffer;
+            buffer.kernel.handle_bytes = MAX_HANDLE_SZ;
+            int mount_id;
+            bool have_kernel = name_to_handle_at(fd, "", &buffer.kernel, &mount_id, AT_EMPTY_PATH) == 0;
+            node->handle = encode(header, have_kernel ? &buffer.kernel : nullptr);
+
+            evictLocked();
+            nodes_[id] = node;
+            ids_[std::make_pair(st.st_dev, st.st_ino)] = id;
+            return node;
+        }
+
+    public:
+        DirHandleTable(const std::string& root_path, size_t max_nodes)
+            : max_nodes_(std::max<size_t>(max_nodes, 1)), root_path_(root_path) {
+            std::random_device rd;
+            epoch_    = static_cast<uint64_t>(rd()) << 32;
+            root_fd_  = ::open(root_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC); // open_by_handle_at rejects O_PATH here
+            char* real = realpath(root_path.c_str(), nullptr);
+            if (real != nullptr) {
+                root_real_ = real;
+                free(real);
+            }
+        }
+
+        ~DirHandleTable() {
+            if (root_fd_ >= 0) {
+                close(root_fd_);
+            }
+        }
+
+        // Opens the directory at path relative to dir (the export root when
+        // dir is null) and returns its node. nullptr with errno set on failure.
+        std::shared_ptr<DirNode> lookup(const std::shared_ptr<DirNode>& dir, const std::string& path) {
+            std::string full = dir ? joinPath(dir->path, path) : root_path_ + path;
+            int fd = dir ? ::openat(dir->fd, path.empty() ? "." : path.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC)
+                         : ::open(full.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+            if (fd < 0) {
+                return nullptr;
+            }
+            return adopt(fd, full, 0);
+        }
+
+        // The node behind a client's handle. nullptr with errno set to ESTALE
+        // if it can no longer be resolved, EINVAL if it is not a handle.
+        std::shared_ptr<DirNode> resolve(const std::string& handle) {
+            if (handle.size() < sizeof(Header)) {
+                errno = EINVAL;
+                return nullptr;
+            }
+            Header header;
+            memcpy(&header, handle.data(), sizeof(header));
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto it = nodes_.find(header.id);
+                if (it != nodes_.end() && (uint64_t)it->second->dev == header.dev && (uint64_t)it->second->ino == header.ino) {
+                    it->second->last_used_ns.store(steadyNowNs(), std::memory_order_relaxed);
+                    return it->second;
+                }
+            }
+
+            // Evicted or from before a restart: reopen it from the kernel handle
+            size_t kernel_bytes = handle.size() - sizeof(Header);
+            if (root_fd_ < 0 || kernel_bytes <= sizeof(int32_t) || kernel_bytes - sizeof(int32_t) > MAX_HANDLE_SZ) {
+                errno = ESTALE;
+                return nullptr;
+            }
+            union {
+                struct file_handle kernel;
+                char space[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+            } buffer;
+            int32_t type;
+            memcpy(&type, handle.data() + sizeof(Header), sizeof(type));
+            buffer.kernel.handle_type  = type;
+            buffer.kernel.handle_bytes = kernel_bytes - sizeof(int32_t);
+            memcpy(buffer.kernel.f_handle, handle.data() + sizeof(Header) + sizeof(type), buffer.kernel.handle_bytes);
+            int fd = open_by_handle_at(root_fd_, &buffer.kernel, O_PATH | O_DIRECTORY | O_CLOEXEC);
+            if (fd < 0) {
+                LOG_DEBUG("Cannot reopen directory handle " << header.id << ": " << strerror(errno));
+                errno = ESTALE; // Unprivileged, or the directory is gone
+                return nullptr;
+            }
+
+            // Recover a path for it; outside the export it is not ours to serve
+            char link[64];
+            char target[PATH_MAX];
+            snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+            ssize_t n = readlink(link, target, sizeof(target) - 1);
+            size_t root = root_real_.size();
+            bool inside = n > 0 && root != 0 && (size_t)n >= root && root_real_.compare(0, root, target, root) == 0 &&
+                          ((size_t)n == root || target[root] == '/' || root_real_[root - 1] == '/');
+            if (!inside) {
+                close(fd);
+                errno = ESTALE;
+                return nullptr;
+            }
+            std::string path = root_path_ + std::string(target + root_real_.size(), n - root_real_.size());
+            std::shared_ptr<DirNode> node = adopt(fd, path, header.id);
+            if (!node || (uint64_t)node->dev != header.dev || (uint64_t)node->ino != header.ino) {
+                errno = ESTALE;
+                return nullptr;
+            }
+            LOG_INFO("Recovered directory handle " << header.id << " for: " << path);
+            return node;
+        }
+
+        // Full path of name inside node, as the path-keyed caches spell it
+        static std::string pathOf(const DirNode& node, const std::string& name) {
+            return joinPath(node.path, name);
+        }
+
+        size_t size() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return nodes_.size();
+        }
+};
+
+// Not-yet-written byte ranges of one file, kept as disjoint, non-adjacent
+// extents. Overlapping or touching writes are coalesced into the extent that
+// starts first, growing its buffer in place, so a run of appends costs
+// amortized linear copying instead of rebuilding the merged string each time.
+class DirtyExtents {
+    private:
+        std::map<off_t, std::string> extents_; // Start offset -> bytes
+        size_t bytes_ = 0;
+
+        // Folds every extent that starts at or before the end of `target` into it
+        void absorbFollowing(std::map<off_t, std::string>::iterator target) {
+            auto next = std::next(target);
+            while (next != extents_.end()) {
+                off_t target_end = target->first + (off_t)target->second.size();
+                if (next->first > target_end) {
+                    break;
+                }
+                off_t next_end = next->first + (off_t)next->second.size();
+                bytes_ -= next->second.size();
+                if (next_end > target_end) {
+                    size_t skip = target_end - next->first;
+                    target->second.append(next->second, skip, std::string::npos);
+                    bytes_ += next_end - target_end;
+                }
+                next = extents_.erase(next);
+            }
+        }
+
+    public:
+        void add(off_t offset, const char* data, size_t size) {
+            if (size == 0) {
+                return;
+            }
+
+            // The extent starting at or before offset, if the new range touches it
+            auto it = extents_.upper_bound(offset);
+            if (it != extents_.begin()) {
+                auto prev = std::prev(it);
+                if (prev->first + (off_t)prev->second.size() >= offset) {
+                    it = prev;
+                }
+            }
+
+            if (it != extents_.end() && it->first <= offset) {
+                // Overwrite/extend the existing buffer in place
+                std::string& buffer = it->second;
+                size_t rel = offset - it->first;
+                if (rel + size > buffer.size()) {
+                    bytes_ += rel + size - buffer.size();
+                    buffer.resize(rel + size);
+                }
+                memcpy(&buffer[rel], data, size);
+            } else {
+                it = extents_.emplace(offset, std::string(data, size)).first;
+                bytes_ += size;
+            }
+            absorbFollowing(it);
+        }
+
+        bool empty() const { return extents_.empty(); }
+        size_t bytes() const { return bytes_; }
+        size_t count() const { return extents_.size(); }
+
+        // Hands the extents to the caller and leaves this empty
+        std::map<off_t, std::string> take() {
+            std::map<off_t, std::string> taken;
+            taken.swap(extents_);
+            bytes_ = 0;
+            return taken;
+        }
+};
+
+// Server-side write-back for NfsWriteAsync. Writes are buffered per open
+// handle and reach the disk as one pwrite per coalesced extent when the file
+// is released, when total buffered bytes pass the high-water mark, or when a
+// buffer has been dirty longer than the flush interval. Errors from a
+// background flush are remembered and reported on release.
+class WriteBackCache {
+    private:
+        struct DirtyFile {
+            std::mutex mutex;
+            std::shared_ptr<OpenFile> file;
+            DirtyExtents extents;
+            int64_t dirty_since_ns = 0;
+            int error = 0; // First failure from a background flush
+        };
+
+        std::mutex mutex_;
+        std::unordered_map<uint64_t, std::shared_ptr<DirtyFile>> files_;
+        std::atomic<size_t> buffered_bytes_{0};
+        size_t high_water_;
+        std::chrono::milliseconds flush_interval_;
+
+        std::condition_variable flusher_cv_;
+        bool stopping_ = false;
+        std::thread flusher_;
+
+        std::function<void(const std::string&)> on_flush_; // Told the path of each file written out
+
+        std::shared_ptr<DirtyFile> find(uint64_t fh) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = files_.find(fh);
+            return it == files_.end() ? nullptr : it->second;
+        }
+
+        std::vector<std::pair<uint64_t, std::shared_ptr<DirtyFile>>> snapshot() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return std::vector<std::pair<uint64_t, std::shared_ptr<DirtyFile>>>(files_.begin(), files_.end());
+        }
+
+        // Caller holds dirty.mutex. Returns 0 or the errno of the first failed write.
+        int writeOut(DirtyFile& dirty) {
+            if (dirty.extents.empty()) {
+                return 0;
+            }
+            size_t bytes = dirty.extents.bytes();
+            std::map<off_t, std::string> extents = dirty.extents.take();
+            buffered_bytes_ -= bytes;
+            dirty.dirty_since_ns = 0;
+
+            int error = 0;
+            for (const auto& extent : extents) {
+                size_t done = 0;
+                while (done < extent.second.size()) {
+                    ssize_t n = timedSyscall([&] {
+                        return pwrite(dirty.file->fd, extent.second.data() + done,
+                                      extent.second.size() - done, extent.first + done);
+                    });
+                    if (n < 0) {
+                        if (errno == EINTR) {
+                            continue;
+                        }
+                        error = errno;
+                        LOG_ERROR("Write-back to " << dirty.file->path << " at offset " << extent.first + done
+                             << " failed: " << strerror(error));
+                        break;
+                    }
+                    done += n;
+                }
+                if (error != 0) {
+                    break;
+                }
+            }
+            LOG_DEBUG("Flushed " << extents.size() << " extent(s), " << bytes << " bytes to " << dirty.file->path);
+            if (on_flush_) {
+                on_flush_(dirty.file->path);
+            }
+            return error;
+        }
+
+        void flushInBackground(DirtyFile& dirty) {
+            std::lock_guard<std::mutex> lock(dirty.mutex);
+            int error = writeOut(dirty);
+            if (error != 0 && dirty.error == 0) {
+                dirty.error = error;
+            }
+        }
+
+        void flushLoop() {
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (!flusher_cv_.wait_for(lock, flush_interval_ / 2, [this] { return stopping_; })) {
+                lock.unlock();
+                int64_t cutoff = steadyNowNs() -
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(flush_interval_).count();
+                for (auto& entry : snapshot()) {
+                    DirtyFile& dirty = *entry.second;
+                    bool expired;
+                    {
+                        std::lock_guard<std::mutex> file_lock(dirty.mutex);
+                        expired = dirty.dirty_since_ns != 0 && dirty.dirty_since_ns < cutoff;
+                    }
+                    if (expired) {
+                        flushInBackground(dirty);
+                    }
+                }
+                lock.lock();
+            }
+        }
+
+    public:
+        WriteBackCache(size_t high_water_bytes, std::chrono::milliseconds flush_interval,
+                       std::function<void(const std::string&)> on_flush = nullptr)
+            : high_water_(high_water_bytes), flush_interval_(flush_interval), on_flush_(std::move(on_flush)) {
+            flusher_ = std::thread(&WriteBackCache::flushLoop, this);
+        }
+
+        ~WriteBackCache() {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stopping_ = true;
+            }
+            flusher_cv_.notify_all();
+            flusher_.join();
+            for (auto& entry : snapshot()) {
+                flushInBackground(*entry.second);
+            }
+        }
+
+        bool empty() const { return buffered_bytes_.load(std::memory_order_relaxed) == 0; }
+
+        void write(uint64_t fh, const std::shared_ptr<OpenFile>& file, off_t offset, const char* data, size_t size) {
+            std::shared_ptr<DirtyFile> dirty;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                std::shared_ptr<DirtyFile>& slot = files_[fh];
+                if (!slot) {
+                    slot = std::make_shared<DirtyFile>();
+                    slot->file = file;
+                }
+                dirty = slot;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(dirty->mutex);
+                size_t before = dirty->extents.bytes();
+                dirty->extents.add(offset, data, size);
+                buffered_bytes_ += dirty->extents.bytes() - before;
+                if (dirty->dirty_since_ns == 0) {
+                    dirty->dirty_since_ns = steadyNowNs();
+                }
+            }
+
+            if (buffered_bytes_ > high_water_) {
+                LOG_DEBUG("Write-back buffer above high-water mark (" << buffered_bytes_ << " bytes), flushing");
+                for (auto& entry : snapshot()) {
+                    flushInBackground(*entry.second);
+                }
+            }
+        }
+
+        // Writes out fh's buffered data. Returns 0 or an errno, including one
+        // left behind by an earlier background flush.
+        int flush(uint64_t fh) {
+            std::shared_ptr<DirtyFile> dirty = find(fh);
+            if (!dirty) {
+                return 0;
+            }
+            std::lock_guard<std::mutex> lock(dirty->mutex);
+            int error = writeOut(*dirty);
+            if (error == 0) {
+                error = dirty->error;
+            }
+            dirty->error = 0;
+            return error;
+        }
+
+        // Writes out every buffer for full_path, so stat() and other handles see the data
+        void flushPath(const std::string& full_path) {
+            for (auto& entry : snapshot()) {
+                if (entry.second->file->path == full_path) {
+                    flushInBackground(*entry.second);
+                }
+            }
+        }
+
+        // Writes out buffers for every file directly inside full_dir
+        void flushDirectory(std::string full_dir) {
+            if (!full_dir.empty() && full_dir.back() == '/') {
+                full_dir.pop_back();
+            }
+            for (auto& entry : snapshot()) {
+                const std::string& path = entry.second->file->path;
+                if (path.size() > full_dir.size() + 1 && path.compare(0, full_dir.size(), full_dir) == 0 &&
+                    path[full_dir.size()] == '/' && path.find('/', full_dir.size() + 1) == std::string::npos) {
+                    flushInBackground(*entry.second);
+                }
+            }
+        }
+
+        // Flushes and forgets fh. Returns 0 or an errno as flush() does.
+        int release(uint64_t fh) {
+            int error = flush(fh);
+            std::lock_guard<std::mutex> lock(mutex_);
+            files_.erase(fh);
+            return error;
+        }
+};
+
+// Listing of one directory as readdir returned it, cookies included, so
+// paged listings can be served from memory exactly as from the disk
+struct DirListing {
+    struct Entry {
+        std::string name;
+        unsigned char type;
+        uint64_t cookie; // d_off, resumes the listing after this entry
+    };
+    std::vector<Entry> entries;
+    bool complete = true; // False for directories too large to cache
+
+    bool contains(uint64_t cookie) const {
+        for (const Entry& entry : entries) {
+            if (entry.cookie == cookie) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// Stat results and directory listings by full path, so repeated getattr,
+// readdir and release calls skip the path walk. Requests that change a path
+// invalidate it directly; an inotify watch on every directory an entry
+// depends on catches changes made outside the server. Entries also expire
+// after a TTL, as a backstop for what inotify cannot see (hard links, a
+// remote file system under the export). An entry is only stored if its
+// watch was in place before the syscall that produced it and nothing that
+// watch covers was invalidated in between, so a racing change can never
+// leave stale data. Each watch counts the entries relying on it, and is
+// removed once the last of them is evicted or expires.
+class MetadataCache {
+    public:
+        struct Stats {
+            uint64_t stat_hits, stat_misses, dir_hits, dir_misses;
+            uint64_t invalidations, events, overflows, entries, watches;
+            uint64_t syscalls_saved;
+        };
+
+    private:
+        struct StatEntry {
+            int error; // errno of the stat, cached negative lookups have ENOENT
+            struct stat st;
+            int64_t expires_ns;
+        };
+        struct ListingEntry {
+            std::shared_ptr<const DirListing> listing;
+            int64_t expires_ns;
+        };
+        struct Watch {
+            int wd;
+            uint64_t generation; // Changed by every invalidation of something it covers
+            size_t entries;      // Cached entries relying on it
+        };
+        typedef std::unordered_map<std::string, StatEntry> StatMap;
+        typedef std::unordered_map<std::string, ListingEntry> ListingMap;
+
+        size_t max_entries_;
+        int64_t ttl_ns_;
+        int inotify_fd_ = -1;
+
+        std::mutex mutex_;
+        StatMap stats_;
+        ListingMap listings_;
+        std::unordered_map<int, std::string> watch_paths_; // By watch descriptor
+        std::unordered_map<std::string, Watch> watches_;   // By directory
+        uint64_t next_generation_ = 1; // Never reused, so a watch added again cannot match an old one
+
+        std::atomic<uint64_t> stat_hits_{0};
+        std::atomic<uint64_t> stat_misses_{0};
+        std::atomic<uint64_t> dir_hits_{0};
+        std::atomic<uint64_t> dir_misses_{0};
+        std::atomic<uint64_t> invalidations_{0};
+        std::atomic<uint64_t> events_{0};
+        std::atomic<uint64_t> overflows_{0};
+        std::atomic<uint64_t> syscalls_saved_{0};
+
+        std::atomic<bool> stopping_{false};
+        std::thread watcher_;
+
+        // One spelling per path: no repeated or trailing slashes
+        static std::string normalize(const std::string& path) {
+            std::string out;
+            out.reserve(path.size());
+            for (char c : path) {
+                if (c == '/' && !out.empty() && out.back() == '/') {
+                    continue;
+                }
+                out += c;
+            }
+            if (out.size() > 1 && out.back() == '/') {
+                out.pop_back();
+            }
+            return out;
+        }
+
+        static std::string parentOf(const std::string& path) {
+            size_t slash = path.rfind('/');
+            if (slash == std::string::npos) {
+                return ".";
+            }
+            return slash == 0 ? "/" : path.substr(0, slash);
+        }
+
+        static bool isDirectory(const StatEntry& entry) {
+            return entry.error == 0 && S_ISDIR(entry.st.st_mode);
+        }
+
+        // Caller holds mutex_. Returns false if dir cannot be watched.
+        bool watchLocked(const std::string& dir, bool* added) {
+            *added = false;
+            if (watches_.count(dir) != 0) {
+                return true;
+            }
+            int wd = inotify_add_watch(inotify_fd_, dir.c_str(),
+                                       IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+                                       IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+            if (wd < 0) {
+                return false; // Gone, not a directory, or out of watches
+            }
+            watches_[dir] = {wd, next_generation_++, 0};
+            watch_paths_[wd] = dir;
+            *added = true;
+            return true;
+        }
+
+        // Caller holds mutex_. Whether dir is still watched under generation.
+        bool currentLocked(const std::string& dir, uint64_t generation) {
+            auto it = watches_.find(dir);
+            return it != watches_.end() && it->second.generation == generation;
+        }
+
+        // Caller holds mutex_. Fails any store begun under dir's watch.
+        void bumpLocked(const std::string& dir) {
+            auto it = watches_.find(dir);
+            if (it != watches_.end()) {
+                it->second.generation = next_generation_++;
+            }
+        }
+
+        // Caller holds mutex_. A stat entry relies on its parent's watch, and
+        // on its own as well for a directory; a listing on its directory's.
+        void retainLocked(const std::string& dir) {
+            auto it = watches_.find(dir);
+            if (it != watches_.end()) {
+                it->second.entries++;
+            }
+        }
+
+        void releaseLocked(const std::string& dir) {
+            auto it = watches_.find(dir);
+            if (it != watches_.end() && it->second.entries > 0) {
+                it->second.entries--;
+            }
+        }
+
+        StatMap::iterator eraseStatLocked(StatMap::iterator it) {
+            releaseLocked(parentOf(it->first));
+            if (isDirectory(it->second)) {
+                releaseLocked(it->first);
+            }
+            return stats_.erase(it);
+        }
+
+        ListingMap::iterator eraseListingLocked(ListingMap::iterator it) {
+            releaseLocked(it->first);
+            return listings_.erase(it);
+        }
+
+        void eraseLocked(const std::string& key) {
+            auto stat = stats_.find(key);
+            if (stat != stats_.end()) {
+                eraseStatLocked(stat);
+            }
+            auto listing = listings_.find(key);
+            if (listing != listings_.end()) {
+                eraseListingLocked(listing);
+            }
+        }
+
+        // Caller holds mutex_. Removes the watches no entry relies on; the
+        // IN_IGNORED this produces finds no watch and is dropped.
+        void unwatchUnusedLocked() {
+            for (auto it = watches_.begin(); it != watches_.end();) {
+                if (it->second.entries == 0) {
+                    inotify_rm_watch(inotify_fd_, it->second.wd);
+                    watch_paths_.erase(it->second.wd);
+                    it = watches_.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+
+        // Caller holds mutex_
+        void invalidateLocked(const std::string& path) {
+            std::string parent = parentOf(path);
+            eraseLocked(path);
+            eraseLocked(parent); // Its mtime and link count follow its entries
+            // The watches the dropped entries were begun under
+            bumpLocked(path);
+            bumpLocked(parent);
+            bumpLocked(parentOf(parent));
+            invalidations_++;
+        }
+
+        // Caller holds mutex_. Drops path and everything below it.
+        void invalidateTreeLocked(const std::string& path) {
+            invalidateLocked(path);
+            std::string prefix = path == "/" ? path : path + "/";
+            for (auto it = stats_.begin(); it != stats_.end();) {
+                it = it->first.compare(0, prefix.size(), prefix) == 0 ? eraseStatLocked(it) : std::next(it);
+            }
+            for (auto it = listings_.begin(); it != listings_.end();) {
+                it = it->first.compare(0, prefix.size(), prefix) == 0 ? eraseListingLocked(it) : std::next(it);
+            }
+            for (auto& watch : watches_) {
+                if (watch.first.compare(0, prefix.size(), prefix) == 0) {
+                    watch.second.generation = next_generation_++;
+                }
+            }
+        }
+
+        // Caller holds mutex_
+        void expireLocked(int64_t now) {
+            for (auto it = stats_.begin(); it != stats_.end();) {
+                it = it->second.expires_ns < now ? eraseStatLocked(it) : std::next(it);
+            }
+            for (auto it = listings_.begin(); it != listings_.end();) {
+                it = it->second.expires_ns < now ? eraseListingLocked(it) : std::next(it);
+            }
+        }
+
+        // Caller holds mutex_. Makes room for one more entry.
+        void evictLocked(int64_t now) {
+            if (stats_.size() + listings_.size() < max_entries_) {
+                return;
+            }
+            expireLocked(now);
+            // Still full of live entries: drop an arbitrary tenth of them
+            size_t excess = max_entries_ / 10 + 1;
+            while (excess > 0 && !stats_.empty() && stats_.size() + listings_.size() >= max_entries_) {
+                eraseStatLocked(stats_.begin());
+                excess--;
+            }
+            while (excess > 0 && !listings_.empty() && stats_.size() + listings_.size() >= max_entries_) {
+                eraseListingLocked(listings_.begin());
+                excess--;
+            }
+            unwatchUnusedLocked();
+        }
+
+        void handleEvent(const struct inotify_event* event) {
+            events_++;
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (event->mask & IN_Q_OVERFLOW) {
+                overflows_++;
+                stats_.clear();
+                listings_.clear();
+                for (auto& watch : watches_) {
+                    watch.second.generation = next_generation_++;
+                    watch.second.entries    = 0;
+                }
+                return;
+            }
+            auto it = watch_paths_.find(event->wd);
+            if (it == watch_paths_.end()) {
+                return;
+            }
+            const std::string dir = it->second;
+            if (event->mask & IN_IGNORED) {
+                invalidateTreeLocked(dir); // Nothing keeps entries below it fresh any more
+                watches_.erase(dir);
+                watch_paths_.erase(event->wd);
+                return;
+            }
+            if (event->len > 0) {
+                std::string path = dir == "/" ? dir + event->name : dir + "/" + event->name;
+                if ((event->mask & IN_ISDIR) && (event->mask & (IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))) {
+                    invalidateTreeLocked(path);
+                } else {
+                    invalidateLocked(path);
+                }
+            } else if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                invalidateTreeLocked(dir);
+            } else {
+                invalidateLocked(dir);
+            }
+        }
+
+        void watchLoop() {
+            alignas(struct inotify_event) char buffer[64 * 1024];
+            // Expired entries are also dropped by lookups and eviction; the
+            // sweep is for those nothing asks for again, so their watches go
+            int64_t sweep_interval = std::max<int64_t>(ttl_ns_, 1000000000);
+            int64_t next_sweep = steadyNowNs() + sweep_interval;
+            while (!stopping_.load(std::memory_order_relaxed)) {
+                int64_t now = steadyNowNs();
+                if (now >= next_sweep) {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    expireLocked(now);
+                    unwatchUnusedLocked();
+                    next_sweep = now + sweep_interval;
+                }
+                struct pollfd pfd = {inotify_fd_, POLLIN, 0};
+                int ready = poll(&pfd, 1, 200);
+                if (ready <= 0) {
+                    continue;
+                }
+                ssize_t n = read(inotify_fd_, buffer, sizeof(buffer));
+                if (n <= 0) {
+                    continue;
+                }
+                for (char* p = buffer; p < buffer + n;) {
+                    const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(p);
+                    handleEvent(event);
+                    p += sizeof(struct inotify_event) + event->len;
+                }
+            }
+        }
+
+    public:
+        MetadataCache(size_t max_entries, std::chrono::milliseconds ttl)
+            : max_entries_(max_entries),
+              ttl_ns_(std::chrono::duration_cast<std::chrono::nanoseconds>(ttl).count()) {
+            if (max_entries_ == 0) {
+                return;
+            }
+            inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (inotify_fd_ < 0) {
+                LOG_WARN("inotify unavailable, metadata cache disabled: " << strerror(errno));
+                max_entries_ = 0;
+                return;
+            }
+            watcher_ = std::thread(&MetadataCache::watchLoop, this);
+        }
+
+        ~MetadataCache() {
+            stopping_ = true;
+            if (watcher_.joinable()) {
+                watcher_.join();
+            }
+            if (inotify_fd_ >= 0) {
+                close(inotify_fd_);
+            }
+        }
+
+        bool enabled() const { return max_entries_ > 0; }
+
+        // Call before the syscall whose result will be stored; dir is the
+        // directory whose watch covers the result. Returns the generation to
+        // pass to store, or 0 if the result must not be cached.
+        uint64_t begin(const std::string& dir) {
+            if (!enabled()) {
+                return 0;
+            }
+            std::string key = normalize(dir);
+            std::lock_guard<std::mutex> lock(mutex_);
+            bool added;
+            return watchLocked(key, &added) ? watches_[key].generation : 0;
+        }
+
+        uint64_t beginStat(const std::string& full_path) {
+            return begin(parentOf(normalize(full_path)));
+        }
+
+        // Returns true on a hit, with the cached errno in *error
+        bool lookupStat(const std::string& full_path, struct stat* st, int* error) {
+            if (!enabled()) {
+                return false;
+            }
+            std::string key = normalize(full_path);
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = stats_.find(key);
+            if (it == stats_.end() || it->second.expires_ns < steadyNowNs()) {
+                if (it != stats_.end()) {
+                    eraseStatLocked(it);
+                }
+                stat_misses_++;
+                return false;
+            }
+            *error = it->second.error;
+            if (*error == 0) {
+                *st = it->second.st;
+            }
+            stat_hits_++;
+            syscalls_saved_++; // The stat
+            return true;
+        }
+
+        void storeStat(const std::string& full_path, uint64_t generation, int error, const struct stat& st) {
+            if (generation == 0 || (error != 0 && error != ENOENT)) {
+                return;
+            }
+            std::string key = normalize(full_path);
+            std::string parent = parentOf(key);
+            std::lock_guard<std::mutex> lock(mutex_);
+            int64_t now = steadyNowNs();
+            evictLocked(now);
+            if (!currentLocked(parent, generation)) {
+                return; // Something changed while we were looking
+            }
+            StatEntry entry = {error, st, now + ttl_ns_};
+            if (isDirectory(entry)) {
+                // A directory's own changes are only reported to its own watch,
+                // which is new if this is the first time we see it
+                bool added;
+                if (!watchLocked(key, &added) || added) {
+                    return;
+                }
+            }
+            auto old = stats_.find(key);
+            if (old != stats_.end()) {
+                eraseStatLocked(old);
+            }
+            stats_[key] = entry;
+            retainLocked(parent);
+            if (isDirectory(entry)) {
+                retainLocked(key);
+            }
+        }
+
+        std::shared_ptr<const DirListing> lookupListing(const std::string& full_dir) {
+            if (!enabled()) {
+                return nullptr;
+            }
+            std::string key = normalize(full_dir);
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = listings_.find(key);
+            if (it == listings_.end() || it->second.expires_ns < steadyNowNs()) {
+                if (it != listings_.end()) {
+                    eraseListingLocked(it);
+                }
+                dir_misses_++;
+                return nullptr;
+            }
+            if (it->second.listing->complete) {
+                dir_hits_++;
+            }
+            return it->second.listing;
+        }
+
+        // For callers answering from a cached listing; stat hits count themselves
+        void countSaved(uint64_t syscalls) {
+            syscalls_saved_ += syscalls;
+        }
+
+        void storeListing(const std::string& full_dir, uint64_t generation, std::shared_ptr<const DirListing> listing) {
+            if (generation == 0) {
+                return;
+            }
+            std::string key = normalize(full_dir);
+            std::lock_guard<std::mutex> lock(mutex_);
+            int64_t now = steadyNowNs();
+            evictLocked(now);
+            if (!currentLocked(key, generation)) {
+                return;
+            }
+            auto it = listings_.find(key);
+            if (it != listings_.end()) {
+                eraseListingLocked(it);
+            }
+            listings_[key] = {std::move(listing), now + ttl_ns_};
+            retainLocked(key);
+        }
+
+        // For changes made by this server; call after the syscall
+        void invalidate(const std::string& full_path) {
+            if (!enabled()) {
+                return;
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            invalidateLocked(normalize(full_path));
+        }
+
+        void invalidateTree(const std::string& full_path) {
+            if (!enabled()) {
+                return;
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            invalidateTreeLocked(normalize(full_path));
+        }
+
+        Stats stats() {
+            Stats out;
+            out.stat_hits      = stat_hits_;
+            out.stat_misses    = stat_misses_;
+            out.dir_hits       = dir_hits_;
+            out.dir_misses     = dir_misses_;
+            out.invalidations  = invalidations_;
+            out.events         = events_;
+            out.overflows      = overflows_;
+            out.syscalls_saved = syscalls_saved_;
+            std::lock_guard<std::mutex> lock(mutex_);
+            out.entries = stats_.size() + listings_.size();
+            out.watches = watches_.size();
+            return out;
+        }
+};
+
+// RPCs the server keeps metrics for, in the order GetStats reports them
+enum class RpcMethod {
+    Ping, NfsGetAttr, NfsReadDir, NfsReadDirPlus, NfsRead, NfsReadStream, NfsOpen, NfsRelease, NfsReleaseAsync,
+    NfsWrite, NfsWriteAsync, NfsWriteStream, NfsUnlink, NfsRmdir, NfsCreate, NfsUtimens, NfsMkdir, NfsCompound,
+    GetStats, NfsLookup, Count
+};
+
+static const char* const kRpcMethodNames[] = {
+    "Ping", "NfsGetAttr", "NfsReadDir", "NfsReadDirPlus", "NfsRead", "NfsReadStream", "NfsOpen", "NfsRelease",
+    "NfsReleaseAsync", "NfsWrite", "NfsWriteAsync", "NfsWriteStream", "NfsUnlink", "NfsRmdir", "NfsCreate",
+    "NfsUtimens", "NfsMkdir", "NfsCompound", "GetStats", "NfsLookup",
+};
+
+// Latency of one phase in GetStats, from nanoseconds
+static void fillLatency(const nfsmetrics::LatencyHistogram& latency, grpc_service::LatencyStats* out) {
+    out->set_count(latency.count());
+    out->set_sum_ns(latency.sum());
+    out->set_max_ns(latency.max());
+    out->set_p50_ns(latency.percentile(0.5));
+    out->set_p90_ns(latency.percentile(0.9));
+    out->set_p99_ns(latency.percentile(0.99));
+}
+
+// Per-RPC counters and latency histograms, all lock-free. Handler time is
+// measured in both engines, and so is the part of it spent in the file
+// system syscalls the handler makes; queueing (request arrival to handler
+// start) and response serialization only in the async engine, which owns
+// those steps. Phases with no samples are left out of every report.
+// Optionally written to a file in the Prometheus text format on an interval.
+class ServerMetrics {
+    private:
+        static const int kErrnoSlots = 134; // Linux errnos; anything above lands in the last slot
+
+        struct Method {
+            std::atomic<uint64_t> calls{0};
+            std::atomic<uint64_t> errors{0};
+            std::atomic<uint64_t> errnos[kErrnoSlots];
+            std::atomic<uint64_t> bytes_read{0};
+            std::atomic<uint64_t> bytes_written{0};
+            std::atomic<uint64_t> compressed{0};
+            nfsmetrics::LatencyHistogram queue;
+            nfsmetrics::LatencyHistogram handler;
+            nfsmetrics::LatencyHistogram syscall; // Calls that made a timed syscall
+            nfsmetrics::LatencyHistogram serialize;
+
+            Method() {
+                for (auto& count : errnos) {
+                    count = 0;
+                }
+            }
+        };
+
+        Method methods_[(int)RpcMethod::Count];
+        int64_t started_ns_;
+
+        std::string dump_path_;
+        std::chrono::milliseconds dump_interval_;
+        std::function<void(std::ostream&)> dump_extra_; // More metrics for the file, from other components
+        std::mutex dump_mutex_;
+        std::condition_variable dump_cv_;
+        bool stopping_ = false;
+        std::thread dumper_;
+
+        static void writeSummary(std::ostream& out, const char* method, const char* phase, const nfsmetrics::LatencyHistogram& latency) {
+            std::string labels = std::string("method=\"") + method + "\",phase=\"" + phase + "\"";
+            for (double q : {0.5, 0.9, 0.99}) {
+                out << "nfs_rpc_latency_seconds{" << labels << ",quantile=\"" << q << "\"} "
+                    << latency.percentile(q) / 1e9 << "\n";
+            }
+            out << "nfs_rpc_latency_seconds_sum{" << labels << "} " << latency.sum() / 1e9 << "\n";
+            out << "nfs_rpc_latency_seconds_count{" << labels << "} " << latency.count() << "\n";
+        }
+
+        // Writes to a temporary file and renames it, so scrapers never see half a dump
+        void dump() {
+            std::string temp = dump_path_ + ".tmp";
+            std::ofstream out(temp);
+            writePrometheus(out);
+            if (dump_extra_) {
+                dump_extra_(out);
+            }
+            out.close();
+            if (!out || rename(temp.c_str(), dump_path_.c_str()) != 0) {
+                LOG_WARN("Could not write metrics to " << dump_path_ << ": " << strerror(errno));
+            }
+        }
+
+        void dumpLoop() {
+            std::unique_lock<std::mutex> lock(dump_mutex_);
+            while (!dump_cv_.wait_for(lock, dump_interval_, [this] { return stopping_; })) {
+                lock.unlock();
+                dump();
+                lock.lock();
+            }
+        }
+
+    public:
+        ServerMetrics(const std::string& dump_path, std::chrono::milliseconds dump_interval,
+                      std::function<void(std::ostream&)> dump_extra = nullptr)
+            : started_ns_(steadyNowNs()), dump_path_(dump_path), dump_interval_(dump_interval),
+              dump_extra_(std::move(dump_extra)) {
+            if (!dump_path_.empty()) {
+                dumper_ = std::thread(&ServerMetrics::dumpLoop, this);
+            }
+        }
+
+        ~ServerMetrics() {
+            if (!dumper_.joinable()) {
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(dump_mutex_);
+                stopping_ = true;
+            }
+            dump_cv_.notify_all();
+            dumper_.join();
+            dump(); // Final counts
+        }
+
+        // syscall_ns is -1 for a call that made no timed syscall
+        void record(RpcMethod method, int64_t handler_ns, int64_t syscall_ns, int error,
+                    uint64_t bytes_read, uint64_t bytes_written) {
+            Method& m = methods_[(int)method];
+            m.calls.fetch_add(1, std::memory_order_relaxed);
+            if (error != 0) {
+                m.errors.fetch_add(1, std::memory_order_relaxed);
+                m.errnos[std::min(std::max(error, 0), kErrnoSlots - 1)].fetch_add(1, std::memory_order_relaxed);
+            }
+            if (bytes_read != 0) {
+                m.bytes_read.fetch_add(bytes_read, std::memory_order_relaxed);
+            }
+            if (bytes_written != 0) {
+                m.bytes_written.fetch_add(bytes_written, std::memory_order_relaxed);
+            }
+            m.handler.record(handler_ns);
+            if (syscall_ns >= 0) {
+                m.syscall.record(syscall_ns);
+            }
+        }
+
+        void recordCompressed(RpcMethod method) { methods_[(int)method].compressed.fetch_add(1, std::memory_order_relaxed); }
+        void recordQueue(RpcMethod method, int64_t ns) { methods_[(int)method].queue.record(ns); }
+        void recordSerialize(RpcMethod method, int64_t ns) { methods_[(int)method].serialize.record(ns); }
+
+        // Methods that have been called at least once
+        void fill(grpc_service::StatsResponse* response) const {
+            response->set_uptime_ms((steadyNowNs() - started_ns_) / 1000000);
+            for (int i = 0; i < (int)RpcMethod::Count; i++) {
+                const Method& m = methods_[i];
+                if (m.calls.load(std::memory_order_relaxed) == 0) {
+                    continue;
+                }
+                grpc_service::MethodStats* out = response->add_rpcs();
+                out->set_method(kRpcMethodNames[i]);
+                out->set_calls(m.calls.load(std::memory_order_relaxed));
+                out->set_errors(m.errors.load(std::memory_order_relaxed));
+                for (int error = 0; error < kErrnoSlots; error++) {
+                    uint64_t count = m.errnos[error].load(std::memory_order_relaxed);
+                    if (count != 0) {
+                        (*out->mutable_errors_by_errno())[error] = count;
+                    }
+                }
+                out->set_bytes_read(m.bytes_read.load(std::memory_order_relaxed));
+                out->set_bytes_written(m.bytes_written.load(std::memory_order_relaxed));
+                out->set_compressed(m.compressed.load(std::memory_order_relaxed));
+                fillLatency(m.handler, out->mutable_handler());
+                if (m.queue.count() != 0) {
+                    fillLatency(m.queue, out->mutable_queue());
+                }
+                if (m.syscall.count() != 0) {
+                    fillLatency(m.syscall, out->mutable_syscall());
+                }
+                if (m.serialize.count() != 0) {
+                    fillLatency(m.serialize, out->mutable_serialize());
+                }
+            }
+        }
+
+        void writePrometheus(std::ostream& out) const {
+            out << "# HELP nfs_uptime_seconds Time since the server started\n"
+                << "# TYPE nfs_uptime_seconds gauge\n"
+                << "nfs_uptime_seconds " << (steadyNowNs() - started_ns_) / 1e9 << "\n";
+            out << "# HELP nfs_rpc_calls_total RPCs served\n# TYPE nfs_rpc_calls_total counter\n";
+            for (int i = 0; i < (int)RpcMethod::Count; i++) {
+                out << "nfs_rpc_calls_total{method=\"" << kRpcMethodNames[i] << "\"} "
+                    << methods_[i].calls.load(std::memory_order_relaxed) << "\n";
+            }
+            out << "# HELP nfs_rpc_errors_total RPCs that failed, by errno\n# TYPE nfs_rpc_errors_total counter\n";
+            for (int i = 0; i < (int)RpcMethod::Count; i++) {
+                for (int error = 0; error < kErrnoSlots; error++) {
+                    uint64_t count = methods_[i].errnos[error].load(std::memory_order_relaxed);
+                    if (count != 0) {
+                        out << "nfs_rpc_errors_total{method=\"" << kRpcMethodNames[i] << "\",errno=\"" << error << "\"} "
+                            << count << "\n";
+                    }
+                }
+            }
+            out << "# HELP nfs_rpc_bytes_total File data read and written\n# TYPE nfs_rpc_bytes_total counter\n";
+            for (int i = 0; i < (int)RpcMethod::Count; i++) {
+                const Method& m = methods_[i];
+                uint64_t read = m.bytes_read.load(std::memory_order_relaxed);
+                uint64_t written = m.bytes_written.load(std::memory_order_relaxed);
+                if (read != 0) {
+                    out << "nfs_rpc_bytes_total{method=\"" << kRpcMethodNames[i] << "\",direction=\"read\"} " << read << "\n";
+                }
+                if (written != 0) {
+                    out << "nfs_rpc_bytes_total{method=\"" << kRpcMethodNames[i] << "\",direction=\"write\"} " << written << "\n";
+                }
+            }
+            out << "# HELP nfs_rpc_compressed_total Replies and stream chunks sent compressed\n"
+                << "# TYPE nfs_rpc_compressed_total counter\n";
+            for (int i = 0; i < (int)RpcMethod::Count; i++) {
+                uint64_t compressed = methods_[i].compressed.load(std::memory_order_relaxed);
+                if (compressed != 0) {
+                    out << "nfs_rpc_compressed_total{method=\"" << kRpcMethodNames[i] << "\"} " << compressed << "\n";
+                }
+            }
+            out << "# HELP nfs_rpc_latency_seconds Time per RPC in each phase\n# TYPE nfs_rpc_latency_seconds summary\n";
+            for (int i = 0; i < (int)RpcMethod::Count; i++) {
+                const Method& m = methods_[i];
+                if (m.calls.load(std::memory_order_relaxed) == 0) {
+                    continue;
+                }
+                writeSummary(out, kRpcMethodNames[i], "handler", m.handler);
+                if (m.queue.count() != 0) {
+                    writeSummary(out, kRpcMethodNames[i], "queue", m.queue);
+                }
+                if (m.syscall.count() != 0) {
+                    writeSummary(out, kRpcMethodNames[i], "syscall", m.syscall);
+                }
+                if (m.serialize.count() != 0) {
+                    writeSummary(out, kRpcMethodNames[i], "serialize", m.serialize);
+                }
+            }
+        }
+};
+
+// Times one RPC from the top of its handler and records it on the way out.
+// Only the outermost scope on a thread counts, so handlers that call other
+// handlers (NfsCompound, the Async variants) are recorded once, under the
+// method the client called.
+class RpcScope {
+    private:
+        static thread_local int depth_;
+        ServerMetrics* metrics_;
+        RpcMethod method_;
+        int64_t start_ns_;
+        int error_ = 0;
+        uint64_t bytes_read_ = 0;
+        uint64_t bytes_written_ = 0;
+
+    public:
+        RpcScope(ServerMetrics* metrics, RpcMethod method)
+            : metrics_(metrics), method_(method), start_ns_(0) {
+            if (depth_++ == 0) {
+                start_ns_         = steadyNowNs();
+                thread_syscall_ns = -1;
+            }
+        }
+
+        ~RpcScope() {
+            if (--depth_ == 0) {
+                metrics_->record(method_, steadyNowNs() - start_ns_, thread_syscall_ns, error_, bytes_read_, bytes_written_);
+            }
+        }
+
+        RpcScope(const RpcScope&) = delete;
+        RpcScope& operator=(const RpcScope&) = delete;
+
+        void fail(int error) { error_ = error; }
+        void compressed() { metrics_->recordCompressed(method_); }
+        void addRead(uint64_t bytes) { bytes_read_ += bytes; }
+        void addWritten(uint64_t bytes) { bytes_written_ += bytes; }
+};
+
+thread_local int RpcScope::depth_ = 0;
+
+// The errno a unary response reports, 0 on success
+template <class Response>
+static int responseError(const Response& response) {
+    return response.success() ? 0 : (response.errorcode() != 0 ? response.errorcode() : EIO);
+}
+static int responseError(const grpc_service::PingResponse&) { return 0; }
+static int responseError(const grpc_service::StatsResponse&) { return 0; }
+
+// File data a response carries
+template <class Response>
+static void countBytes(RpcScope&, const Response&) {}
+static void countBytes(RpcScope& scope, const grpc_service::NfsReadResponse& response) { scope.addRead(response.size()); }
+static void countBytes(RpcScope& scope, const grpc_service::NfsWriteResponse& response) { scope.addWritten(response.bytes_written()); }
+static void countBytes(RpcScope& scope, const grpc_service::TransferStatus& response) { scope.addWritten(response.bytes_received()); }
+
+// RpcScope for a handler with a response message, which holds the outcome
+template <class Response>
+class ResponseScope : public RpcScope {
+    private:
+        const Response* response_;
+
+    public:
+        ResponseScope(ServerMetrics* metrics, RpcMethod method, const Response* response)
+            : RpcScope(metrics, method), response_(response) {}
+
+        ~ResponseScope() {
+            fail(responseError(*response_));
+            countBytes(*this, *response_);
+        }
+};
+
+// NfsReadStream chunk sizes
+static const int64_t kDefaultStreamChunk = 256 * 1024;
+static const int64_t kMaxStreamChunk     = 2 * 1024 * 1024;
+
+// NfsWriteStream gathers contiguous chunks into one pwritev up to these limits
+static const size_t kMaxWriteBatchBytes  = 1024 * 1024;
+static const size_t kMaxWriteBatchChunks = 64;
+
+// Writes every byte of iov at offset, resuming after short writes.
+// Returns 0 or the errno of the failed write.
+static int pwritevFully(int fd, std::vector<struct iovec>& iov, off_t offset) {
+    size_t first = 0;
+    while (first < iov.size()) {
+        ssize_t n = timedSyscall([&] { return pwritev(fd, &iov[first], iov.size() - first, offset); });
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        offset += n;
+        while (n > 0 && first < iov.size()) {
+            size_t step = std::min<size_t>(n, iov[first].iov_len);
+            iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + step;
+            iov[first].iov_len -= step;
+            n -= step;
+            if (iov[first].iov_len == 0) {
+                first++;
+            }
+        }
+    }
+    return 0;
+}
+
+// Reads one page of a directory listing. A cookie is the d_off the kernel
+// gave an entry, which seekdir() resumes right after, so a listing can be
+// continued across requests without keeping the directory open on the
+// server. visit(name, d_type, cookie) returns whether it took the entry; at
+// most max_entries are taken, every entry when max_entries is 0.
+// Returns 0 or the errno of the failed readdir.
+template <typename Visit>
+static int walkDirectory(DIR* dir, uint64_t cookie, int max_entries, uint64_t* next_cookie, bool* eof, Visit visit) {
+    if (cookie != 0) {
+        seekdir(dir, (long)cookie);
+    }
+    *next_cookie = cookie;
+    *eof         = false;
+    int taken = 0;
+    while (max_entries <= 0 || taken < max_entries) {
+        errno = 0;
+        struct dirent* entry = timedSyscall([dir] { return readdir(dir); }); // getdents when its buffer runs out
+        if (entry == nullptr) {
+            if (errno != 0) {
+                return errno;
+            }
+            *eof = true;
+            return 0;
+        }
+        *next_cookie = (uint64_t)entry->d_off;
+        if (visit(entry->d_name, entry->d_type, *next_cookie)) {
+            taken++;
+        }
+    }
+    return 0;
+}
+
+// walkDirectory over a cached listing, with the same cookies
+template <typename Visit>
+static int walkListing(const DirListing& listing, uint64_t cookie, int max_entries, uint64_t* next_cookie, bool* eof, Visit visit) {
+    size_t index = 0;
+    if (cookie != 0) {
+        while (index < listing.entries.size() && listing.entries[index].cookie != cookie) {
+            index++;
+        }
+        index++; // Resume after the entry the cookie came from
+    }
+    *next_cookie = cookie;
+    *eof         = false;
+    int taken = 0;
+    while (max_entries <= 0 || taken < max_entries) {
+        if (index >= listing.entries.size()) {
+            *eof = true;
+            return 0;
+        }
+        const DirListing::Entry& entry = listing.entries[index++];
+        *next_cookie = entry.cookie;
+        if (visit(entry.name.c_str(), entry.type, *next_cookie)) {
+            taken++;
+        }
+    }
+    return 0;
+}
+
 class grpcServices final : public grpc_service::GrpcService::Service {
     private:
         std::string directory_path_; // Where All the files will get mounted
-        std::unordered_map<int, vector<WriteCommand>> file_descriptor_map_; // Maps file descriptors to their write commands
+        FileHandleTable handles_; // Open files behind client handles
+        DirHandleTable dir_handles_; // Directories behind NfsLookup handles
+        MetadataCache metadata_; // Stats and listings, declared before write_back_ which reports into it
+        WriteBackCache write_back_; // Buffered NfsWriteAsync data, keyed by handle
+        bool compress_replies_;
+        nfscompress::Policy reply_policy_; // Size and entropy limits; the algorithm comes from each call
+        ServerMetrics metrics_; // Last, so its dump thread stops before what it reports on goes away
+
+        // Directories larger than this are always listed from the disk
+        static const size_t kMaxCachedListing = 16 * 1024;
+
+        // stat() through the metadata cache. Returns 0 or the errno.
+        int statPath(const std::string& full_path, struct stat* st) {
+            int error;
+            if (metadata_.lookupStat(full_path, st, &error)) {
+                return error;
+            }
+            uint64_t generation = metadata_.beginStat(full_path);
+            error = timedSyscall([&] { return stat(full_path.c_str(), st); }) == 0 ? 0 : errno;
+            metadata_.storeStat(full_path, generation, error, *st);
+            return error;
+        }
 
-    public: 
-        grpcServices(const std::string& directory_path) : directory_path_(directory_path) {}
+        // Where a request points: a name relative to a directory descriptor.
+        // Plain requests carry a full path, resolved from the current
+        // directory; handle requests name one entry inside a looked-up
+        // directory, or the directory itself when the name is empty.
+        struct Target {
+            int dir_fd = AT_FDCWD;
+            std::string name;              // Relative to dir_fd
+            std::string full;              // Full path, for the path-keyed caches
+            std::shared_ptr<DirNode> dir;  // Keeps dir_fd open for handle requests
+
+            bool byHandle() const { return dir != nullptr; }
+        };
+
+        // Returns 0 or an errno, ESTALE for a handle that cannot be resolved
+        int resolve(const std::string& dir_handle, const std::string& path, Target* target) {
+            if (dir_handle.empty()) {
+                target->full = directory_path_ + path;
+                target->name = target->full;
+                return 0;
+            }
+            target->dir = dir_handles_.resolve(dir_handle);
+            if (!target->dir) {
+                return errno;
+            }
+            if (path == ".." || path.find('/') != std::string::npos) {
+                return EINVAL; // One entry inside the directory, no walking
+            }
+            bool self = path.empty() || path == ".";
+            target->dir_fd = target->dir->fd;
+            target->name   = self ? "." : path;
+            target->full   = self ? target->dir->path : DirHandleTable::pathOf(*target->dir, path);
+            return 0;
+        }
+
+        // stat() of a target. Plain paths go through the metadata cache; a
+        // handle request already costs a single-component lookup.
+        int statTarget(const Target& target, struct stat* st) {
+            if (!target.byHandle()) {
+                return statPath(target.full, st);
+            }
+            return timedSyscall([&] { return fstatat(target.dir_fd, target.name.c_str(), st, 0); }) == 0 ? 0 : errno;
+        }
+
+        // How to compress the reply to a call: the algorithm the client asked
+        // for in its metadata, none if it did not or replies are not compressed
+        nfscompress::Policy replyPolicy(const ServerContext* context) const {
+            nfscompress::Policy policy = reply_policy_;
+            if (!compress_replies_) {
+                return policy;
+            }
+            auto it = context->client_metadata().find(nfscompress::kMetadataKey);
+            if (it != context->client_metadata().end() &&
+                !nfscompress::parseAlgorithm(std::string(it->second.data(), it->second.size()), &policy.algorithm)) {
+                policy.algorithm = GRPC_COMPRESS_NONE;
+            }
+            return policy;
+        }
+
+        static DIR* openDirectory(const Target& target) {
+            int fd = openat(target.dir_fd, target.name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd < 0) {
+                return nullptr;
+            }
+            DIR* dir = fdopendir(fd);
+            if (dir == nullptr) {
+                int error = errno;
+                close(fd);
+                errno = error;
+            }
+            return dir;
+        }
+
+        // Pages through a directory for NfsReadDir and NfsReadDirPlus, from the
+        // metadata cache when it holds the listing. A listing that starts at
+        // the top is read whole and cached if the directory is small enough.
+        // visit(name, d_type, cookie) as for walkDirectory.
+        template <typename Visit>
+        int listDirectory(const Target& target, uint64_t cookie, int max_entries,
+                          uint64_t* next_cookie, bool* eof, Visit visit) {
+            const std::string& full_dir = target.full;
+            std::shared_ptr<const DirListing> cached = metadata_.lookupListing(full_dir);
+            if (cached && cached->complete && (cookie == 0 || cached->contains(cookie))) {
+                // opendir, getdents and closedir; a directory big enough to
+                // need several getdents calls counts as one
+                metadata_.countSaved(3);
+                return walkListing(*cached, cookie, max_entries, next_cookie, eof, visit);
+            }
+
+            uint64_t generation = 0;
+            if (cookie == 0 && !cached && metadata_.enabled()) {
+                generation = metadata_.begin(full_dir);
+            }
+            DIR* dir = openDirectory(target);
+            if (dir == nullptr) {
+                return errno;
+            }
+
+            int error;
+            if (generation != 0) {
+                std::shared_ptr<DirListing> listing = std::make_shared<DirListing>();
+                uint64_t end_cookie;
+                bool at_end;
+                error = walkDirectory(dir, 0, kMaxCachedListing, &end_cookie, &at_end,
+                    [&listing](const char* name, unsigned char type, uint64_t entry_cookie) {
+                        listing->entries.push_back({name, type, entry_cookie});
+                        return true;
+                    });
+                if (error == 0 && at_end) {
+                    closedir(dir);
+                    metadata_.storeListing(full_dir, generation, listing);
+                    return walkListing(*listing, cookie, max_entries, next_cookie, eof, visit);
+                }
+                // Too large: remember not to try again, and page from the disk
+                listing->entries.clear();
+                listing->complete = false;
+                metadata_.storeListing(full_dir, generation, listing);
+                rewinddir(dir);
+            }
+            error = walkDirectory(dir, cookie, max_entries, next_cookie, eof, visit);
+            closedir(dir);
+            return error;
+        }
+
+    public:
+        grpcServices(const std::string& directory_path, const ServerOptions& options = ServerOptions())
+            : directory_path_(directory_path),
+              handles_(options.max_open_handles, options.handle_idle),
+              dir_handles_(directory_path, options.max_dir_handles),
+              metadata_(options.md_cache_entries, options.md_cache_ttl),
+              write_back_(options.write_back_high_water, options.write_back_interval,
+                          [this](const std::string& full_path) { metadata_.invalidate(full_path); }),
+              compress_replies_(options.compress_replies),
+              metrics_(options.metrics_file, options.metrics_interval,
+                       [this](std::ostream& out) { writeMetadataMetrics(out); }) {
+            reply_policy_.min_bytes   = options.compress_min_bytes;
+            reply_policy_.max_entropy = options.compress_max_entropy;
+        }
+
+        ServerMetrics& metrics() { return metrics_; }
 
         Status Ping(
             ServerContext*                   context,
             const grpc_service::PingRequest* request,
             grpc_service::PingResponse*      response
         ) override {
+            ResponseScope<grpc_service::PingResponse> scope(&metrics_, RpcMethod::Ping, response);
             response->set_message("Ack");
             return Status::OK;
         }
@@ -54,48 +1898,157 @@ class grpcServices final : public grpc_service::GrpcService::Service {
             const grpc_service::NfsGetAttrRequest* request,
             grpc_service::NfsGetAttrResponse* response
         ) override {
+            ResponseScope<grpc_service::NfsGetAttrResponse> scope(&metrics_, RpcMethod::NfsGetAttr, response);
             const std::string path = request->path();
             struct stat st;
-            if (stat((directory_path_ + path).c_str(), &st) != 0) {
+            Target target;
+            int error = resolve(request->dir(), path, &target);
+            if (error == 0) {
+                if (!write_back_.empty()) {
+                    write_back_.flushPath(target.full); // Size must include buffered writes
+                }
+                error = statTarget(target, &st);
+            }
+            if (error != 0) {
                 response->set_success(false);
-                response->set_errorcode(errno);
+                response->set_errorcode(error);
                 response->set_message("File not found");
                 return Status::OK;
             }
             response->set_success(true);
-            response->set_size(st.st_size);
-            response->set_mode(st.st_mode);
-            response->set_nlink(st.st_nlink);
+            response->set_size(st.st_size);
+            response->set_mode(st.st_mode);
+            response->set_nlink(st.st_nlink);
+            response->set_atime_ns(timespecNs(st.st_atim));
+            response->set_mtime_ns(timespecNs(st.st_mtim));
+            response->set_ctime_ns(timespecNs(st.st_ctim));
+            response->set_ino(st.st_ino);
+            response->set_uid(st.st_uid);
+            response->set_gid(st.st_gid);
+            response->set_blocks(st.st_blocks);
+            return Status::OK;
+        }
+
+        Status NfsReadDir(
+            ServerContext* context,
+            const grpc_service::NfsReadDirRequest* request,
+            grpc_service::NfsReadDirResponse* response
+        ) override {
+            ResponseScope<grpc_service::NfsReadDirResponse> scope(&metrics_, RpcMethod::NfsReadDir, response);
+            const std::string path = request->path();
+            uint64_t next_cookie = 0;
+            bool eof = false;
+            Target target;
+            int error = resolve(request->dir(), path, &target);
+            if (error == 0) {
+                error = listDirectory(target, request->cookie(), request->max_entries(), &next_cookie, &eof,
+                    [response](const char* name, unsigned char type, uint64_t cookie) {
+                        // DT_REG = regular file
+                        // DT_DIR = directory
+                        if (type != DT_REG && type != DT_DIR) {
+                            return false;
+                        }
+                        LOG_TRACE(name);
+                        response->add_files(name);
+                        response->add_cookies(cookie);
+                        return true;
+                    });
+            }
+
+            if (error != 0) {
+                response->Clear();
+                response->set_success(false);
+                response->set_errorcode(error);
+                response->set_message("Failed to read directory");
+                return Status::OK;
+            }
+            response->set_success(true);
+            response->set_message("Directory read successfully");
+            response->set_next_cookie(next_cookie);
+            response->set_eof(eof);
             return Status::OK;
         }
 
-        Status NfsReadDir(
+        // NfsReadDir plus each entry's attributes, from one readdir (getdents)
+        // pass and a stat per entry, both through the metadata cache
+        Status NfsReadDirPlus(
             ServerContext* context,
             const grpc_service::NfsReadDirRequest* request,
-            grpc_service::NfsReadDirResponse* response
+            grpc_service::NfsReadDirPlusResponse* response
         ) override {
+            ResponseScope<grpc_service::NfsReadDirPlusResponse> scope(&metrics_, RpcMethod::NfsReadDirPlus, response);
             const std::string path = request->path();
-            DIR* dir = opendir((directory_path_ + path).c_str());
-            if (dir == nullptr) {
+            uint64_t next_cookie = 0;
+            bool eof = false;
+            Target target;
+            int error = resolve(request->dir(), path, &target);
+            if (error == 0) {
+                const std::string& full_dir = target.full;
+                const std::string  prefix   = (!full_dir.empty() && full_dir.back() == '/') ? full_dir : full_dir + "/";
+                // Handle requests stat entries relative to the held directory
+                const std::string  relative = target.name == "." ? "" : target.name + "/";
+
+                // Sizes must include buffered writes
+                if (!write_back_.empty()) {
+                    write_back_.flushDirectory(full_dir);
+                }
+
+                error = listDirectory(target, request->cookie(), request->max_entries(), &next_cookie, &eof,
+                    [this, response, &target, &prefix, &relative](const char* name, unsigned char type, uint64_t cookie) {
+                        if (type != DT_REG && type != DT_DIR && type != DT_UNKNOWN) {
+                            return false; // Same entries NfsReadDir lists
+                        }
+                        // Known files and directories stat the same followed or not,
+                        // so only an unknown type needs an uncached lstat
+                        struct stat st;
+                        int stat_error;
+                        if (target.byHandle()) {
+                            const std::string entry_name = relative + name;
+                            int flags = type == DT_UNKNOWN ? AT_SYMLINK_NOFOLLOW : 0;
+                            stat_error = timedSyscall([&] { return fstatat(target.dir_fd, entry_name.c_str(), &st, flags); }) == 0
+                                       ? 0 : errno;
+                        } else {
+                            const std::string entry_path = prefix + name;
+                            stat_error = type == DT_UNKNOWN
+                                       ? (timedSyscall([&] { return lstat(entry_path.c_str(), &st); }) == 0 ? 0 : errno)
+                                       : statPath(entry_path, &st);
+                        }
+                        if (stat_error != 0) {
+                            return false; // Removed since readdir saw it
+                        }
+                        if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+                            return false;
+                        }
+                        LOG_TRACE(name);
+
+                        grpc_service::FileAttr* attr = response->add_entries();
+                        attr->set_name(name);
+                        attr->set_cookie(cookie);
+                        attr->set_mode(st.st_mode);
+                        attr->set_size(st.st_size);
+                        attr->set_nlink(st.st_nlink);
+                        attr->set_ino(st.st_ino);
+                        attr->set_atime_ns(timespecNs(st.st_atim));
+                        attr->set_mtime_ns(timespecNs(st.st_mtim));
+                        attr->set_ctime_ns(timespecNs(st.st_ctim));
+                        attr->set_uid(st.st_uid);
+                        attr->set_gid(st.st_gid);
+                        attr->set_blocks(st.st_blocks);
+                        return true;
+                    });
+            }
+
+            if (error != 0) {
+                response->Clear();
                 response->set_success(false);
-                response->set_errorcode(errno);
-                response->set_message("Directory not found");
+                response->set_errorcode(error);
+                response->set_message("Failed to read directory");
                 return Status::OK;
             }
-
             response->set_success(true);
             response->set_message("Directory read successfully");
-
-            struct dirent* entry;
-            while ((entry = readdir(dir)) != nullptr) {
-                // DT_REG = regular file
-                // DT_DIR = directory
-                if (entry->d_type == DT_REG || entry->d_type == DT_DIR) {
-                    cout << entry->d_name << endl;
-                    response->add_files(entry->d_name);
-                }
-            }
-            closedir(dir);
+            response->set_next_cookie(next_cookie);
+            response->set_eof(eof);
             return Status::OK;
         }
 
@@ -104,85 +2057,138 @@ class grpcServices final : public grpc_service::GrpcService::Service {
             const grpc_service::NfsReadRequest* request,
             grpc_service::NfsReadResponse* response
         ) override {
-            //Read first
-
+            ResponseScope<grpc_service::NfsReadResponse> scope(&metrics_, RpcMethod::NfsRead, response);
             const std::string path  = request->path();
             const int64_t     flags = request->flags(); 
-            cout << "NfsOpen called with path: " << path << endl; // Debug log
+            const uint64_t    fh    = request->fh();
+            LOG_DEBUG("NfsRead called with path: " << path << ", handle: " << fh);
 
-            // Open the file and get the file descriptor
-            int file_descriptor = open((directory_path_ + path).c_str(), flags);
-            if (file_descriptor < 0) {
-                cout << "File not found: " << path << endl; // Debug log
+            // Look up the open file behind the handle, reopening it if the handle is stale
+            std::shared_ptr<OpenFile> file = handles_.acquire(fh, directory_path_ + path, flags);
+            if (!file) {
+                LOG_DEBUG("File not found: " << path);
                 response->set_success(false);
                 response->set_errorcode(errno);
                 response->set_message("File not found");
                 return Status::OK;
             }
 
-            // If the file exists, we can open it successfully
-            cout << "File opened successfully: " << path << endl; // Debug log
-
-            // int file_descriptor = request->filedescriptor(); // Get the file descriptor from the request
             off_t offset = request->offset();
             off_t size   = request->size();
-
-            cout << "NfsRead called with file descriptor: " << file_descriptor << endl; // Debug log
-            
-            struct stat st;
-            if (fstat(file_descriptor, &st) != 0) { // Get file info using fstat
-                cerr << "Failed to get file status for descriptor: " << file_descriptor << endl; // Debug log
-                close(file_descriptor);
+            if (size < 0 || offset < 0 || size > (int64_t)nfslimits::kMaxReadBytes) {
                 response->set_success(false);
-                response->set_errorcode(errno);
-                response->set_message("File status retrieval failed");
+                response->set_message("Invalid read range");
+                response->set_errorcode(EINVAL);
                 return Status::OK;
             }
-            
-            int fileSize = st.st_size;
 
-            if (offset >= fileSize) {
-                close(file_descriptor);
-                response->set_success(false);
-                response->set_errorcode(0); // No data to read
-                response->set_message("Offset is beyond the file size");
-                return Status::OK;
+            LOG_DEBUG("NfsRead called with file descriptor: " << file->fd);
+
+            // Reads must see data still sitting in the write-back buffer
+            if (!write_back_.empty()) {
+                write_back_.flushPath(file->path);
             }
-            if (size > fileSize - offset) {
-                size = fileSize - offset; // Adjust size to read only up to the file size
+
+            // Never allocate past the end of the file
+            struct stat st;
+            if (timedSyscall([&] { return fstat(file->fd, &st); }) == 0) {
+                size = std::max<off_t>(0, std::min<off_t>(size, st.st_size - offset));
             }
 
-            std::vector<char> buffer(size);
-            ssize_t bytes_read = pread(file_descriptor, buffer.data(), size, offset); // Read from the file descriptor
-            
+            // pread straight into the response buffer
+            std::string* content = response->mutable_content();
+            content->resize(size);
+            ssize_t bytes_read = timedSyscall([&] { return pread(file->fd, &(*content)[0], size, offset); }); // Read from the file descriptor
+
             if (bytes_read < 0) {
-                cerr << "Failed to read file descriptor: " << file_descriptor << endl; // Debug log
-                close(file_descriptor);
+                int error = errno;
+                LOG_WARN("Failed to read file descriptor: " << file->fd);
+                content->clear();
                 response->set_success(false);
                 response->set_message("File Read Failed");
-                response->set_errorcode(errno);
+                response->set_errorcode(error);
                 return Status::OK;
             }
 
+            content->resize(bytes_read);
             response->set_size(bytes_read);
             response->set_success(true);
+
+            nfscompress::Policy compression = replyPolicy(context);
+            if (compression.worthIt(content->data(), bytes_read)) {
+                context->set_compression_algorithm(compression.algorithm);
+                scope.compressed();
+            }
             response->set_message("File Read successfully");
-            response->set_content(std::string(buffer.data(), bytes_read));
-            cout << "File content: " << response->content() << endl;
+            LOG_PAYLOAD("File content: " << response->content());
+
+            return Status::OK;
+        }
 
+        Status NfsReadStream(
+            ServerContext* context,
+            const grpc_service::NfsReadStreamRequest* request,
+            ServerWriter<grpc_service::DataChunk>* writer
+        ) override {
+            RpcScope scope(&metrics_, RpcMethod::NfsReadStream); // Handler time includes waiting on the client
+            const std::string path = request->path();
+            LOG_DEBUG("NfsReadStream called with path: " << path << ", offset: " << request->offset()
+                 << ", size: " << request->size());
 
-            // Close the file descriptor
-            cout << "NfsRelease called with file descriptor: " << file_descriptor << endl; // Debug log
+            std::shared_ptr<OpenFile> file = handles_.acquire(request->fh(), directory_path_ + path, request->flags());
+            if (!file) {
+                scope.fail(errno);
+                return Status(grpc::StatusCode::NOT_FOUND, "File not found", std::to_string(errno));
+            }
+            if (!write_back_.empty()) {
+                write_back_.flushPath(file->path);
+            }
 
-            if (close(file_descriptor) != 0) {
-                cerr << "Failed to close file descriptor: " << file_descriptor << ", error: " << strerror(errno) << endl;
-                response->set_success(false);
-                response->set_errorcode(errno);
-                response->set_message("File close failed");
-            } else {
-                cout << "File descriptor " << file_descriptor << " closed successfully." << endl;
+            int64_t chunk_size = request->chunk_size() > 0 ? request->chunk_size() : kDefaultStreamChunk;
+            chunk_size = std::max<int64_t>(4096, std::min<int64_t>(chunk_size, kMaxStreamChunk));
+
+            // Compression is chosen for the stream, then skipped for chunks that fail the probe
+            nfscompress::Policy compression = replyPolicy(context);
+            if (compression.enabled()) {
+                context->set_compression_algorithm(compression.algorithm);
             }
 
+            // Each Write blocks until the transport accepts the chunk, so HTTP/2
+            // flow control paces us to the client and at most one chunk is buffered here
+            grpc_service::DataChunk chunk;
+            off_t   offset    = request->offset();
+            int64_t remaining = request->size();
+            while (remaining > 0 && !context->IsCancelled()) {
+                size_t want = std::min<int64_t>(chunk_size, remaining);
+                std::string* data = chunk.mutable_data();
+                data->resize(want);
+                ssize_t bytes_read = timedSyscall([&] { return pread(file->fd, &(*data)[0], want, offset); });
+                if (bytes_read < 0) {
+                    LOG_WARN("Failed to read file descriptor: " << file->fd << ", error: " << strerror(errno));
+                    scope.fail(errno);
+                    return Status(grpc::StatusCode::INTERNAL, "File Read Failed", std::to_string(errno));
+                }
+                if (bytes_read == 0) {
+                    break; // End of file
+                }
+                data->resize(bytes_read);
+                chunk.set_offset(offset);
+                grpc::WriteOptions write_options;
+                if (compression.worthIt(data->data(), bytes_read)) {
+                    scope.compressed();
+                } else {
+                    write_options.set_no_compression();
+                }
+                if (!writer->Write(chunk, write_options)) {
+                    break; // Client went away
+                }
+                scope.addRead(bytes_read);
+                offset    += bytes_read;
+                remaining -= bytes_read;
+                if ((size_t)bytes_read < want) {
+                    break; // End of file
+                }
+            }
             return Status::OK;
         }
 
@@ -191,62 +2197,47 @@ class grpcServices final : public grpc_service::GrpcService::Service {
             const grpc_service::NfsOpenRequest* request,
             grpc_service::NfsOpenResponse* response
         ) override {
+            ResponseScope<grpc_service::NfsOpenResponse> scope(&metrics_, RpcMethod::NfsOpen, response);
             const std::string path  = request->path();
             const int64_t     flags = request->flags(); 
-            cout << "NfsOpen called with path: " << path << endl; // Debug log
+            LOG_DEBUG("NfsOpen called with path: " << path);
 
-            // check permissions
-            int access_mode = 0;
-            if (flags & O_RDONLY) {
-                access_mode |= R_OK;
-            }
-            if (flags & O_WRONLY) {
-                access_mode |= W_OK;
-            }
-            if (flags & O_RDWR) {
-                access_mode |= R_OK | W_OK;
+            Target target;
+            int error = resolve(request->dir(), path, &target);
+            if (error != 0) {
+                response->set_success(false);
+                response->set_errorcode(error);
+                response->set_message("Bad directory handle");
+                return Status::OK;
             }
 
-            if (access((directory_path_ + path).c_str(), access_mode) != 0) {
-                cout << "Permission denied or file not found: " << path << endl; // Debug log
+            // Opening checks permissions and keeps the descriptor for later reads and writes
+            std::shared_ptr<OpenFile> file;
+            uint64_t fh = handles_.openAt(target.dir_fd, target.name.c_str(), target.full, flags, 0, &file);
+            if (fh == 0) {
+                LOG_DEBUG("Permission denied or file not found: " << path);
                 response->set_success(false);
                 response->set_errorcode(errno);
                 response->set_message("Permission denied or file not found");
                 return Status::OK;
             }
 
-            cout << "File access check passed for path: " << path << endl; // Debug log
-            response->set_success(true);
-            response->set_message("File access check passed");
-            return Status::OK;
-        }
-
-        WriteCommand mergeContent(const WriteCommand& a, const WriteCommand& b) {
-            // Log the input arguments
-            cout << "Merging WriteCommands: a.offset = " << a.offset << ", a.size = " << a.size << ", a.content = " << a.content << endl;
-            cout << "b.offset = " << b.offset << ", b.size = " << b.size << ", b.content = " << b.content << endl;
-
-            // Check if the commands overlap or are continuous
-            if (b.offset > a.offset + a.size) {
-                throw std::invalid_argument("WriteCommands do not overlap or are not continuous");
+            if (flags & (O_CREAT | O_TRUNC)) {
+                metadata_.invalidate(target.full);
             }
 
-            // Create a new WriteCommand for the merged content
-            WriteCommand merged_command;
-            merged_command.offset = a.offset; // Start at the beginning of the first command
-            merged_command.size = std::max(a.offset + a.size, b.offset + b.size) - a.offset; // Calculate the new size
-
-            // Create the merged content
-            merged_command.content = a.content;
-            // Overwrite the overlapping region with the content of the second command
-            size_t overlap_start = b.offset - a.offset; // Calculate the start of the overlap in the first command
-            merged_command.content.replace(overlap_start, b.size, b.content); // Replace the overlapping part
-
-            cout << "Final merged command: offset = " << merged_command.offset 
-                 << ", size = " << merged_command.size 
-                 << ", content = " << merged_command.content << endl;
+            // Size and mtime let the client decide whether its cached pages are still valid
+            struct stat st;
+            if (timedSyscall([&] { return fstat(file->fd, &st); }) == 0) {
+                response->set_size(st.st_size);
+                response->set_mtime_ns(timespecNs(st.st_mtim));
+            }
 
-            return merged_command;
+            LOG_DEBUG("File opened with handle " << fh << " for path: " << path);
+            response->set_success(true);
+            response->set_fh(fh);
+            response->set_message("File opened successfully");
+            return Status::OK;
         }
 
         Status NfsReleaseAsync(
@@ -254,107 +2245,11 @@ class grpcServices final : public grpc_service::GrpcService::Service {
             const grpc_service::NfsReleaseRequest* request,
             grpc_service::NfsReleaseResponse* response
         ) override {
-            // int file_descriptor = request->filedescriptor();
-            // cout << "NfsReleaseAsync called with file descriptor: " << file_descriptor << endl;
-
-
-            // // Need to push to disk
-            // // First sort the WriteCommands under the file descriptor by offset
-            // // Then start merging the Write Commands when possible
-            // // if nextOffset < currentOffset + currentSize
-            // // then it can be merged
-            // // currentSize = nextOffset + nextSize - currentOffset
-            // // content that overlaps should be overwritten by the new content
-            // // 
-            // // else: this overlap is done, and is one writeCommand, add to a final write command vector
-            // // on to the next commands
-            // //
-            // // At the end using the final write command vector, write to the file descriptor
-            // cout << "Retrieving write commands for file descriptor: " << file_descriptor << endl;
-            // std::vector<WriteCommand> write_commands = file_descriptor_map_[file_descriptor];
-            // cout << "Number of write commands retrieved: " << write_commands.size() << endl;
-
-            // cout << "Sorting write commands by offset." << endl;
-            // std::sort(write_commands.begin(), write_commands.end(), [](const WriteCommand& a, const WriteCommand& b) {
-            //     return a.offset < b.offset; // Sort by offset
-            // });
-
-            // std::vector<WriteCommand> final_write_commands;
-            // WriteCommand current_command = {0, 0, ""}; // Initialize with default values
-
-            // for (const auto& command : write_commands) {
-            //     cout << "Processing command: offset = " << command.offset 
-            //          << ", size = " << command.size 
-            //          << ", content = " << command.content << endl;
-
-            //     if (current_command.size == 0) {
-            //         cout << "Initializing current_command with the first command." << endl;
-            //         current_command = command;
-            //     } else {
-            //         cout << "Comparing current_command: offset = " << current_command.offset 
-            //              << ", size = " << current_command.size 
-            //              << " with command: offset = " << command.offset 
-            //              << ", size = " << command.size << endl;
-
-            //         if (command.offset <= current_command.offset + current_command.size) {
-            //             cout << "Commands overlap. Merging commands." << endl;
-            //             current_command = mergeContent(current_command, command);
-            //         } else {
-            //             cout << "No overlap detected. Finalizing current command." << endl;
-            //             final_write_commands.push_back(current_command);
-            //             current_command = command; // Start a new command
-            //         }
-            //     }
-            // }
-
-            // // Add the last command if it exists
-            // if (current_command.size > 0) {
-            //     cout << "Adding the last command to final write commands." << endl;
-            //     final_write_commands.push_back(current_command);
-            // }
-
-            // // Write the final commands to the file descriptor
-            // for (const auto& cmd : final_write_commands) {
-            //     cout << "Writing to file descriptor " << file_descriptor 
-            //          << " at offset " << cmd.offset 
-            //          << " with size " << cmd.size 
-            //          << " and content: " << cmd.content << endl;
-
-            //     if (lseek(file_descriptor, cmd.offset, SEEK_SET) == (off_t)-1) {
-            //         cerr << "Failed to seek to offset: " << cmd.offset << " for file descriptor: " << file_descriptor << endl;
-            //         response->set_success(false);
-            //         response->set_errorcode(errno);
-            //         response->set_message("File seek failed");
-            //         return Status::OK;
-            //     }
-
-            //     ssize_t bytes_written = write(file_descriptor, cmd.content.data(), cmd.size);
-            //     if (bytes_written < 0) {
-            //         cerr << "Failed to write to file descriptor: " << file_descriptor 
-            //              << ", error: " << strerror(errno) << endl;
-            //         response->set_success(false);
-            //         response->set_errorcode(errno);
-            //         response->set_message("File write failed");
-            //         return Status::OK;
-            //     }
-            //     cout << "Successfully wrote " << bytes_written << " bytes." << endl;
-            // }
-
-            // cout << "Clearing the file descriptor map." << endl;
-            // file_descriptor_map_.clear(); // Clear the file descriptor map
-
-            // if (close(file_descriptor) == 0) {
-            //     cout << "File descriptor " << file_descriptor << " closed successfully." << endl;
-            //     response->set_success(true);
-            //     response->set_message("File released successfully");
-            // } else {
-            //     cerr << "Failed to close file descriptor: " << file_descriptor << ", error: " << strerror(errno) << endl;
-            //     response->set_success(false);
-            //     response->set_errorcode(errno);
-            //     response->set_message("File release failed");
-            // }
+            ResponseScope<grpc_service::NfsReleaseResponse> scope(&metrics_, RpcMethod::NfsReleaseAsync, response);
+            LOG_DEBUG("NfsReleaseAsync called with path: " << request->path() << ", handle: " << request->fh());
 
-            return Status::OK;
+            // Release always drains the handle's write-back buffer first
+            return NfsRelease(context, request, response);
         }
 
         Status NfsRelease(
@@ -362,14 +2257,36 @@ class grpcServices final : public grpc_service::GrpcService::Service {
             const grpc_service::NfsReleaseRequest* request,
             grpc_service::NfsReleaseResponse* response
         ) override {
+            ResponseScope<grpc_service::NfsReleaseResponse> scope(&metrics_, RpcMethod::NfsRelease, response);
 
             const std::string path  = request->path();
             struct stat buffer;
 
-            if (stat((directory_path_ + path).c_str(), &buffer) != 0) {
+            // Push buffered NfsWriteAsync data to disk before the descriptor goes away
+            if (request->fh() != 0) {
+                int error = write_back_.release(request->fh());
+                if (error != 0) {
+                    handles_.release(request->fh());
+                    response->set_success(false);
+                    response->set_errorcode(error);
+                    response->set_message("Write-back flush failed");
+                    return Status::OK;
+                }
+            }
+
+            if (request->fh() != 0 && handles_.release(request->fh())) {
+                LOG_DEBUG("File handle " << request->fh() << " released for path: " << path);
+                response->set_success(true);
+                response->set_message("File released successfully");
+                return Status::OK;
+            }
+
+            // Unknown handle (already evicted or issued before a restart)
+            int error = statPath(directory_path_ + path, &buffer);
+            if (error != 0) {
                 // If stat fails, the file does not exist or there is another error
                 response->set_success(false);
-                response->set_errorcode(errno);
+                response->set_errorcode(error);
                 response->set_message("File not found: " + path);
                 return Status::OK;
             }
@@ -384,58 +2301,52 @@ class grpcServices final : public grpc_service::GrpcService::Service {
             const grpc_service::NfsWriteRequest* request,
             grpc_service::NfsWriteResponse* response
         ) override {
+            ResponseScope<grpc_service::NfsWriteResponse> scope(&metrics_, RpcMethod::NfsWrite, response);
             const std::string path  = request->path();
             const int64_t     flags = request->flags(); 
-            const std::string content = request->content();
-            int64_t size = request->size();
+            const std::string& content = request->content();
+            size_t size  = std::min<size_t>(request->size(), content.size()); // Never past the payload
             off_t offset = request->offset(); 
 
-            cout << "NfsOpen called with path: " << path << endl; // Debug log
+            LOG_DEBUG("NfsWrite called with path: " << path << ", handle: " << request->fh());
 
-            // Open the file and get the file descriptor
-            int file_descriptor = open((directory_path_ + path).c_str(), flags);
-            if (file_descriptor < 0) {
-                cout << "File not found: " << path << endl; // Debug log
+            // Look up the open file behind the handle, reopening it if the handle is stale
+            std::shared_ptr<OpenFile> file = handles_.acquire(request->fh(), directory_path_ + path, flags);
+            if (!file) {
+                LOG_DEBUG("File not found: " << path);
                 response->set_success(false);
                 response->set_errorcode(errno);
                 response->set_message("File not found");
                 return Status::OK;
             }
 
-            // If the file exists, we can open it successfully
-            cout << "File opened successfully: " << path << endl; // Debug log
-
-            cout << "NfsWrite invoked with file descriptor: " << file_descriptor << ", content size: " << size << ", and offset: " << offset << endl; // Debug log
-            cout << "Writing content: " << content << " to file descriptor: " << file_descriptor << " at offset: " << offset << endl; // Log the content being written
-            if (lseek(file_descriptor, offset, SEEK_SET) == (off_t)-1) {
-                cerr << "Failed to seek to offset: " << offset << " in file descriptor: " << file_descriptor << endl;
-                close(file_descriptor);
-                response->set_success(false);
-                response->set_errorcode(errno);
-                response->set_message("File seek failed");
-                return Status::OK;
+            // Keep ordering with earlier buffered writes on the same handle, and
+            // report what a background flush of them failed with
+            if (!write_back_.empty()) {
+                int error = write_back_.flush(request->fh());
+                if (error != 0) {
+                    response->set_success(false);
+                    response->set_errorcode(error);
+                    response->set_message("Write-back flush failed");
+                    return Status::OK;
+                }
             }
 
-            // Write the content to the file
-            ssize_t bytes_written = write(file_descriptor, content.c_str(), size);
+            LOG_DEBUG("NfsWrite invoked with file descriptor: " << file->fd << ", content size: " << size << ", and offset: " << offset);
+            LOG_PAYLOAD("Writing content: " << content << " to file descriptor: " << file->fd << " at offset: " << offset); // Log the content being written
+
+            // pwrite keeps concurrent writers on a shared descriptor from racing on the file offset
+            ssize_t bytes_written = timedSyscall([&] { return pwrite(file->fd, content.c_str(), size, offset); });
             if (bytes_written < 0) {
-                cerr << "Failed to write to file descriptor: " << file_descriptor << ", error: " << strerror(errno) << endl; // Debug log with error message
-                close(file_descriptor);
+                LOG_WARN("Failed to write to file descriptor: " << file->fd << ", error: " << strerror(errno));
                 response->set_success(false);
                 response->set_errorcode(errno);
                 response->set_message("File write failed");
                 return Status::OK;
             }
 
-            cout << "Successfully wrote " << bytes_written << " bytes to file descriptor: " << file_descriptor << endl; // Debug log
-            // close file
-            if (close(file_descriptor) != 0) {
-                cerr << "Failed to close file: " << path << ", error: " << strerror(errno) << endl; // Debug log with error message
-                response->set_success(false);
-                response->set_errorcode(errno);
-                response->set_message("File close failed");
-                return Status::OK;
-            }
+            LOG_DEBUG("Successfully wrote " << bytes_written << " bytes to file descriptor: " << file->fd);
+            metadata_.invalidate(file->path);
 
             response->set_success(true);
             response->set_message("File written successfully");
@@ -448,33 +2359,122 @@ class grpcServices final : public grpc_service::GrpcService::Service {
             const grpc_service::NfsWriteRequest* request,
             grpc_service::NfsWriteResponse* response
         ) override {
-            // int file_descriptor = request->filedescriptor();
-            // const std::string data = request->content();
-            // int64_t offset = request->offset();
-            // int32_t size = request->size();
-
-            // cout << "NfsWriteAsync invoked with file descriptor: " << file_descriptor 
-            //      << ", data size: " << size << ", and offset: " << offset << endl; // Debug log
-
-            // // Check if the file descriptor is valid
-            // if (file_descriptor < 0) {
-            //     cerr << "Invalid file descriptor: " << file_descriptor << endl;
-            //     response->set_success(false);
-            //     response->set_message("Invalid file descriptor");
-            //     return Status::OK;
-            // }
-        
-            // WriteCommand command;
-            // command.offset = offset;
-            // command.size = size;
-            // command.content = data;
-
-            // // Store the write command in the file descriptor map
-            // file_descriptor_map_[file_descriptor].push_back(command);
-
-            // response->set_success(true);
-            // response->set_message("Data buffered successfully");
-            // response->set_bytes_written(size); // Return the number of bytes intended to be written
+            ResponseScope<grpc_service::NfsWriteResponse> scope(&metrics_, RpcMethod::NfsWriteAsync, response);
+            const std::string& path    = request->path();
+            const std::string& content = request->content();
+            const uint64_t     fh      = request->fh();
+            size_t size = std::min<size_t>(request->size(), content.size());
+
+            // Buffers are keyed by handle, without one there is nothing to flush on release
+            if (fh == 0) {
+                return NfsWrite(context, request, response);
+            }
+
+            std::shared_ptr<OpenFile> file = handles_.acquire(fh, directory_path_ + path, request->flags());
+            if (!file) {
+                response->set_success(false);
+                response->set_errorcode(errno);
+                response->set_message("File not found");
+                return Status::OK;
+            }
+
+            LOG_DEBUG("NfsWriteAsync buffering " << size << " bytes at offset " << request->offset() << " for handle " << fh);
+            write_back_.write(fh, file, request->offset(), content.data(), size);
+
+            response->set_success(true);
+            response->set_message("Data buffered successfully");
+            response->set_bytes_written(size); // Return the number of bytes intended to be written
+            return Status::OK;
+        }
+
+        Status NfsWriteStream(
+            ServerContext* context,
+            ServerReader<grpc_service::DataChunk>* reader,
+            grpc_service::TransferStatus* response
+        ) override {
+            ResponseScope<grpc_service::TransferStatus> scope(&metrics_, RpcMethod::NfsWriteStream, response);
+            grpc_service::DataChunk chunk;
+            if (!reader->Read(&chunk)) {
+                response->set_success(true); // Empty stream, nothing to write
+                return Status::OK;
+            }
+
+            const std::string path = chunk.path();
+            const uint64_t    fh   = chunk.fh();
+            LOG_DEBUG("NfsWriteStream called with path: " << path << ", handle: " << fh);
+
+            std::shared_ptr<OpenFile> file = handles_.acquire(fh, directory_path_ + path, chunk.flags());
+            if (!file) {
+                response->set_success(false);
+                response->set_errorcode(errno);
+                response->set_message("File not found");
+                return Status::OK;
+            }
+            if (!write_back_.empty()) {
+                int error = write_back_.flush(fh); // Keep ordering with earlier buffered writes
+                if (error != 0) {
+                    response->set_success(false);
+                    response->set_errorcode(error);
+                    response->set_message("Write-back flush failed");
+                    return Status::OK;
+                }
+            }
+
+            // Chunks that continue where the previous one ended are written with
+            // a single pwritev; the batch owns their buffers until then
+            std::vector<std::string> batch;
+            std::vector<struct iovec> iov;
+            off_t   batch_offset = 0;
+            size_t  batch_bytes  = 0;
+            int64_t committed    = 0;
+            int     error        = 0;
+
+            auto flushBatch = [&]() {
+                if (batch.empty() || error != 0) {
+                    return;
+                }
+                iov.clear();
+                for (std::string& data : batch) {
+                    iov.push_back({&data[0], data.size()});
+                }
+                error = pwritevFully(file->fd, iov, batch_offset);
+                if (error == 0) {
+                    committed += batch_bytes;
+                } else {
+                    LOG_WARN("Failed to write stream to " << path << ": " << strerror(error));
+                }
+                batch.clear();
+                batch_bytes = 0;
+            };
+
+            do {
+                if (chunk.data().empty()) {
+                    continue;
+                }
+                bool contiguous = !batch.empty() && chunk.offset() == batch_offset + (off_t)batch_bytes;
+                if (!contiguous || batch_bytes >= kMaxWriteBatchBytes || batch.size() >= kMaxWriteBatchChunks) {
+                    flushBatch();
+                    batch_offset = chunk.offset();
+                }
+                batch_bytes += chunk.data().size();
+                batch.emplace_back();
+                batch.back().swap(*chunk.mutable_data());
+            } while (error == 0 && reader->Read(&chunk));
+            flushBatch();
+            if (committed > 0) {
+                metadata_.invalidate(file->path);
+            }
+
+            LOG_DEBUG("NfsWriteStream committed " << committed << " bytes to " << path);
+            response->set_bytes_received(committed);
+            if (error != 0) {
+                response->set_success(false);
+                response->set_errorcode(error);
+                response->set_message("File write failed");
+                return Status::OK;
+            }
+            response->set_success(true);
+            response->set_message("File written successfully");
             return Status::OK;
         }
 
@@ -483,17 +2483,24 @@ class grpcServices final : public grpc_service::GrpcService::Service {
             const grpc_service::NfsUnlinkRequest* request,
             grpc_service::NfsUnlinkResponse* response
         ) override {
+            ResponseScope<grpc_service::NfsUnlinkResponse> scope(&metrics_, RpcMethod::NfsUnlink, response);
             const std::string path = request->path();
-            cout << "NfsUnlink called with path: " << path << endl; // Debug log
+            LOG_DEBUG("NfsUnlink called with path: " << path);
 
-            if (unlink((directory_path_ + path).c_str()) == 0) {
-                cout << "File unlinked successfully: " << path << endl;
+            Target target;
+            int error = resolve(request->dir(), path, &target);
+            if (error == 0 && unlinkat(target.dir_fd, target.name.c_str(), 0) != 0) {
+                error = errno;
+            }
+            if (error == 0) {
+                metadata_.invalidate(target.full);
+                LOG_DEBUG("File unlinked successfully: " << path);
                 response->set_success(true);
                 response->set_message("File unlinked successfully");
             } else {
-                cerr << "Failed to unlink file: " << path << " - " << strerror(errno) << endl;
+                LOG_WARN("Failed to unlink file: " << path << " - " << strerror(error));
                 response->set_success(false);
-                response->set_errorcode(errno);
+                response->set_errorcode(error);
                 response->set_message("File unlink failed");
             }
             return Status::OK;
@@ -504,18 +2511,25 @@ class grpcServices final : public grpc_service::GrpcService::Service {
             const grpc_service::NfsRmdirRequest* request,
             grpc_service::NfsRmdirResponse* response
         ) override {
+            ResponseScope<grpc_service::NfsRmdirResponse> scope(&metrics_, RpcMethod::NfsRmdir, response);
             const std::string path = request->path();
-            cout << "NfsRmdir called with path: " << path << endl; // Debug log
+            LOG_DEBUG("NfsRmdir called with path: " << path);
 
             // Perform rmdir operation
-            if (rmdir((directory_path_ + path).c_str()) == 0) {
-                cout << "Directory removed successfully: " << path << endl;
+            Target target;
+            int error = resolve(request->dir(), path, &target);
+            if (error == 0 && unlinkat(target.dir_fd, target.name.c_str(), AT_REMOVEDIR) != 0) {
+                error = errno;
+            }
+            if (error == 0) {
+                metadata_.invalidate(target.full); // Only negative entries can remain below it, and they still hold
+                LOG_DEBUG("Directory removed successfully: " << path);
                 response->set_success(true);
                 response->set_message("Directory removed successfully");
             } else {
-                cerr << "Failed to remove directory: " << path << " - " << strerror(errno) << endl;
+                LOG_WARN("Failed to remove directory: " << path << " - " << strerror(error));
                 response->set_success(false);
-                response->set_errorcode(errno);
+                response->set_errorcode(error);
                 response->set_message("Directory removal failed");
             }
 
@@ -527,33 +2541,36 @@ class grpcServices final : public grpc_service::GrpcService::Service {
             const grpc_service::NfsCreateRequest* request,
             grpc_service::NfsCreateResponse* response
         ) override {
+            ResponseScope<grpc_service::NfsCreateResponse> scope(&metrics_, RpcMethod::NfsCreate, response);
             const std::string path = request->path();
             mode_t mode = request->mode();
-            cout << "NfsCreate called with path: " << path << " and mode: " << oct << mode << endl;
+            int64_t flags = request->flags() != 0 ? request->flags() : O_WRONLY;
+            LOG_DEBUG("NfsCreate called with path: " << path << " and mode: " << oct << mode << dec);
 
-            // open the file and get the file descriptor
-            int file_descriptor = open((directory_path_ + path).c_str(), O_CREAT | O_WRONLY, mode);
-            if (file_descriptor < 0) {
-                cerr << "Failed to create file: " << path << endl;
+            Target target;
+            int error = resolve(request->dir(), path, &target);
+            if (error != 0) {
                 response->set_success(false);
-                response->set_errorcode(errno);
-                response->set_message("File creation failed");
+                response->set_errorcode(error);
+                response->set_message("Bad directory handle");
                 return Status::OK;
             }
 
-            cout << "File created successfully: " << path << endl;
-            response->set_success(true);
-            response->set_message("File created successfully");
-
-            if (close(file_descriptor) != 0) {
-                cerr << "Failed to close file descriptor: " << file_descriptor << ", error: " << strerror(errno) << endl;
+            // Create the file and keep it open under a handle for the writes that follow
+            uint64_t fh = handles_.openAt(target.dir_fd, target.name.c_str(), target.full, flags | O_CREAT, mode);
+            if (fh == 0) {
+                LOG_WARN("Failed to create file: " << path);
                 response->set_success(false);
                 response->set_errorcode(errno);
-                response->set_message("File close failed");
-            } else {
-                cout << "File descriptor " << file_descriptor << " closed successfully." << endl;
+                response->set_message("File creation failed");
+                return Status::OK;
             }
+            metadata_.invalidate(target.full);
 
+            LOG_DEBUG("File created successfully: " << path << " with handle " << fh);
+            response->set_success(true);
+            response->set_fh(fh);
+            response->set_message("File created successfully");
             return Status::OK;
         }
 
@@ -562,6 +2579,7 @@ class grpcServices final : public grpc_service::GrpcService::Service {
             const grpc_service::NfsUtimensRequest* request,
             grpc_service::NfsUtimensResponse* response
         ) override {
+            ResponseScope<grpc_service::NfsUtimensResponse> scope(&metrics_, RpcMethod::NfsUtimens, response);
             const std::string path = request->path();
             struct timespec times[2];
 
@@ -573,15 +2591,21 @@ class grpcServices final : public grpc_service::GrpcService::Service {
             times[1].tv_sec = request->mtime();
             times[1].tv_nsec = 0;
 
-            if (utimensat(AT_FDCWD, (directory_path_ + path).c_str(), times, 0) == 0) {
+            Target target;
+            int error = resolve(request->dir(), path, &target);
+            if (error == 0 && utimensat(target.dir_fd, target.name.c_str(), times, 0) != 0) {
+                error = errno;
+            }
+            if (error == 0) {
+                metadata_.invalidate(target.full);
                 response->set_success(true);
                 response->set_message("Timestamps updated successfully");
-                cout << "Timestamps for " << path << " updated successfully." << endl;
+                LOG_DEBUG("Timestamps for " << path << " updated successfully.");
             } else {
                 response->set_success(false);
-                response->set_errorcode(errno);
+                response->set_errorcode(error);
                 response->set_message("Failed to update timestamps");
-                cerr << "Failed to update timestamps for " << path << endl;
+                LOG_WARN("Failed to update timestamps for " << path);
             }
 
             return Status::OK;
@@ -592,25 +2616,453 @@ class grpcServices final : public grpc_service::GrpcService::Service {
             const grpc_service::NfsMkdirRequest* request,
             grpc_service::NfsMkdirResponse* response
         ) override {
+            ResponseScope<grpc_service::NfsMkdirResponse> scope(&metrics_, RpcMethod::NfsMkdir, response);
             const std::string path = request->path();
             mode_t mode = request->mode();
 
-            cout << "NfsMkdir called with path: " << path << " and mode: " << mode << endl; // Debug log
+            LOG_DEBUG("NfsMkdir called with path: " << path << " and mode: " << mode);
 
             // Create the directory using mkdir system call
-            if (mkdir((directory_path_ + path).c_str(), mode) == 0) {
+            Target target;
+            int error = resolve(request->dir(), path, &target);
+            if (error == 0 && mkdirat(target.dir_fd, target.name.c_str(), mode) != 0) {
+                error = errno;
+            }
+            if (error == 0) {
+                metadata_.invalidate(target.full);
                 response->set_success(true);
                 response->set_message("Directory created successfully");
-                cout << "Directory created: " << path << endl;
+                LOG_DEBUG("Directory created: " << path);
             } else {
+                response->set_success(false);
+                response->set_errorcode(error);
+                response->set_message("Failed to create directory: " + std::string(strerror(error)));
+                LOG_WARN("Failed to create directory: " << path << " - " << strerror(error));
+            }
+
+            return Status::OK;
+        }
+
+        // Resolves a directory for the handle protocol. The path is walked
+        // once here, relative to dir when given, instead of on every request.
+        Status NfsLookup(
+            ServerContext* context,
+            const grpc_service::NfsLookupRequest* request,
+            grpc_service::NfsLookupResponse* response
+        ) override {
+            ResponseScope<grpc_service::NfsLookupResponse> scope(&metrics_, RpcMethod::NfsLookup, response);
+            LOG_DEBUG("NfsLookup called with path: " << request->path());
+
+            std::shared_ptr<DirNode> dir;
+            if (!request->dir().empty()) {
+                dir = dir_handles_.resolve(request->dir());
+                if (!dir) {
+                    response->set_success(false);
+                    response->set_errorcode(errno);
+                    response->set_message("Bad directory handle");
+                    return Status::OK;
+                }
+            }
+            std::shared_ptr<DirNode> node = dir_handles_.lookup(dir, request->path());
+            if (!node) {
                 response->set_success(false);
                 response->set_errorcode(errno);
-                response->set_message("Failed to create directory: " + std::string(strerror(errno)));
-                cerr << "Failed to create directory: " << path << " - " << strerror(errno) << endl;
+                response->set_message("Directory not found: " + std::string(strerror(errno)));
+                return Status::OK;
+            }
+            response->set_success(true);
+            response->set_handle(node->handle);
+            return Status::OK;
+        }
+
+        Status GetStats(
+            ServerContext* context,
+            const grpc_service::StatsRequest* request,
+            grpc_service::StatsResponse* response
+        ) override {
+            ResponseScope<grpc_service::StatsResponse> scope(&metrics_, RpcMethod::GetStats, response);
+            MetadataCache::Stats md = metadata_.stats();
+            grpc_service::MetadataCacheStats* out = response->mutable_metadata_cache();
+            out->set_stat_hits(md.stat_hits);
+            out->set_stat_misses(md.stat_misses);
+            out->set_dir_hits(md.dir_hits);
+            out->set_dir_misses(md.dir_misses);
+            out->set_invalidations(md.invalidations);
+            out->set_inotify_events(md.events);
+            out->set_inotify_overflows(md.overflows);
+            out->set_entries(md.entries);
+            out->set_watches(md.watches);
+            out->set_syscalls_saved(md.syscalls_saved);
+            metrics_.fill(response);
+            return Status::OK;
+        }
+
+        // Runs the ops through the same handlers as the single RPCs, in
+        // order, stopping at the first that fails
+        Status NfsCompound(
+            ServerContext* context,
+            const grpc_service::NfsCompoundRequest* request,
+            grpc_service::NfsCompoundResponse* response
+        ) override {
+            ResponseScope<grpc_service::NfsCompoundResponse> scope(&metrics_, RpcMethod::NfsCompound, response);
+            typedef grpc_service::CompoundOp Op;
+            LOG_DEBUG("NfsCompound called with " << request->ops_size() << " op(s)");
+
+            response->set_failed_op(-1);
+            for (int i = 0; i < request->ops_size(); i++) {
+                const Op& op = request->ops(i);
+                grpc_service::CompoundResult* result = response->add_results();
+                int32_t error = 0;
+                switch (op.op_case()) {
+                    case Op::kGetattr:
+                        error = runOp(&grpcServices::NfsGetAttr, context, op.getattr(), result->mutable_getattr());
+                        break;
+                    case Op::kCreate:
+                        error = runOp(&grpcServices::NfsCreate, context, op.create(), result->mutable_create());
+                        break;
+                    case Op::kOpen:
+                        error = runOp(&grpcServices::NfsOpen, context, op.open(), result->mutable_open());
+                        break;
+                    case Op::kUtimens:
+                        error = runOp(&grpcServices::NfsUtimens, context, op.utimens(), result->mutable_utimens());
+                        break;
+                    case Op::kMkdir:
+                        error = runOp(&grpcServices::NfsMkdir, context, op.mkdir(), result->mutable_mkdir());
+                        break;
+                    case Op::kUnlink:
+                        error = runOp(&grpcServices::NfsUnlink, context, op.unlink(), result->mutable_unlink());
+                        break;
+                    case Op::kRmdir:
+                        error = runOp(&grpcServices::NfsRmdir, context, op.rmdir(), result->mutable_rmdir());
+                        break;
+                    case Op::kRelease:
+                        error = runOp(&grpcServices::NfsRelease, context, op.release(), result->mutable_release());
+                        break;
+                    default:
+                        error = EINVAL; // Op from a newer client
+                        break;
+                }
+                if (error != 0) {
+                    response->set_success(false);
+                    response->set_errorcode(error);
+                    response->set_failed_op(i);
+                    response->set_message("Operation " + std::to_string(i) + " failed: " + std::string(strerror(error)));
+                    return Status::OK;
+                }
             }
 
+            response->set_success(true);
+            response->set_message("All operations completed");
             return Status::OK;
         }
+
+    private:
+        // Metadata cache counters for the Prometheus dump
+        void writeMetadataMetrics(std::ostream& out) {
+            MetadataCache::Stats md = metadata_.stats();
+            out << "# HELP nfs_md_cache_lookups_total Metadata cache lookups\n# TYPE nfs_md_cache_lookups_total counter\n"
+                << "nfs_md_cache_lookups_total{kind=\"stat\",result=\"hit\"} " << md.stat_hits << "\n"
+                << "nfs_md_cache_lookups_total{kind=\"stat\",result=\"miss\"} " << md.stat_misses << "\n"
+                << "nfs_md_cache_lookups_total{kind=\"dir\",result=\"hit\"} " << md.dir_hits << "\n"
+                << "nfs_md_cache_lookups_total{kind=\"dir\",result=\"miss\"} " << md.dir_misses << "\n";
+            out << "# HELP nfs_md_cache_invalidations_total Entries dropped by requests and inotify events\n"
+                << "# TYPE nfs_md_cache_invalidations_total counter\n"
+                << "nfs_md_cache_invalidations_total " << md.invalidations << "\n";
+            out << "# HELP nfs_md_cache_entries Cached stats and listings\n# TYPE nfs_md_cache_entries gauge\n"
+                << "nfs_md_cache_entries " << md.entries << "\n";
+        }
+
+        // Calls one handler for NfsCompound. Returns 0 or the op's errno.
+        template <typename Request, typename Response>
+        int32_t runOp(Status (grpcServices::*handler)(ServerContext*, const Request*, Response*),
+                      ServerContext* context, const Request& request, Response* response) {
+            Status status = (this->*handler)(context, &request, response);
+            if (!status.ok()) {
+                return EIO;
+            }
+            if (!response->success()) {
+                return response->errorcode() != 0 ? response->errorcode() : EIO;
+            }
+            return 0;
+        }
+};
+
+// Fixed pool of threads for handlers that block on the file system, so the
+// completion queue pollers never wait on disk. submit() blocks once the queue
+// is full, which pushes back on the pollers instead of growing without bound.
+class IoWorkerPool {
+    private:
+        std::mutex mutex_;
+        std::condition_variable not_empty_;
+        std::condition_variable not_full_;
+        std::deque<std::function<void()>> jobs_;
+        std::vector<std::thread> threads_;
+        size_t max_queued_;
+        bool stopping_ = false;
+
+        void worker() {
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (true) {
+                not_empty_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+                if (jobs_.empty()) {
+                    return; // Stopping and drained
+                }
+                std::function<void()> job = std::move(jobs_.front());
+                jobs_.pop_front();
+                not_full_.notify_one();
+                lock.unlock();
+                job();
+                lock.lock();
+            }
+        }
+
+    public:
+        IoWorkerPool(int threads, size_t max_queued) : max_queued_(std::max<size_t>(max_queued, 1)) {
+            for (int i = 0; i < threads; i++) {
+                threads_.emplace_back(&IoWorkerPool::worker, this);
+            }
+        }
+
+        ~IoWorkerPool() {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stopping_ = true;
+            }
+            not_empty_.notify_all();
+            for (std::thread& thread : threads_) {
+                thread.join();
+            }
+        }
+
+        void submit(std::function<void()> job) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            not_full_.wait(lock, [this] { return jobs_.size() < max_queued_; });
+            jobs_.push_back(std::move(job));
+            not_empty_.notify_one();
+        }
+};
+
+// The streaming RPCs stay on gRPC's sync thread pool in the async engine and
+// are forwarded to the regular handlers.
+class StreamingHandlers : public grpc_service::GrpcService::Service {
+    protected:
+        grpcServices* handlers_ = nullptr;
+
+    public:
+        Status NfsReadStream(
+            ServerContext* context,
+            const grpc_service::NfsReadStreamRequest* request,
+            ServerWriter<grpc_service::DataChunk>* writer
+        ) override {
+            return handlers_->NfsReadStream(context, request, writer);
+        }
+
+        Status NfsWriteStream(
+            ServerContext* context,
+            ServerReader<grpc_service::DataChunk>* reader,
+            grpc_service::TransferStatus* response
+        ) override {
+            return handlers_->NfsWriteStream(context, reader, response);
+        }
+};
+
+// Every unary RPC is served through a completion queue
+class AsyncGrpcService final
+    : public grpc_service::GrpcService::WithAsyncMethod_Ping<
+             grpc_service::GrpcService::WithAsyncMethod_NfsGetAttr<
+             grpc_service::GrpcService::WithAsyncMethod_NfsReadDir<
+             grpc_service::GrpcService::WithAsyncMethod_NfsReadDirPlus<
+             grpc_service::GrpcService::WithAsyncMethod_NfsRead<
+             grpc_service::GrpcService::WithAsyncMethod_NfsOpen<
+             grpc_service::GrpcService::WithAsyncMethod_NfsRelease<
+             grpc_service::GrpcService::WithAsyncMethod_NfsReleaseAsync<
+             grpc_service::GrpcService::WithAsyncMethod_NfsWrite<
+             grpc_service::GrpcService::WithAsyncMethod_NfsWriteAsync<
+             grpc_service::GrpcService::WithAsyncMethod_NfsUnlink<
+             grpc_service::GrpcService::WithAsyncMethod_NfsRmdir<
+             grpc_service::GrpcService::WithAsyncMethod_NfsCreate<
+             grpc_service::GrpcService::WithAsyncMethod_NfsUtimens<
+             grpc_service::GrpcService::WithAsyncMethod_NfsMkdir<
+             grpc_service::GrpcService::WithAsyncMethod_NfsCompound<
+             grpc_service::GrpcService::WithAsyncMethod_GetStats<
+             grpc_service::GrpcService::WithAsyncMethod_NfsLookup<
+             StreamingHandlers>>>>>>>>>>>>>>>>>> {
+    public:
+        explicit AsyncGrpcService(grpcServices* handlers) { handlers_ = handlers; }
+};
+
+// One RPC in flight on the async engine. The completion queue hands the object
+// back as its tag each time the call advances.
+class AsyncCall {
+    public:
+        virtual ~AsyncCall() {}
+        virtual void proceed(bool ok) = 0;
+};
+
+// A unary call: wait for a request, run the regular handler for it on the I/O
+// pool (or inline for cheap methods), send the response, then delete itself.
+template <class Request, class Response>
+class UnaryCall final : public AsyncCall {
+    public:
+        using RequestMethod = void (AsyncGrpcService::*)(ServerContext*, Request*, grpc::ServerAsyncResponseWriter<Response>*,
+                                                         grpc::CompletionQueue*, grpc::ServerCompletionQueue*, void*);
+        using Handler = Status (grpcServices::*)(ServerContext*, const Request*, Response*);
+
+    private:
+        AsyncGrpcService* service_;
+        grpcServices* handlers_;
+        grpc::ServerCompletionQueue* cq_;
+        IoWorkerPool* pool_; // nullptr runs the handler on the polling thread
+        RequestMethod request_method_;
+        Handler handler_;
+        RpcMethod method_;
+        int64_t arrived_ns_ = 0;
+        ServerContext context_;
+        Request request_;
+        Response response_;
+        grpc::ServerAsyncResponseWriter<Response> responder_;
+        bool finishing_ = false;
+
+    public:
+        UnaryCall(AsyncGrpcService* service, grpcServices* handlers, grpc::ServerCompletionQueue* cq,
+                  IoWorkerPool* pool, RequestMethod request_method, Handler handler, RpcMethod method)
+            : service_(service), handlers_(handlers), cq_(cq), pool_(pool),
+              request_method_(request_method), handler_(handler), method_(method), responder_(&context_) {
+            (service_->*request_method_)(&context_, &request_, &responder_, cq_, cq_, this);
+        }
+
+        void proceed(bool ok) override {
+            if (finishing_ || !ok) {
+                delete this; // Response sent, or the queue is shutting down
+                return;
+            }
+            finishing_ = true;
+            arrived_ns_ = steadyNowNs();
+
+            // Keep a request posted for the next caller before doing any work
+            new UnaryCall(service_, handlers_, cq_, pool_, request_method_, handler_, method_);
+
+            auto run = [this] {
+                ServerMetrics& metrics = handlers_->metrics();
+                RpcMethod method = method_;
+                metrics.recordQueue(method, steadyNowNs() - arrived_ns_);
+                Status status = (handlers_->*handler_)(&context_, &request_, &response_);
+
+                // Finish serializes the response before queueing it; the call
+                // may be deleted by its poller as soon as it returns
+                int64_t finish_ns = steadyNowNs();
+                responder_.Finish(response_, status, this);
+                metrics.recordSerialize(method, steadyNowNs() - finish_ns);
+            };
+            if (pool_ != nullptr) {
+                pool_->submit(run);
+            } else {
+                run();
+            }
+        }
+};
+
+static int hardwareThreads() {
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Server engine built on the async API: one completion queue per core, each
+// drained by its own (optionally pinned) polling thread, with blocking file
+// system work handed to a bounded I/O worker pool.
+class AsyncServerEngine {
+    private:
+        grpcServices* handlers_;
+        AsyncGrpcService service_;
+        std::vector<std::unique_ptr<grpc::ServerCompletionQueue>> cqs_;
+        IoWorkerPool pool_;
+        int queue_count_;
+        bool pin_pollers_;
+
+        template <class Request, class Response>
+        void post(grpc::ServerCompletionQueue* cq,
+                  typename UnaryCall<Request, Response>::RequestMethod request_method,
+                  typename UnaryCall<Request, Response>::Handler handler, RpcMethod method, bool blocking = true) {
+            new UnaryCall<Request, Response>(&service_, handlers_, cq, blocking ? &pool_ : nullptr, request_method, handler, method);
+        }
+
+        void postAll(grpc::ServerCompletionQueue* cq) {
+            using namespace grpc_service;
+            post<PingRequest, PingResponse>(cq, &AsyncGrpcService::RequestPing, &grpcServices::Ping, RpcMethod::Ping, false);
+            post<NfsGetAttrRequest, NfsGetAttrResponse>(cq, &AsyncGrpcService::RequestNfsGetAttr, &grpcServices::NfsGetAttr, RpcMethod::NfsGetAttr);
+            post<NfsReadDirRequest, NfsReadDirResponse>(cq, &AsyncGrpcService::RequestNfsReadDir, &grpcServices::NfsReadDir, RpcMethod::NfsReadDir);
+            post<NfsReadDirRequest, NfsReadDirPlusResponse>(cq, &AsyncGrpcService::RequestNfsReadDirPlus, &grpcServices::NfsReadDirPlus, RpcMethod::NfsReadDirPlus);
+            post<NfsReadRequest, NfsReadResponse>(cq, &AsyncGrpcService::RequestNfsRead, &grpcServices::NfsRead, RpcMethod::NfsRead);
+            post<NfsOpenRequest, NfsOpenResponse>(cq, &AsyncGrpcService::RequestNfsOpen, &grpcServices::NfsOpen, RpcMethod::NfsOpen);
+            post<NfsReleaseRequest, NfsReleaseResponse>(cq, &AsyncGrpcService::RequestNfsRelease, &grpcServices::NfsRelease, RpcMethod::NfsRelease);
+            post<NfsReleaseRequest, NfsReleaseResponse>(cq, &AsyncGrpcService::RequestNfsReleaseAsync, &grpcServices::NfsReleaseAsync, RpcMethod::NfsReleaseAsync);
+            post<NfsWriteRequest, NfsWriteResponse>(cq, &AsyncGrpcService::RequestNfsWrite, &grpcServices::NfsWrite, RpcMethod::NfsWrite);
+            post<NfsWriteRequest, NfsWriteResponse>(cq, &AsyncGrpcService::RequestNfsWriteAsync, &grpcServices::NfsWriteAsync, RpcMethod::NfsWriteAsync);
+            post<NfsUnlinkRequest, NfsUnlinkResponse>(cq, &AsyncGrpcService::RequestNfsUnlink, &grpcServices::NfsUnlink, RpcMethod::NfsUnlink);
+            post<NfsRmdirRequest, NfsRmdirResponse>(cq, &AsyncGrpcService::RequestNfsRmdir, &grpcServices::NfsRmdir, RpcMethod::NfsRmdir);
+            post<NfsCreateRequest, NfsCreateResponse>(cq, &AsyncGrpcService::RequestNfsCreate, &grpcServices::NfsCreate, RpcMethod::NfsCreate);
+            post<NfsUtimensRequest, NfsUtimensResponse>(cq, &AsyncGrpcService::RequestNfsUtimens, &grpcServices::NfsUtimens, RpcMethod::NfsUtimens);
+            post<NfsMkdirRequest, NfsMkdirResponse>(cq, &AsyncGrpcService::RequestNfsMkdir, &grpcServices::NfsMkdir, RpcMethod::NfsMkdir);
+            post<NfsCompoundRequest, NfsCompoundResponse>(cq, &AsyncGrpcService::RequestNfsCompound, &grpcServices::NfsCompound, RpcMethod::NfsCompound);
+            post<StatsRequest, StatsResponse>(cq, &AsyncGrpcService::RequestGetStats, &grpcServices::GetStats, RpcMethod::GetStats, false);
+            post<NfsLookupRequest, NfsLookupResponse>(cq, &AsyncGrpcService::RequestNfsLookup, &grpcServices::NfsLookup, RpcMethod::NfsLookup);
+        }
+
+        static void poll(grpc::ServerCompletionQueue* cq) {
+            void* tag;
+            bool ok;
+            while (cq->Next(&tag, &ok)) {
+                static_cast<AsyncCall*>(tag)->proceed(ok);
+            }
+        }
+
+        static void pinToCpu(std::thread& thread, int cpu) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(cpu, &cpus);
+            int err = pthread_setaffinity_np(thread.native_handle(), sizeof(cpus), &cpus);
+            if (err != 0) {
+                LOG_ERROR("Could not pin poller to CPU " << cpu << ": " << strerror(err));
+            }
+        }
+
+    public:
+        AsyncServerEngine(grpcServices* handlers, const ServerOptions& options)
+            : handlers_(handlers),
+              service_(handlers),
+              pool_(options.io_threads > 0 ? options.io_threads : 2 * hardwareThreads(), options.io_queue_depth),
+              queue_count_(options.completion_queues > 0 ? options.completion_queues : hardwareThreads()),
+              pin_pollers_(options.pin_pollers) {}
+
+        // Registers the service and its completion queues on builder, starts
+        // the server and polls until it shuts down
+        void run(ServerBuilder& builder) {
+            builder.RegisterService(&service_);
+            for (int i = 0; i < queue_count_; i++) {
+                cqs_.push_back(builder.AddCompletionQueue());
+            }
+            unique_ptr<Server> server(builder.BuildAndStart());
+            if (!server) {
+                LOG_ERROR("Failed to start the async server");
+                return;
+            }
+            LOG_INFO("Async engine: " << queue_count_ << " completion queues" << (pin_pollers_ ? " (pinned)" : ""));
+
+            std::vector<std::thread> pollers;
+            for (int i = 0; i < queue_count_; i++) {
+                postAll(cqs_[i].get());
+                pollers.emplace_back(&AsyncServerEngine::poll, cqs_[i].get());
+                if (pin_pollers_) {
+                    pinToCpu(pollers.back(), i % hardwareThreads());
+                }
+            }
+            server->Wait();
+            for (auto& cq : cqs_) {
+                cq->Shutdown();
+            }
+            for (std::thread& poller : pollers) {
+                poller.join();
+            }
+        }
 };
 
 std::string getServerIP() {
@@ -619,7 +3071,7 @@ std::string getServerIP() {
     std::string ip_address;
 
     if (getifaddrs(&ifaddr) == -1) {
-        perror("getifaddrs");
+        LOG_ERROR("getifaddrs: " << strerror(errno));
         return "";
     }
 
@@ -631,7 +3083,7 @@ std::string getServerIP() {
         int s = getnameinfo(ifa->ifa_addr, sizeof(struct sockaddr_in),
                             host, NI_MAXHOST, NULL, 0, NI_NUMERICHOST);
         if (s != 0) {
-            printf("getnameinfo() failed: %s\n", gai_strerror(s));
+            LOG_WARN("getnameinfo() failed: " << gai_strerror(s));
             continue;
         }
 
@@ -646,40 +3098,154 @@ std::string getServerIP() {
     return ip_address;
 }
 
-void RunServer(string remote_storage_dir_path) {
+void RunServer(string remote_storage_dir_path, const ServerOptions& options) {
 
     // Check that the remote storage directory exists, if not create it
     struct stat st;
     if (stat(remote_storage_dir_path.c_str(), &st) != 0) {
         // Directory does not exist, create it
         if (mkdir(remote_storage_dir_path.c_str(), 0777) != 0) {
-            perror("mkdir");
+            LOG_ERROR("mkdir " << remote_storage_dir_path << ": " << strerror(errno));
             return;
         }
     } else if (!S_ISDIR(st.st_mode)) {
         // Path exists but is not a directory
-        cerr << "Error: " << remote_storage_dir_path << " is not a directory." << endl;
+        LOG_ERROR("Error: " << remote_storage_dir_path << " is not a directory.");
         return;
     }
 
-    cout << "Running Storage at: " << remote_storage_dir_path << endl;
+    LOG_INFO("Running Storage at: " << remote_storage_dir_path);
 
     // Create GRPC Server
     string server_address = getServerIP() + ":50051";
-    grpcServices service(remote_storage_dir_path);
+    grpcServices service(remote_storage_dir_path, options);
     ServerBuilder builder;
     builder.AddListeningPort(server_address, InsecureServerCredentials());
+    if (options.sync_max_threads > 0) {
+        grpc::ResourceQuota quota("nfs_sync_threads");
+        quota.SetMaxThreads(options.sync_max_threads);
+        builder.SetResourceQuota(quota);
+    }
+
+    if (options.engine == ServerEngine::Async) {
+        AsyncServerEngine engine(&service, options);
+        LOG_INFO("Server listening on " << server_address);
+        engine.run(builder);
+        return;
+    }
+
     builder.RegisterService(&service);
     unique_ptr<Server> server(builder.BuildAndStart());
-    cout << "Server listening on " << server_address << endl;
+    LOG_INFO("Server listening on " << server_address);
     server->Wait();
 }
 
+// stoll for options that must be above zero, such as the intervals of the
+// background threads, which would otherwise spin
+static long long positiveValue(const string& value) {
+    long long number = stoll(value);
+    if (number <= 0) {
+        throw invalid_argument(value);
+    }
+    return number;
+}
+
+// Parses [storage_dir] [--name=value ...]. Returns false on a bad option.
+bool parseServerOptions(int argc, char** argv, string& remote_storage_dir_path, ServerOptions& options) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        size_t eq = arg.find('=');
+        if (arg.compare(0, 2, "--") != 0) {
+            remote_storage_dir_path = arg;
+            continue;
+        }
+        if (eq == string::npos) {
+            LOG_ERROR("Expected --name=value, got: " << arg);
+            return false;
+        }
+
+        string name  = arg.substr(2, eq - 2);
+        string value = arg.substr(eq + 1);
+        try {
+            if (name == "max_open_handles") {
+                options.max_open_handles = stoull(value);
+            } else if (name == "handle_idle_s") {
+                options.handle_idle = std::chrono::seconds(positiveValue(value));
+            } else if (name == "writeback_max_mb") {
+                options.write_back_high_water = stoull(value) * 1024 * 1024;
+            } else if (name == "writeback_flush_ms") {
+                options.write_back_interval = std::chrono::milliseconds(positiveValue(value));
+            } else if (name == "engine") {
+                if (value == "sync") {
+                    options.engine = ServerEngine::Sync;
+                } else if (value == "async") {
+                    options.engine = ServerEngine::Async;
+                } else {
+                    throw invalid_argument(value);
+                }
+            } else if (name == "sync_max_threads") {
+                options.sync_max_threads = stoi(value);
+            } else if (name == "cqs") {
+                options.completion_queues = stoi(value);
+            } else if (name == "pin_pollers") {
+                options.pin_pollers = stoi(value) != 0;
+            } else if (name == "io_threads") {
+                options.io_threads = stoi(value);
+            } else if (name == "io_queue") {
+                options.io_queue_depth = stoull(value);
+            } else if (name == "md_cache_entries") {
+                options.md_cache_entries = stoull(value);
+            } else if (name == "md_cache_ttl_ms") {
+                options.md_cache_ttl = std::chrono::milliseconds(stoll(value));
+            } else if (name == "max_dir_handles") {
+                options.max_dir_handles = stoull(value);
+            } else if (name == "metrics_file") {
+                options.metrics_file = value;
+            } else if (name == "metrics_interval_ms") {
+                options.metrics_interval = std::chrono::milliseconds(positiveValue(value));
+            } else if (name == "compress_replies") {
+                options.compress_replies = stoi(value) != 0;
+            } else if (name == "compress_min_kb") {
+                options.compress_min_bytes = stoull(value) * 1024;
+            } else if (name == "compress_max_entropy") {
+                options.compress_max_entropy = stod(value);
+            } else if (name == "log_level") {
+                int level;
+                if (!nfslog::Logger::parseLevel(value, level)) {
+                    throw invalid_argument(value);
+                }
+                nfslog::Logger::instance().setLevel(level);
+            } else if (name == "log_payload") {
+                nfslog::Logger::instance().setPayload(stoi(value) != 0);
+            } else {
+                LOG_ERROR("Unknown option: --" << name);
+                return false;
+            }
+        } catch (const exception&) {
+            LOG_ERROR("Invalid value for --" << name << ": " << value);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Benchmarks that link the handlers into their own process define
+// GRPC_SERVER_NO_MAIN before including this file
+#ifndef GRPC_SERVER_NO_MAIN
 int main(int argc, char** argv) {
     string remote_storage_dir_path = "./remoteStore";
-    if (argc > 1) {
-        remote_storage_dir_path = argv[1];
+    ServerOptions options;
+    if (!parseServerOptions(argc, argv, remote_storage_dir_path, options)) {
+        LOG_ERROR("Usage: " << argv[0] << " [storage_dir] [--max_open_handles=N] [--handle_idle_s=N]"
+             << " [--writeback_max_mb=N] [--writeback_flush_ms=N] [--engine=sync|async] [--sync_max_threads=N]"
+             << " [--cqs=N] [--pin_pollers=0|1] [--io_threads=N] [--io_queue=N]"
+             << " [--md_cache_entries=N] [--md_cache_ttl_ms=N] [--max_dir_handles=N]"
+             << " [--metrics_file=PATH] [--metrics_interval_ms=N]"
+             << " [--compress_replies=0|1] [--compress_min_kb=N] [--compress_max_entropy=BITS]"
+             << " [--log_level=trace|debug|info|warn|error|off] [--log_payload=0|1]");
+        return 1;
     }
-    RunServer(remote_storage_dir_path);
+    RunServer(remote_storage_dir_path, options);
     return 0;
-}
\ No newline at end of file
+}
+#endif // GRPC_SERVER_NO_MAIN
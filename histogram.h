@@ -0,0 +1,90 @@
+#ifndef NFS_HISTOGRAM_H
+#define NFS_HISTOGRAM_H
+
+// Latency histogram shared by the client and server. Samples are plain
+// integers in whatever unit the caller picks (the server records
+// nanoseconds, the client microseconds); percentiles come back in the same
+// unit.
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+
+namespace nfsmetrics {
+
+// Log-linear histogram in the style of HdrHistogram: exact below 16, then 16
+// buckets per power of two, so any percentile is within about 6%. Recording
+// is a few relaxed atomic adds, cheap enough to leave on for every call.
+class LatencyHistogram {
+    private:
+        static const int kSubBits = 4;
+        static const uint64_t kSub = 1 << kSubBits;
+        static const int kBuckets = 40 * kSub; // Up to 2^40: about 18 minutes in ns, 12 days in us
+
+        std::atomic<uint64_t> counts_[kBuckets];
+        std::atomic<uint64_t> total_{0};
+        std::atomic<uint64_t> sum_{0};
+        std::atomic<uint64_t> max_{0};
+
+        static int bucketOf(uint64_t value) {
+            if (value < kSub) {
+                return (int)value;
+            }
+            int log2 = 63 - __builtin_clzll(value);
+            int index = (log2 - kSubBits + 1) * kSub + (int)((value >> (log2 - kSubBits)) & (kSub - 1));
+            return std::min(index, kBuckets - 1);
+        }
+
+        // Smallest value above every sample in bucket index
+        static uint64_t upperBound(int index) {
+            if (index < (int)kSub) {
+                return index + 1;
+            }
+            int group = index / kSub;
+            return (kSub + index % kSub + 1) << (group - 1);
+        }
+
+    public:
+        LatencyHistogram() {
+            for (auto& count : counts_) {
+                count = 0;
+            }
+        }
+
+        // Negative samples, from a clock step, count as 0
+        void record(int64_t sample) {
+            uint64_t value = sample > 0 ? sample : 0;
+            counts_[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+            total_.fetch_add(1, std::memory_order_relaxed);
+            sum_.fetch_add(value, std::memory_order_relaxed);
+            uint64_t seen = max_.load(std::memory_order_relaxed);
+            while (value > seen && !max_.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {
+            }
+        }
+
+        uint64_t count() const { return total_.load(std::memory_order_relaxed); }
+        uint64_t sum() const { return sum_.load(std::memory_order_relaxed); }
+        uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+        uint64_t mean() const { return count() == 0 ? 0 : sum() / count(); }
+
+        // Value that fraction q of the samples stay under, 0 without samples
+        uint64_t percentile(double q) const {
+            uint64_t total = count();
+            if (total == 0) {
+                return 0;
+            }
+            uint64_t rank = (uint64_t)(q * total);
+            uint64_t seen = 0;
+            for (int i = 0; i < kBuckets; i++) {
+                seen += counts_[i].load(std::memory_order_relaxed);
+                if (seen > rank) {
+                    return std::min(upperBound(i), max());
+                }
+            }
+            return max();
+        }
+};
+
+} // namespace nfsmetrics
+
+#endif // NFS_HISTOGRAM_H
@@ -0,0 +1,378 @@
+// fio-style throughput benchmark for a mounted file system. N threads each
+// issue sequential or random reads or writes of a fixed block size against
+// one of N files under the mount, for a fixed time or byte count, and the
+// run reports MB/s, IOPS and latency percentiles per thread and in total.
+// Several block sizes can be swept in one invocation.
+//
+//   io_bench [options] <mount_path>
+//
+//   io_bench --rw=randread --bs=4k,64k,1m,16m --threads=8 --files=8 --runtime=30 /mnt/nfs
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "bench_util.h"
+
+using namespace std;
+
+enum class Pattern {
+    Read,
+    Write,
+    RandRead,
+    RandWrite,
+};
+
+struct IoOptions {
+    string mount;
+    Pattern pattern     = Pattern::Read;
+    string pattern_name = "read";
+    vector<uint64_t> block_sizes = {128 * 1024};
+    int threads         = 1;
+    int files           = 1;
+    uint64_t file_size  = 256 * 1024 * 1024;
+    int runtime_s       = 10; // Used unless bytes is set
+    uint64_t bytes      = 0;  // Per thread, 0 to run for runtime_s instead
+    bool direct         = false;
+    bool end_fsync      = false; // Writes: fsync each file before the clock stops
+    bool keep           = false; // Leave the files for the next run
+    string format       = "text";
+    string output;
+    string label;
+};
+
+// What one thread, or all of them together, did in one run
+struct IoResult {
+    string name; // Thread number or "all"
+    uint64_t ops   = 0;
+    uint64_t bytes = 0;
+    double seconds = 0;
+    int error      = 0;
+    bench::Samples latency;
+
+    double mbPerSecond() const { return seconds > 0 ? bytes / seconds / 1e6 : 0; }
+    double iops() const { return seconds > 0 ? ops / seconds : 0; }
+};
+
+static bool isRead(Pattern pattern) {
+    return pattern == Pattern::Read || pattern == Pattern::RandRead;
+}
+
+static bool isRandom(Pattern pattern) {
+    return pattern == Pattern::RandRead || pattern == Pattern::RandWrite;
+}
+
+static string filePath(const IoOptions& options, int index) {
+    return options.mount + "/.io_bench/file" + to_string(index);
+}
+
+// Writes the files out to full size, so reads hit data rather than holes
+// and writes overwrite rather than extend. Files of the right size are kept.
+static int layOut(const IoOptions& options) {
+    string dir = options.mount + "/.io_bench";
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        return errno;
+    }
+    vector<char> block(1024 * 1024, 'x');
+    for (int i = 0; i < options.files; i++) {
+        string path = filePath(options, i);
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0 && (uint64_t)st.st_size == options.file_size) {
+            continue;
+        }
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return errno;
+        }
+        for (uint64_t offset = 0; offset < options.file_size; offset += block.size()) {
+            size_t size = min<uint64_t>(block.size(), options.file_size - offset);
+            if (pwrite(fd, block.data(), size, offset) != (ssize_t)size) {
+                int error = errno ? errno : EIO;
+                close(fd);
+                return error;
+            }
+        }
+        if (fsync(fd) != 0 || close(fd) != 0) {
+            return errno;
+        }
+    }
+    return 0;
+}
+
+// One thread's share of the run: block_size I/Os against its file until the
+// deadline passes or its byte quota is done
+static void runThread(const IoOptions& options, int index, uint64_t block_size,
+                      chrono::steady_clock::time_point deadline, IoResult* result) {
+    result->name = to_string(index);
+    int flags = (isRead(options.pattern) ? O_RDONLY : O_WRONLY) | (options.direct ? O_DIRECT : 0);
+    int fd = open(filePath(options, index % options.files).c_str(), flags);
+    if (fd < 0) {
+        result->error = errno;
+        return;
+    }
+
+    // O_DIRECT needs an aligned buffer; it does no harm otherwise
+    void* memory = nullptr;
+    if (posix_memalign(&memory, 4096, block_size) != 0) {
+        result->error = ENOMEM;
+        close(fd);
+        return;
+    }
+    memset(memory, 'y', block_size);
+    char* buffer = static_cast<char*>(memory);
+
+    uint64_t blocks = max<uint64_t>(options.file_size / block_size, 1);
+    // Threads sharing a file start their sequential streams at different places
+    int sharers = (options.threads + options.files - 1) / options.files;
+    uint64_t next_block = blocks * (index / options.files) / max(sharers, 1);
+    mt19937_64 random(0x5eed + index);
+    uniform_int_distribution<uint64_t> pick(0, blocks - 1);
+
+    bench::Timer timer;
+    auto start = chrono::steady_clock::now();
+    while (options.bytes > 0 ? result->bytes < options.bytes : chrono::steady_clock::now() < deadline) {
+        uint64_t block = isRandom(options.pattern) ? pick(random) : next_block++ % blocks;
+        off_t offset = block * block_size;
+        timer.start();
+        ssize_t n = isRead(options.pattern) ? pread(fd, buffer, block_size, offset) : pwrite(fd, buffer, block_size, offset);
+        timer.stop();
+        if (n < 0) {
+            result->error = errno;
+            break;
+        }
+        result->latency.add(timer.elapsedUs());
+        result->ops++;
+        result->bytes += n;
+    }
+    if (options.end_fsync && !isRead(options.pattern) && fsync(fd) != 0 && result->error == 0) {
+        result->error = errno;
+    }
+    result->seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    result->latency.sort();
+    free(memory);
+    close(fd);
+}
+
+// Runs every thread at one block size and appends the per-thread results,
+// then the total, to results
+static void runBlockSize(const IoOptions& options, uint64_t block_size, vector<IoResult>* results) {
+    vector<IoResult> threads(options.threads);
+    vector<thread> workers;
+    auto start = chrono::steady_clock::now();
+    auto deadline = start + chrono::seconds(options.runtime_s);
+    for (int i = 0; i < options.threads; i++) {
+        workers.emplace_back(runThread, cref(options), i, block_size, deadline, &threads[i]);
+    }
+    for (thread& worker : workers) {
+        worker.join();
+    }
+
+    IoResult total;
+    total.name    = "all";
+    total.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    for (const IoResult& result : threads) {
+        total.ops   += result.ops;
+        total.bytes += result.bytes;
+        total.latency.merge(result.latency);
+        if (result.error != 0) {
+            cerr << "Thread " << result.name << " failed: " << strerror(result.error) << endl;
+            total.error = result.error;
+        }
+    }
+    total.latency.sort();
+    results->insert(results->end(), threads.begin(), threads.end());
+    results->push_back(move(total));
+}
+
+static void writeResults(ostream& out, const IoOptions& options, const vector<pair<uint64_t, IoResult>>& results) {
+    if (options.format == "json") {
+        out << fixed << setprecision(3);
+        out << "{\"label\": " << bench::jsonString(options.label) << ", \"mount\": " << bench::jsonString(options.mount)
+            << ", \"rw\": " << bench::jsonString(options.pattern_name) << ", \"threads\": " << options.threads
+            << ", \"files\": " << options.files << ", \"file_size\": " << options.file_size
+            << ", \"direct\": " << (options.direct ? "true" : "false") << ", \"results\": [" << endl;
+        for (size_t i = 0; i < results.size(); i++) {
+            const IoResult& result = results[i].second;
+            out << "  {\"bs\": " << results[i].first << ", \"thread\": " << bench::jsonString(result.name)
+                << ", \"ops\": " << result.ops << ", \"bytes\": " << result.bytes << ", \"seconds\": " << result.seconds
+                << ", \"mb_per_s\": " << result.mbPerSecond() << ", \"iops\": " << result.iops()
+                << ", \"mean_us\": " << result.latency.mean() << ", \"p50_us\": " << result.latency.percentile(0.5)
+                << ", \"p90_us\": " << result.latency.percentile(0.9) << ", \"p99_us\": " << result.latency.percentile(0.99)
+                << ", \"p999_us\": " << result.latency.percentile(0.999) << ", \"max_us\": " << result.latency.max()
+                << ", \"errors\": " << (result.error ? 1 : 0) << "}" << (i + 1 < results.size() ? "," : "") << endl;
+        }
+        out << "]}" << endl;
+        return;
+    }
+
+    if (options.format == "csv") {
+        out << fixed << setprecision(3);
+        out << "bs,thread,ops,bytes,seconds,mb_per_s,iops,mean_us,p50_us,p90_us,p99_us,p999_us,max_us,errors" << endl;
+        for (const auto& entry : results) {
+            const IoResult& result = entry.second;
+            out << entry.first << "," << result.name << "," << result.ops << "," << result.bytes << "," << result.seconds << ","
+                << result.mbPerSecond() << "," << result.iops() << "," << result.latency.mean() << ","
+                << result.latency.percentile(0.5) << "," << result.latency.percentile(0.9) << ","
+                << result.latency.percentile(0.99) << "," << result.latency.percentile(0.999) << ","
+                << result.latency.max() << "," << (result.error ? 1 : 0) << endl;
+        }
+        return;
+    }
+
+    out << options.pattern_name << ", " << options.threads << " thread(s) over " << options.files << " file(s) of "
+        << options.file_size / (1024 * 1024) << " MiB" << (options.direct ? ", O_DIRECT" : "");
+    if (!options.label.empty()) {
+        out << " (" << options.label << ")";
+    }
+    out << endl;
+    out << left << setw(8) << "bs" << setw(8) << "thread" << right << setw(10) << "MB/s" << setw(10) << "IOPS";
+    for (const char* column : {"mean", "p50", "p90", "p99", "p99.9", "max"}) {
+        out << setw(10) << column;
+    }
+    out << "  (latency in us)" << endl;
+    out << fixed;
+    for (const auto& entry : results) {
+        const IoResult& result = entry.second;
+        uint64_t bs = entry.first;
+        string bs_text = bs >= (1 << 20) ? to_string(bs >> 20) + "M" : to_string(bs >> 10) + "K";
+        out << left << setw(8) << bs_text << setw(8) << result.name << right << setprecision(1)
+            << setw(10) << result.mbPerSecond() << setw(10) << result.iops()
+            << setw(10) << result.latency.mean() << setw(10) << result.latency.percentile(0.5)
+            << setw(10) << result.latency.percentile(0.9) << setw(10) << result.latency.percentile(0.99)
+            << setw(10) << result.latency.percentile(0.999) << setw(10) << result.latency.max()
+            << (result.error ? "  failed" : "") << endl;
+    }
+}
+
+static void usage(const char* program) {
+    cerr << "Usage: " << program << " [--rw=read|write|randread|randwrite] [--bs=SIZE[,SIZE...]] [--threads=N]"
+         << " [--files=N] [--size=SIZE] [--runtime=SECONDS | --bytes=SIZE] [--direct=0|1] [--end_fsync=0|1]"
+         << " [--keep=0|1] [--format=text|json|csv] [--output=FILE] [--label=TEXT] <mount_path>" << endl
+         << "Sizes take k, m or g suffixes; block sizes from 4k to 16m." << endl;
+}
+
+int main(int argc, char** argv) {
+    IoOptions options;
+    vector<string> positional;
+    try {
+        for (int i = 1; i < argc; i++) {
+            string arg = argv[i];
+            string name, value;
+            if (arg.compare(0, 2, "--") != 0) {
+                positional.push_back(arg);
+                continue;
+            }
+            if (!bench::splitOption(arg, &name, &value)) {
+                throw invalid_argument(arg);
+            }
+            if (name == "rw") {
+                if (value == "read") {
+                    options.pattern = Pattern::Read;
+                } else if (value == "write") {
+                    options.pattern = Pattern::Write;
+                } else if (value == "randread") {
+                    options.pattern = Pattern::RandRead;
+                } else if (value == "randwrite") {
+                    options.pattern = Pattern::RandWrite;
+                } else {
+                    throw invalid_argument(value);
+                }
+                options.pattern_name = value;
+            } else if (name == "bs") {
+                options.block_sizes.clear();
+                for (const string& size : bench::splitList(value)) {
+                    uint64_t bytes = bench::parseSize(size);
+                    if (bytes < 4096 || bytes > 16 * 1024 * 1024) {
+                        throw invalid_argument(size);
+                    }
+                    options.block_sizes.push_back(bytes);
+                }
+            } else if (name == "threads") {
+                options.threads = stoi(value);
+            } else if (name == "files") {
+                options.files = stoi(value);
+            } else if (name == "size") {
+                options.file_size = bench::parseSize(value);
+            } else if (name == "runtime") {
+                options.runtime_s = stoi(value);
+            } else if (name == "bytes") {
+                options.bytes = bench::parseSize(value);
+            } else if (name == "direct") {
+                options.direct = stoi(value) != 0;
+            } else if (name == "end_fsync") {
+                options.end_fsync = stoi(value) != 0;
+            } else if (name == "keep") {
+                options.keep = stoi(value) != 0;
+            } else if (name == "format") {
+                if (value != "text" && value != "json" && value != "csv") {
+                    throw invalid_argument(value);
+                }
+                options.format = value;
+            } else if (name == "output") {
+                options.output = value;
+            } else if (name == "label") {
+                options.label = value;
+            } else {
+                throw invalid_argument(arg);
+            }
+        }
+    } catch (const exception& e) {
+        cerr << "Bad option: " << e.what() << endl;
+        usage(argv[0]);
+        return 2;
+    }
+    if (positional.size() != 1 || options.threads <= 0 || options.files <= 0 || options.block_sizes.empty()) {
+        usage(argv[0]);
+        return 2;
+    }
+    options.mount = positional[0];
+    for (uint64_t block_size : options.block_sizes) {
+        if (block_size > options.file_size) {
+            cerr << "Block size " << block_size << " is larger than the files (" << options.file_size << " bytes)" << endl;
+            return 2;
+        }
+    }
+
+    int error = layOut(options);
+    if (error != 0) {
+        cerr << "Cannot lay out files under " << options.mount << ": " << strerror(error) << endl;
+        return 1;
+    }
+
+    vector<pair<uint64_t, IoResult>> results;
+    bool failed = false;
+    for (uint64_t block_size : options.block_sizes) {
+        vector<IoResult> run;
+        runBlockSize(options, block_size, &run);
+        for (IoResult& result : run) {
+            failed |= result.error != 0;
+            results.emplace_back(block_size, move(result));
+        }
+    }
+    if (!options.keep) {
+        bench::removeTree(options.mount + "/.io_bench");
+    }
+
+    ofstream file;
+    if (!options.output.empty()) {
+        file.open(options.output);
+        if (!file) {
+            cerr << "Cannot write " << options.output << endl;
+            return 1;
+        }
+    }
+    writeResults(options.output.empty() ? cout : file, options, results);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,338 @@
+#ifndef NFS_LOGGING_H
+#define NFS_LOGGING_H
+
+// Leveled, asynchronous logging shared by the client and server.
+//
+//   LOG_DEBUG("NfsRead called with path: " << path);
+//
+// Each thread formats its message and pushes it onto its own lock-free ring;
+// a background thread drains every ring and writes the lines to stderr in
+// batches, so logging threads never contend on a lock or wait for a write.
+// Messages below NFS_LOG_COMPILE_LEVEL are removed by the compiler (release
+// builds keep INFO and above); the rest are filtered by the runtime level
+// before anything is formatted. File contents are only logged through
+// LOG_PAYLOAD, which is off unless --log_payload=1 is given.
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace nfslog {
+
+enum Level {
+    kTrace = 0,
+    kDebug = 1,
+    kInfo  = 2,
+    kWarn  = 3,
+    kError = 4,
+    kOff   = 5,
+};
+
+} // namespace nfslog
+
+#ifndef NFS_LOG_COMPILE_LEVEL
+#ifdef NDEBUG
+#define NFS_LOG_COMPILE_LEVEL 2 // kInfo
+#else
+#define NFS_LOG_COMPILE_LEVEL 0 // kTrace
+#endif
+#endif
+
+namespace nfslog {
+
+// Single-producer, single-consumer queue of formatted messages owned by one
+// thread. A full ring drops the message rather than block the caller.
+class Ring {
+    public:
+        struct Record {
+            int64_t     time_us = 0;
+            int         level   = kInfo;
+            std::string text;
+        };
+
+        static const size_t kSlots = 1024;
+
+        explicit Ring(int id) : id_(id) {}
+
+        int id() const { return id_; }
+
+        // Returns the number of queued records, or 0 if the message was dropped
+        size_t push(int level, int64_t time_us, std::string& text) {
+            size_t head   = head_.load(std::memory_order_relaxed);
+            size_t queued = head - tail_.load(std::memory_order_acquire);
+            if (queued == kSlots) {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                return 0;
+            }
+            Record& record = slots_[head % kSlots];
+            record.time_us = time_us;
+            record.level   = level;
+            record.text.swap(text);
+            head_.store(head + 1, std::memory_order_release);
+            return queued + 1;
+        }
+
+        // Moves every published record into out. Only the writer calls this.
+        void drain(std::vector<std::pair<int, Record>>& out) {
+            size_t tail = tail_.load(std::memory_order_relaxed);
+            size_t head = head_.load(std::memory_order_acquire);
+            for (; tail != head; tail++) {
+                out.emplace_back(id_, Record());
+                Record& record = slots_[tail % kSlots];
+                out.back().second.time_us = record.time_us;
+                out.back().second.level   = record.level;
+                out.back().second.text.swap(record.text);
+            }
+            tail_.store(head, std::memory_order_release);
+        }
+
+        uint64_t takeDropped() { return dropped_.exchange(0, std::memory_order_relaxed); }
+
+        std::atomic<bool> orphaned{false}; // Owning thread has exited
+
+    private:
+        int id_;
+        Record slots_[kSlots];
+        std::atomic<size_t> head_{0}; // Next slot the owner writes
+        std::atomic<size_t> tail_{0}; // Next slot the writer reads
+        std::atomic<uint64_t> dropped_{0};
+};
+
+class Logger {
+    public:
+        // Never destroyed, so the writer thread can outlive static destructors
+        static Logger& instance() {
+            static Logger* logger = new Logger();
+            return *logger;
+        }
+
+        bool enabled(int level) const { return level >= level_.load(std::memory_order_relaxed); }
+        void setLevel(int level) { level_.store(level, std::memory_order_relaxed); }
+        bool payloadEnabled() const { return payload_.load(std::memory_order_relaxed); }
+        void setPayload(bool enabled) { payload_.store(enabled, std::memory_order_relaxed); }
+
+        void write(int level, std::string text) {
+            Ring* ring = localRing();
+            int64_t now_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+            size_t queued = ring->push(level, now_us, text);
+            if (!writer_running_.load(std::memory_order_acquire)) {
+                startWriter();
+            }
+            if (level >= kWarn || queued == Ring::kSlots / 2) {
+                wake_.notify_one(); // Errors go out promptly, and a filling ring is drained early
+            }
+        }
+
+        // Writes out everything queued so far from the calling thread
+        void flush() {
+            std::lock_guard<std::mutex> lock(drain_mutex_);
+            drainLocked();
+        }
+
+    private:
+        std::atomic<int> level_{kInfo};
+        std::atomic<bool> payload_{false};
+        std::atomic<bool> writer_running_{false};
+        std::mutex registry_mutex_; // Guards rings_ and next_id_
+        std::vector<std::shared_ptr<Ring>> rings_;
+        int next_id_ = 1;
+        std::mutex drain_mutex_; // One drainer at a time
+        std::mutex wake_mutex_;
+        std::condition_variable wake_;
+
+        // Keeps the ring alive for the writer after its thread exits
+        struct LocalRing {
+            std::shared_ptr<Ring> ring;
+            ~LocalRing() {
+                if (ring) {
+                    ring->orphaned.store(true, std::memory_order_release);
+                }
+            }
+        };
+
+        static LocalRing& local() {
+            static thread_local LocalRing local;
+            return local;
+        }
+
+        Logger() {
+            if (const char* env = std::getenv("NFS_LOG_LEVEL")) {
+                int level;
+                if (parseLevel(env, level)) {
+                    level_.store(level);
+                }
+            }
+            pthread_atfork(&Logger::beforeFork, &Logger::afterForkParent, &Logger::afterForkChild);
+            std::atexit([] { Logger::instance().flush(); });
+        }
+
+    public:
+        static bool parseLevel(const std::string& name, int& level) {
+            static const char* const kNames[] = {"trace", "debug", "info", "warn", "error", "off"};
+            for (int i = kTrace; i <= kOff; i++) {
+                if (name == kNames[i]) {
+                    level = i;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+    private:
+        Ring* localRing() {
+            LocalRing& slot = local();
+            if (!slot.ring) {
+                std::lock_guard<std::mutex> lock(registry_mutex_);
+                slot.ring = std::make_shared<Ring>(next_id_++);
+                rings_.push_back(slot.ring);
+            }
+            return slot.ring.get();
+        }
+
+        void startWriter() {
+            bool expected = false;
+            if (writer_running_.compare_exchange_strong(expected, true)) {
+                std::thread(&Logger::writerLoop, this).detach();
+            }
+        }
+
+        void writerLoop() {
+            while (writer_running_.load(std::memory_order_acquire)) {
+                {
+                    std::unique_lock<std::mutex> lock(wake_mutex_);
+                    wake_.wait_for(lock, std::chrono::milliseconds(20));
+                }
+                flush();
+            }
+        }
+
+        void drainLocked() {
+            std::vector<std::shared_ptr<Ring>> rings;
+            {
+                std::lock_guard<std::mutex> lock(registry_mutex_);
+                rings = rings_;
+            }
+
+            std::vector<std::pair<int, Ring::Record>> records;
+            std::string out;
+            for (const auto& ring : rings) {
+                bool orphaned = ring->orphaned.load(std::memory_order_acquire);
+                ring->drain(records);
+                uint64_t dropped = ring->takeDropped();
+                if (dropped > 0) {
+                    out += "[log] thread " + std::to_string(ring->id()) + " dropped " + std::to_string(dropped) + " message(s)\n";
+                }
+                if (orphaned) {
+                    std::lock_guard<std::mutex> lock(registry_mutex_);
+                    rings_.erase(std::find(rings_.begin(), rings_.end(), ring));
+                }
+            }
+            if (records.empty() && out.empty()) {
+                return;
+            }
+
+            std::stable_sort(records.begin(), records.end(), [](const std::pair<int, Ring::Record>& a, const std::pair<int, Ring::Record>& b) {
+                return a.second.time_us < b.second.time_us;
+            });
+            for (const auto& entry : records) {
+                format(entry.first, entry.second, out);
+            }
+
+            const char* data = out.data();
+            size_t left = out.size();
+            while (left > 0) {
+                ssize_t n = ::write(STDERR_FILENO, data, left);
+                if (n <= 0) {
+                    break; // Nowhere to report it
+                }
+                data += n;
+                left -= n;
+            }
+        }
+
+        static void format(int thread_id, const Ring::Record& record, std::string& out) {
+            static const char kLetters[] = "TDIWE";
+            time_t seconds = record.time_us / 1000000;
+            struct tm local_time;
+            localtime_r(&seconds, &local_time);
+            char prefix[48];
+            snprintf(prefix, sizeof(prefix), "%02d:%02d:%02d.%06lld %c %3d ",
+                     local_time.tm_hour, local_time.tm_min, local_time.tm_sec,
+                     (long long)(record.time_us % 1000000), kLetters[record.level], thread_id);
+            out += prefix;
+            out += record.text;
+            out += '\n';
+        }
+
+        // FUSE daemonizes with fork(): hold the locks across it so the child
+        // gets them unlocked, then let the child start its own writer
+        static void beforeFork() {
+            Logger& logger = instance();
+            logger.drain_mutex_.lock();
+            logger.drainLocked(); // Otherwise parent and child would both print what is queued
+            logger.registry_mutex_.lock();
+        }
+
+        static void afterForkParent() {
+            Logger& logger = instance();
+            logger.registry_mutex_.unlock();
+            logger.drain_mutex_.unlock();
+        }
+
+        static void afterForkChild() {
+            Logger& logger = instance();
+            // Other threads' rings were copied mid-use; their messages belong to the parent
+            std::shared_ptr<Ring> mine = local().ring;
+            logger.rings_.clear();
+            if (mine) {
+                logger.rings_.push_back(mine);
+            }
+            logger.writer_running_.store(false);
+            logger.registry_mutex_.unlock();
+            logger.drain_mutex_.unlock();
+        }
+};
+
+inline bool enabled(int level) { return Logger::instance().enabled(level); }
+inline bool payloadEnabled() { return Logger::instance().payloadEnabled(); }
+
+} // namespace nfslog
+
+#define NFS_LOG(level, message)                                                 \
+    do {                                                                        \
+        if ((level) >= NFS_LOG_COMPILE_LEVEL && nfslog::enabled(level)) {       \
+            std::ostringstream nfs_log_stream_;                                 \
+            nfs_log_stream_ << message;                                         \
+            nfslog::Logger::instance().write((level), nfs_log_stream_.str());   \
+        }                                                                       \
+    } while (0)
+
+#define LOG_TRACE(message) NFS_LOG(nfslog::kTrace, message)
+#define LOG_DEBUG(message) NFS_LOG(nfslog::kDebug, message)
+#define LOG_INFO(message)  NFS_LOG(nfslog::kInfo, message)
+#define LOG_WARN(message)  NFS_LOG(nfslog::kWarn, message)
+#define LOG_ERROR(message) NFS_LOG(nfslog::kError, message)
+
+// File contents and other bulk data, at trace level and only when enabled
+#define LOG_PAYLOAD(message)                                                    \
+    do {                                                                        \
+        if (nfslog::kTrace >= NFS_LOG_COMPILE_LEVEL && nfslog::payloadEnabled()) { \
+            LOG_TRACE(message);                                                 \
+        }                                                                       \
+    } while (0)
+
+#endif // NFS_LOGGING_H
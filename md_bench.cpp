@@ -0,0 +1,487 @@
+// mdtest-style metadata benchmark for a mounted file system. N threads work
+// through the phases of a metadata storm in lockstep: build a directory tree,
+// create M files each, stat them, list the directories, unlink the files and
+// remove the tree. Trees are either shared by all threads, so they contend
+// on the same directories, or private to each thread. Every phase reports
+// ops/sec over its wall time and the latency distribution of its calls.
+//
+// On a mount served by grpc_client, each phase also shows how many RPCs of
+// each type it cost per operation, from the user.nfs.rpc_stats attribute of
+// the mount root.
+//
+//   md_bench [options] <mount_path>
+//
+//   md_bench --threads=16 --files=10000 --depth=2 --branch=8 --tree=both /mnt/nfs
+//
+// Stats hit the attributes the create phase cached unless --stat_delay_ms
+// waits out the mount's attribute TTL (grpc_client --attr_ttl_ms) first.
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+#include "bench_util.h"
+
+using namespace std;
+
+struct MdOptions {
+    string mount;
+    int threads       = 4;
+    int files         = 1000; // Per thread
+    int depth         = 1;    // Levels of directories below each tree's root
+    int branch        = 4;    // Subdirectories per directory
+    int stat_delay_ms = 0;    // Wait before the stat phase, to outlast the mount's attribute TTL
+    bool shared       = true;
+    bool private_tree = true;
+    string format     = "text";
+    string output;
+    string label;
+};
+
+// Releases its waiters once all parties have arrived, and can be reused
+class Barrier {
+    private:
+        mutex mutex_;
+        condition_variable released_;
+        int parties_;
+        int waiting_ = 0;
+        uint64_t generation_ = 0;
+
+    public:
+        explicit Barrier(int parties) : parties_(parties) {}
+
+        void wait() {
+            unique_lock<mutex> lock(mutex_);
+            uint64_t generation = generation_;
+            if (++waiting_ == parties_) {
+                waiting_ = 0;
+                generation_++;
+                released_.notify_all();
+                return;
+            }
+            released_.wait(lock, [&] { return generation_ != generation; });
+        }
+};
+
+// One phase of one tree mode, summed over all threads
+struct PhaseResult {
+    string tree;  // "shared" or "private"
+    string phase;
+    uint64_t ops = 0;
+    uint64_t errors = 0;
+    double seconds = 0;
+    bench::Samples latency;
+    map<string, double> rpcs_per_op; // RPC type to calls per op, if the mount reports them
+};
+
+// Directories of a tree of the given depth and branching below root,
+// parents before children. Leaves are the last branch^depth entries.
+static vector<string> treeDirs(const string& root, int depth, int branch) {
+    vector<string> dirs = {root};
+    size_t level_start = 0;
+    for (int level = 0; level < depth; level++) {
+        size_t level_end = dirs.size();
+        for (size_t i = level_start; i < level_end; i++) {
+            for (int b = 0; b < branch; b++) {
+                dirs.push_back(dirs[i] + "/d" + to_string(b));
+            }
+        }
+        level_start = level_end;
+    }
+    return dirs;
+}
+
+// Attempts per RPC type so far, parsed from grpc_client's statistics
+// attribute. Empty if the mount does not have it.
+static map<string, uint64_t> rpcAttempts(const string& mount) {
+    map<string, uint64_t> attempts;
+    vector<char> buffer(64 * 1024);
+    ssize_t size = getxattr(mount.c_str(), "user.nfs.rpc_stats", buffer.data(), buffer.size());
+    if (size <= 0) {
+        return attempts;
+    }
+    istringstream lines(string(buffer.data(), size));
+    for (string line; getline(lines, line);) {
+        size_t colon = line.find(':');
+        size_t of = line.find(" ok of ");
+        if (colon != string::npos && of != string::npos) {
+            attempts[line.substr(0, colon)] = strtoull(line.c_str() + of + 7, nullptr, 10);
+        }
+    }
+    return attempts;
+}
+
+class MdBench {
+    private:
+        const MdOptions& options_;
+        Barrier barrier_;
+        vector<bench::Samples> latency_; // Per thread, for the phase in progress
+        vector<uint64_t> errors_;
+
+        // Times one call and returns whether it succeeded
+        bool timed(int thread, const function<int()>& call) {
+            bench::Timer timer;
+            timer.start();
+            int result = call();
+            timer.stop();
+            if (result < 0) {
+                errors_[thread]++;
+                return false;
+            }
+            latency_[thread].add(timer.elapsedUs());
+            return true;
+        }
+
+        // Runs body on every thread at once and sums up what they timed
+        PhaseResult phase(const string& tree, const string& name, const function<void(int)>& body) {
+            for (int i = 0; i < options_.threads; i++) {
+                latency_[i] = bench::Samples();
+                errors_[i]  = 0;
+            }
+            map<string, uint64_t> rpcs_before = rpcAttempts(options_.mount);
+
+            chrono::steady_clock::time_point start;
+            vector<thread> workers;
+            for (int i = 0; i < options_.threads; i++) {
+                workers.emplace_back([&, i] {
+                    barrier_.wait();
+                    if (i == 0) {
+                        start = chrono::steady_clock::now();
+                    }
+                    barrier_.wait(); // Nobody starts before the clock does
+                    body(i);
+                });
+            }
+            for (thread& worker : workers) {
+                worker.join();
+            }
+
+            PhaseResult result;
+            result.tree    = tree;
+            result.phase   = name;
+            result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            for (int i = 0; i < options_.threads; i++) {
+                result.latency.merge(latency_[i]);
+                result.errors += errors_[i];
+            }
+            result.latency.sort();
+            result.ops = result.latency.count();
+
+            map<string, uint64_t> rpcs_after = rpcAttempts(options_.mount);
+            for (const auto& entry : rpcs_after) {
+                uint64_t calls = entry.second - rpcs_before[entry.first];
+                if (calls > 0 && result.ops > 0) {
+                    result.rpcs_per_op[entry.first] = (double)calls / result.ops;
+                }
+            }
+            if (result.errors > 0) {
+                cerr << tree << " " << name << ": " << result.errors << " call(s) failed" << endl;
+            }
+            return result;
+        }
+
+    public:
+        explicit MdBench(const MdOptions& options)
+            : options_(options), barrier_(options.threads), latency_(options.threads), errors_(options.threads) {}
+
+        // All phases over one kind of tree
+        void run(bool shared, vector<PhaseResult>* results) {
+            string tree = shared ? "shared" : "private";
+            string base = options_.mount + "/.md_bench/" + tree;
+            mkdir((options_.mount + "/.md_bench").c_str(), 0755);
+            mkdir(base.c_str(), 0755);
+
+            // One tree for everyone, or one per thread
+            vector<vector<string>> dirs(options_.threads);
+            for (int i = 0; i < options_.threads; i++) {
+                dirs[i] = treeDirs(shared ? base + "/tree" : base + "/t" + to_string(i), options_.depth, options_.branch);
+            }
+            size_t leaves = 1;
+            for (int level = 0; level < options_.depth; level++) {
+                leaves *= options_.branch;
+            }
+            auto leaf = [&](int thread, int file) -> const string& {
+                const vector<string>& own = dirs[thread];
+                return own[own.size() - leaves + file % leaves];
+            };
+            auto file = [&](int thread, int index) {
+                return leaf(thread, index + thread) + "/t" + to_string(thread) + ".f" + to_string(index);
+            };
+
+            // Shared trees are built level by level, the threads splitting each level
+            results->push_back(phase(tree, "mkdir", [&](int thread) {
+                const vector<string>& own = dirs[thread];
+                if (!shared) {
+                    for (const string& dir : own) {
+                        timed(thread, [&] { return mkdir(dir.c_str(), 0755); });
+                    }
+                    return;
+                }
+                size_t level_start = 0;
+                size_t level_size  = 1;
+                for (int level = 0; level <= options_.depth; level++) {
+                    for (size_t i = level_start + thread; i < level_start + level_size; i += options_.threads) {
+                        timed(thread, [&] { return mkdir(own[i].c_str(), 0755); });
+                    }
+                    barrier_.wait();
+                    level_start += level_size;
+                    level_size  *= options_.branch;
+                }
+            }));
+
+            results->push_back(phase(tree, "create", [&](int thread) {
+                for (int i = 0; i < options_.files; i++) {
+                    string path = file(thread, i);
+                    int fd = -1;
+                    if (timed(thread, [&] { return fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644); })) {
+                        close(fd);
+                    }
+                }
+            }));
+
+            // The mount's attribute cache is shared by every thread, so the
+            // attributes create left behind answer these stats until they
+            // expire: without a delay past the TTL the phase measures warm hits
+            if (options_.stat_delay_ms > 0) {
+                this_thread::sleep_for(chrono::milliseconds(options_.stat_delay_ms));
+            }
+            results->push_back(phase(tree, "stat", [&](int thread) {
+                int other = (thread + 1) % options_.threads;
+                for (int i = 0; i < options_.files; i++) {
+                    string path = file(other, i);
+                    struct stat st;
+                    timed(thread, [&] { return stat(path.c_str(), &st); });
+                }
+            }));
+
+            results->push_back(phase(tree, "readdir", [&](int thread) {
+                const vector<string>& own = dirs[thread];
+                for (size_t i = own.size() - leaves; i < own.size(); i++) {
+                    timed(thread, [&] {
+                        DIR* dir = opendir(own[i].c_str());
+                        if (!dir) {
+                            return -1;
+                        }
+                        while (readdir(dir) != nullptr) {
+                        }
+                        return closedir(dir);
+                    });
+                }
+            }));
+
+            results->push_back(phase(tree, "unlink", [&](int thread) {
+                for (int i = 0; i < options_.files; i++) {
+                    string path = file(thread, i);
+                    timed(thread, [&] { return unlink(path.c_str()); });
+                }
+            }));
+
+            // Children before parents, splitting each level of a shared tree again
+            results->push_back(phase(tree, "rmdir", [&](int thread) {
+                const vector<string>& own = dirs[thread];
+                if (!shared) {
+                    for (size_t i = own.size(); i-- > 0;) {
+                        timed(thread, [&] { return rmdir(own[i].c_str()); });
+                    }
+                    return;
+                }
+                size_t level_end  = own.size();
+                size_t level_size = leaves;
+                for (int level = options_.depth; level >= 0; level--) {
+                    size_t level_start = level_end - level_size;
+                    for (size_t i = level_start + thread; i < level_end; i += options_.threads) {
+                        timed(thread, [&] { return rmdir(own[i].c_str()); });
+                    }
+                    barrier_.wait();
+                    level_end  = level_start;
+                    level_size /= options_.branch;
+                }
+            }));
+            bench::removeTree(base);
+        }
+};
+
+static void writeResults(ostream& out, const MdOptions& options, const vector<PhaseResult>& results) {
+    if (options.format == "json") {
+        out << fixed << setprecision(3);
+        out << "{\"label\": " << bench::jsonString(options.label) << ", \"mount\": " << bench::jsonString(options.mount)
+            << ", \"threads\": " << options.threads << ", \"files\": " << options.files << ", \"depth\": " << options.depth
+            << ", \"branch\": " << options.branch << ", \"stat_delay_ms\": " << options.stat_delay_ms
+            << ", \"results\": [" << endl;
+        for (size_t i = 0; i < results.size(); i++) {
+            const PhaseResult& result = results[i];
+            out << "  {\"tree\": " << bench::jsonString(result.tree) << ", \"phase\": " << bench::jsonString(result.phase)
+                << ", \"ops\": " << result.ops << ", \"errors\": " << result.errors << ", \"seconds\": " << result.seconds
+                << ", \"ops_per_s\": " << (result.seconds > 0 ? result.ops / result.seconds : 0)
+                << ", \"mean_us\": " << result.latency.mean() << ", \"p50_us\": " << result.latency.percentile(0.5)
+                << ", \"p90_us\": " << result.latency.percentile(0.9) << ", \"p99_us\": " << result.latency.percentile(0.99)
+                << ", \"max_us\": " << result.latency.max() << ", \"rpcs_per_op\": {";
+            bool first = true;
+            for (const auto& rpc : result.rpcs_per_op) {
+                out << (first ? "" : ", ") << bench::jsonString(rpc.first) << ": " << rpc.second;
+                first = false;
+            }
+            out << "}}" << (i + 1 < results.size() ? "," : "") << endl;
+        }
+        out << "]}" << endl;
+        return;
+    }
+
+    if (options.format == "csv") {
+        out << fixed << setprecision(3);
+        out << "tree,phase,ops,errors,seconds,ops_per_s,mean_us,p50_us,p90_us,p99_us,max_us,rpcs_per_op" << endl;
+        for (const PhaseResult& result : results) {
+            out << result.tree << "," << result.phase << "," << result.ops << "," << result.errors << "," << result.seconds << ","
+                << (result.seconds > 0 ? result.ops / result.seconds : 0) << "," << result.latency.mean() << ","
+                << result.latency.percentile(0.5) << "," << result.latency.percentile(0.9) << ","
+                << result.latency.percentile(0.99) << "," << result.latency.max() << ",";
+            bool first = true;
+            for (const auto& rpc : result.rpcs_per_op) {
+                out << (first ? "" : " ") << rpc.first << "=" << rpc.second;
+                first = false;
+            }
+            out << endl;
+        }
+        return;
+    }
+
+    out << options.threads << " thread(s), " << options.files << " files each, tree depth " << options.depth
+        << " branch " << options.branch;
+    if (options.stat_delay_ms > 0) {
+        out << ", stat after " << options.stat_delay_ms << " ms";
+    } else {
+        out << ", stat warm from create";
+    }
+    if (!options.label.empty()) {
+        out << " (" << options.label << ")";
+    }
+    out << endl;
+    out << left << setw(9) << "tree" << setw(9) << "phase" << right << setw(10) << "ops" << setw(11) << "ops/s";
+    for (const char* column : {"mean", "p50", "p90", "p99", "max"}) {
+        out << setw(10) << column;
+    }
+    out << "  (latency in us)" << endl;
+    out << fixed << setprecision(1);
+    for (const PhaseResult& result : results) {
+        out << left << setw(9) << result.tree << setw(9) << result.phase << right << setw(10) << result.ops
+            << setw(11) << (result.seconds > 0 ? result.ops / result.seconds : 0)
+            << setw(10) << result.latency.mean() << setw(10) << result.latency.percentile(0.5)
+            << setw(10) << result.latency.percentile(0.9) << setw(10) << result.latency.percentile(0.99)
+            << setw(10) << result.latency.max();
+        if (result.errors > 0) {
+            out << "  " << result.errors << " failed";
+        }
+        out << endl;
+        if (!result.rpcs_per_op.empty()) {
+            out << setw(18) << "" << "RPCs per op:" << setprecision(2);
+            for (const auto& rpc : result.rpcs_per_op) {
+                out << " " << rpc.first << " " << rpc.second;
+            }
+            out << setprecision(1) << endl;
+        }
+    }
+}
+
+static void usage(const char* program) {
+    cerr << "Usage: " << program << " [--threads=N] [--files=N] [--depth=N] [--branch=N] [--tree=shared|private|both]"
+         << " [--stat_delay_ms=N] [--format=text|json|csv] [--output=FILE] [--label=TEXT] <mount_path>" << endl;
+}
+
+int main(int argc, char** argv) {
+    MdOptions options;
+    vector<string> positional;
+    try {
+        for (int i = 1; i < argc; i++) {
+            string arg = argv[i];
+            string name, value;
+            if (arg.compare(0, 2, "--") != 0) {
+                positional.push_back(arg);
+                continue;
+            }
+            if (!bench::splitOption(arg, &name, &value)) {
+                throw invalid_argument(arg);
+            }
+            if (name == "threads") {
+                options.threads = stoi(value);
+            } else if (name == "files") {
+                options.files = stoi(value);
+            } else if (name == "depth") {
+                options.depth = stoi(value);
+            } else if (name == "branch") {
+                options.branch = stoi(value);
+            } else if (name == "stat_delay_ms") {
+                options.stat_delay_ms = stoi(value);
+            } else if (name == "tree") {
+                if (value != "shared" && value != "private" && value != "both") {
+                    throw invalid_argument(value);
+                }
+                options.shared       = value != "private";
+                options.private_tree = value != "shared";
+            } else if (name == "format") {
+                if (value != "text" && value != "json" && value != "csv") {
+                    throw invalid_argument(value);
+                }
+                options.format = value;
+            } else if (name == "output") {
+                options.output = value;
+            } else if (name == "label") {
+                options.label = value;
+            } else {
+                throw invalid_argument(arg);
+            }
+        }
+    } catch (const exception& e) {
+        cerr << "Bad option: " << e.what() << endl;
+        usage(argv[0]);
+        return 2;
+    }
+    if (positional.size() != 1 || options.threads <= 0 || options.files < 0 || options.depth < 0 || options.branch <= 0 ||
+        options.stat_delay_ms < 0) {
+        usage(argv[0]);
+        return 2;
+    }
+    options.mount = positional[0];
+
+    MdBench bench(options);
+    vector<PhaseResult> results;
+    if (options.shared) {
+        bench.run(true, &results);
+    }
+    if (options.private_tree) {
+        bench.run(false, &results);
+    }
+    bench::removeTree(options.mount + "/.md_bench");
+
+    ofstream file;
+    if (!options.output.empty()) {
+        file.open(options.output);
+        if (!file) {
+            cerr << "Cannot write " << options.output << endl;
+            return 1;
+        }
+    }
+    writeResults(options.output.empty() ? cout : file, options, results);
+    for (const PhaseResult& result : results) {
+        if (result.errors > 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,746 @@
+// In-process RPC benchmark. Links the server's grpcServices handlers into this
+// process and drives each RPC through four layers, so a regression can be
+// pinned to the one that grew:
+//
+//   handler  the grpcServices method called directly
+//   serde    the same, with the request and response serialized and parsed
+//   inproc   a stub on gRPC's in-process channel to a server in this process
+//   tcp      a stub on a loopback TCP channel to the same server (opt-in)
+//
+// The differences between layers are the serialization, gRPC core and
+// network costs of a call. No FUSE, kernel or remote machine is involved.
+// With --compression, the stub layers compress reads and writes the way
+// grpc_client does; --payload=text gives them data that compresses, and the
+// CPU time per call shows what that costs both ends together.
+//
+//   rpc_bench [options] [storage_dir]
+//
+//   rpc_bench --ops=getattr,read,write --sizes=4k,1m --threads=1,8 --layers=handler,serde,inproc,tcp
+//   rpc_bench --ops=read,write --sizes=1m --layers=inproc,tcp --payload=text --compression=gzip
+
+#define GRPC_SERVER_NO_MAIN
+#include "grpc_server.cpp"
+#include "bench_util.h"
+
+#include <fstream>
+#include <iomanip>
+#include <stdlib.h>
+#include <sys/resource.h>
+
+using grpc_service::GrpcService;
+
+enum class Layer { Handler, Serde, InProcess, Tcp, Count };
+
+static const char* const kLayerNames[] = {"handler", "serde", "inproc", "tcp"};
+
+struct RpcBenchOptions {
+    string storage_dir;   // Empty for a scratch directory under /tmp
+    vector<string> ops    = {"ping", "getattr", "lookup", "readdir", "readdirplus", "open", "read", "write",
+                             "create", "unlink", "mkdir", "rmdir"};
+    vector<uint64_t> sizes = {4096, 64 * 1024, 1024 * 1024}; // Payloads of read and write
+    vector<int> threads   = {1, 4};
+    vector<Layer> layers  = {Layer::Handler, Layer::Serde, Layer::InProcess};
+    int iterations        = 2000; // Calls per thread
+    int entries           = 100;  // Files in each thread's directory, what readdir lists
+    bool text_payload     = false; // Log-like lines instead of random bytes
+    nfscompress::Policy compression;
+    string format         = "text";
+    string output;
+    string label;
+};
+
+// One op at one payload size, concurrency and layer
+struct RpcResult {
+    string op;
+    uint64_t size = 0;
+    int threads = 0;
+    Layer layer = Layer::Handler;
+    uint64_t errors = 0;
+    double seconds = 0;
+    double cpu_seconds = 0; // User and system time of the whole process, both ends of the call
+    bench::Samples latency;
+};
+
+// Makes one timed call through the layer under test. Ops build their requests
+// outside of it, so only the call itself is measured.
+class Caller {
+    private:
+        Layer layer_;
+        grpcServices* service_;
+        GrpcService::Stub* stub_;
+        const nfscompress::Policy& compression_;
+        // For the handler layers. NfsRead looks in it for the compression the
+        // client asked for, and finds none, so those layers never compress a
+        // reply; nothing a call leaves in it changes the next, so one per
+        // thread is enough.
+        ServerContext server_context_;
+        bench::Samples* latency_;
+        uint64_t* errors_;
+
+        // Compression for a stub call, as grpc_client asks for it
+        template <class Request>
+        void compress(grpc::ClientContext*, const Request&) {}
+
+        void compress(grpc::ClientContext* context, const grpc_service::NfsWriteRequest& request) {
+            if (compression_.worthIt(request.content().data(), request.content().size())) {
+                context->set_compression_algorithm(compression_.algorithm);
+            }
+        }
+
+        void compress(grpc::ClientContext* context, const grpc_service::NfsReadRequest& request) {
+            if (compression_.sizeQualifies(request.size())) {
+                context->AddMetadata(nfscompress::kMetadataKey, nfscompress::algorithmName(compression_.algorithm));
+            }
+        }
+
+    public:
+        Caller(Layer layer, grpcServices* service, GrpcService::Stub* stub, const nfscompress::Policy& compression,
+               bench::Samples* latency, uint64_t* errors)
+            : layer_(layer), service_(service), stub_(stub), compression_(compression), latency_(latency), errors_(errors) {}
+
+        template <class Request, class Response>
+        bool call(Status (grpcServices::*handler)(ServerContext*, const Request*, Response*),
+                  Status (GrpcService::Stub::*method)(grpc::ClientContext*, const Request&, Response*),
+                  const Request& request, Response* response) {
+            bench::Timer timer;
+            timer.start();
+            Status status;
+            switch (layer_) {
+                case Layer::Handler:
+                    status = (service_->*handler)(&server_context_, &request, response);
+                    break;
+                case Layer::Serde: {
+                    // The copies gRPC makes on each side of the wire, minus the wire
+                    string wire;
+                    request.SerializeToString(&wire);
+                    Request received;
+                    received.ParseFromString(wire);
+                    Response sent;
+                    status = (service_->*handler)(&server_context_, &received, &sent);
+                    sent.SerializeToString(&wire);
+                    response->ParseFromString(wire);
+                    break;
+                }
+                default: {
+                    grpc::ClientContext context;
+                    compress(&context, request);
+                    status = (stub_->*method)(&context, request, response);
+                    break;
+                }
+            }
+            timer.stop();
+            latency_->add(timer.elapsedUs());
+            if (!status.ok()) {
+                (*errors_)++;
+            }
+            return status.ok();
+        }
+
+        // Counts a call that went through but whose response reports a failure
+        void fail() { (*errors_)++; }
+
+        // For an op's untimed setup calls, which go to the handlers directly
+        ServerContext* context() { return &server_context_; }
+};
+
+// Per-thread state the ops share: the thread's directory, a file of
+// kSlots payloads in it, and a handle open on that file
+struct ThreadState {
+    string dir;      // Relative to the storage directory, with a leading '/'
+    string file;
+    uint64_t fh = 0;
+    string payload;  // Written by the write op
+};
+
+static const int kSlots = 4; // Offsets read and write cycle through
+
+// Runs iteration i of an op on one thread; untimed setup talks to the
+// handlers directly. Returns false if the op failed.
+using OpFunction = function<bool(Caller&, grpcServices&, ThreadState&, int i, uint64_t size)>;
+
+template <class Response>
+static bool succeeded(Caller& caller, bool called, const Response& response) {
+    if (called && !response.success()) {
+        caller.fail();
+    }
+    return called && response.success();
+}
+
+static map<string, OpFunction> makeOps() {
+    using namespace grpc_service;
+    map<string, OpFunction> ops;
+
+    ops["ping"] = [](Caller& caller, grpcServices&, ThreadState&, int, uint64_t) {
+        PingRequest request;
+        PingResponse response;
+        request.set_message("ping");
+        return caller.call(&grpcServices::Ping, &GrpcService::Stub::Ping, request, &response);
+    };
+    ops["getattr"] = [](Caller& caller, grpcServices&, ThreadState& state, int, uint64_t) {
+        NfsGetAttrRequest request;
+        NfsGetAttrResponse response;
+        request.set_path(state.file);
+        return succeeded(caller, caller.call(&grpcServices::NfsGetAttr, &GrpcService::Stub::NfsGetAttr, request, &response), response);
+    };
+    ops["lookup"] = [](Caller& caller, grpcServices&, ThreadState& state, int, uint64_t) {
+        NfsLookupRequest request;
+        NfsLookupResponse response;
+        request.set_path(state.dir.substr(1));
+        return succeeded(caller, caller.call(&grpcServices::NfsLookup, &GrpcService::Stub::NfsLookup, request, &response), response);
+    };
+    ops["readdir"] = [](Caller& caller, grpcServices&, ThreadState& state, int, uint64_t) {
+        NfsReadDirRequest request;
+        NfsReadDirResponse response;
+        request.set_path(state.dir);
+        return succeeded(caller, caller.call(&grpcServices::NfsReadDir, &GrpcService::Stub::NfsReadDir, request, &response), response);
+    };
+    ops["readdirplus"] = [](Caller& caller, grpcServices&, ThreadState& state, int, uint64_t) {
+        NfsReadDirRequest request;
+        NfsReadDirPlusResponse response;
+        request.set_path(state.dir);
+        return succeeded(caller, caller.call(&grpcServices::NfsReadDirPlus, &GrpcService::Stub::NfsReadDirPlus, request, &response), response);
+    };
+    ops["open"] = [](Caller& caller, grpcServices& service, ThreadState& state, int, uint64_t) {
+        NfsOpenRequest request;
+        NfsOpenResponse response;
+        request.set_path(state.file);
+        request.set_flags(O_RDONLY);
+        bool ok = succeeded(caller, caller.call(&grpcServices::NfsOpen, &GrpcService::Stub::NfsOpen, request, &response), response);
+        NfsReleaseRequest release;
+        NfsReleaseResponse released;
+        release.set_path(state.file);
+        release.set_fh(response.fh());
+        service.NfsRelease(caller.context(), &release, &released);
+        return ok;
+    };
+    ops["read"] = [](Caller& caller, grpcServices&, ThreadState& state, int i, uint64_t size) {
+        NfsReadRequest request;
+        NfsReadResponse response;
+        request.set_path(state.file);
+        request.set_fh(state.fh);
+        request.set_flags(O_RDWR);
+        request.set_offset((i % kSlots) * size);
+        request.set_size(size);
+        return succeeded(caller, caller.call(&grpcServices::NfsRead, &GrpcService::Stub::NfsRead, request, &response), response);
+    };
+    ops["write"] = [](Caller& caller, grpcServices&, ThreadState& state, int i, uint64_t size) {
+        NfsWriteRequest request;
+        NfsWriteResponse response;
+        request.set_path(state.file);
+        request.set_fh(state.fh);
+        request.set_flags(O_RDWR);
+        request.set_offset((i % kSlots) * size);
+        request.set_content(state.payload.data(), size);
+        request.set_size(size);
+        return succeeded(caller, caller.call(&grpcServices::NfsWrite, &GrpcService::Stub::NfsWrite, request, &response), response);
+    };
+    ops["create"] = [](Caller& caller, grpcServices& service, ThreadState& state, int i, uint64_t) {
+        string path = state.dir + "/create." + to_string(i);
+        NfsCreateRequest request;
+        NfsCreateResponse response;
+        request.set_path(path);
+        request.set_mode(0644);
+        request.set_flags(O_WRONLY | O_CREAT | O_EXCL);
+        bool ok = succeeded(caller, caller.call(&grpcServices::NfsCreate, &GrpcService::Stub::NfsCreate, request, &response), response);
+        NfsReleaseRequest release;
+        NfsReleaseResponse released;
+        release.set_path(path);
+        release.set_fh(response.fh());
+        service.NfsRelease(caller.context(), &release, &released);
+        NfsUnlinkRequest unlink;
+        NfsUnlinkResponse unlinked;
+        unlink.set_path(path);
+        service.NfsUnlink(caller.context(), &unlink, &unlinked);
+        return ok;
+    };
+    ops["unlink"] = [](Caller& caller, grpcServices& service, ThreadState& state, int i, uint64_t) {
+        string path = state.dir + "/unlink." + to_string(i);
+        NfsCreateRequest create;
+        NfsCreateResponse created;
+        create.set_path(path);
+        create.set_mode(0644);
+        create.set_flags(O_WRONLY | O_CREAT);
+        service.NfsCreate(caller.context(), &create, &created);
+        NfsReleaseRequest release;
+        NfsReleaseResponse released;
+        release.set_path(path);
+        release.set_fh(created.fh());
+        service.NfsRelease(caller.context(), &release, &released);
+        NfsUnlinkRequest request;
+        NfsUnlinkResponse response;
+        request.set_path(path);
+        return succeeded(caller, caller.call(&grpcServices::NfsUnlink, &GrpcService::Stub::NfsUnlink, request, &response), response);
+    };
+    ops["mkdir"] = [](Caller& caller, grpcServices& service, ThreadState& state, int i, uint64_t) {
+        string path = state.dir + "/mkdir." + to_string(i);
+        NfsMkdirRequest request;
+        NfsMkdirResponse response;
+        request.set_path(path);
+        request.set_mode(0755);
+        bool ok = succeeded(caller, caller.call(&grpcServices::NfsMkdir, &GrpcService::Stub::NfsMkdir, request, &response), response);
+        NfsRmdirRequest rmdir;
+        NfsRmdirResponse removed;
+        rmdir.set_path(path);
+        service.NfsRmdir(caller.context(), &rmdir, &removed);
+        return ok;
+    };
+    ops["rmdir"] = [](Caller& caller, grpcServices& service, ThreadState& state, int i, uint64_t) {
+        string path = state.dir + "/rmdir." + to_string(i);
+        NfsMkdirRequest mkdir;
+        NfsMkdirResponse made;
+        mkdir.set_path(path);
+        mkdir.set_mode(0755);
+        service.NfsMkdir(caller.context(), &mkdir, &made);
+        NfsRmdirRequest request;
+        NfsRmdirResponse response;
+        request.set_path(path);
+        return succeeded(caller, caller.call(&grpcServices::NfsRmdir, &GrpcService::Stub::NfsRmdir, request, &response), response);
+    };
+    return ops;
+}
+
+// Whether an op's cost depends on the payload size
+static bool sized(const string& op) {
+    return op == "read" || op == "write";
+}
+
+// User plus system time of the process so far
+static double cpuSeconds() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static double callsPerSecond(const RpcResult& result) {
+    return result.seconds > 0 ? result.latency.count() / result.seconds : 0;
+}
+
+// Payload throughput of read and write, 0 for the other ops
+static double megabytesPerSecond(const RpcResult& result) {
+    return callsPerSecond(result) * result.size / 1e6;
+}
+
+static double cpuUsPerCall(const RpcResult& result) {
+    return result.latency.count() > 0 ? result.cpu_seconds * 1e6 / result.latency.count() : 0;
+}
+
+class RpcBench {
+    private:
+        const RpcBenchOptions& options_;
+        grpcServices service_;
+        ServerContext setup_context_; // For the bench's own calls, on the main thread
+        unique_ptr<Server> server_;
+        shared_ptr<grpc::Channel> channels_[(int)Layer::Count];
+        vector<ThreadState> states_;
+        map<string, OpFunction> ops_;
+
+        // Thread directories, each with its data file and entries to list
+        void prepareStorage(int threads) {
+            uint64_t max_size = *max_element(options_.sizes.begin(), options_.sizes.end());
+            mt19937_64 random(42);
+            for (int i = (int)states_.size(); i < threads; i++) {
+                ThreadState state;
+                state.dir   = "/rpc_bench.t" + to_string(i);
+                state.file  = state.dir + "/data";
+                string dir  = options_.storage_dir + state.dir;
+                mkdir(dir.c_str(), 0755);
+                for (int entry = 0; entry < options_.entries; entry++) {
+                    close(open((dir + "/entry." + to_string(entry)).c_str(), O_WRONLY | O_CREAT, 0644));
+                }
+
+                // Random bytes, so nothing along the way can shortcut zeros, or
+                // lines like a service log, which compress about as well as ours
+                state.payload.clear();
+                while (options_.text_payload && state.payload.size() < max_size) {
+                    state.payload += "2026-10-16T12:" + to_string(random() % 60) + ":" + to_string(random() % 60)
+                                   + " host-" + to_string(random() % 32) + " GET /api/v1/items/" + to_string(random() % 100000)
+                                   + " status=200 bytes=" + to_string(random() % 65536) + "\n";
+                }
+                state.payload.resize(max_size);
+                for (size_t offset = 0; !options_.text_payload && offset + 8 <= max_size; offset += 8) {
+                    uint64_t word = random();
+                    memcpy(&state.payload[offset], &word, 8);
+                }
+                int fd = open((options_.storage_dir + state.file).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                for (int slot = 0; slot < kSlots && fd >= 0; slot++) {
+                    if (pwrite(fd, state.payload.data(), max_size, slot * max_size) != (ssize_t)max_size) {
+                        LOG_ERROR("Cannot fill " << options_.storage_dir << state.file << ": " << strerror(errno));
+                    }
+                }
+                if (fd >= 0) {
+                    close(fd);
+                }
+
+                grpc_service::NfsOpenRequest request;
+                grpc_service::NfsOpenResponse response;
+                request.set_path(state.file);
+                request.set_flags(O_RDWR);
+                service_.NfsOpen(&setup_context_, &request, &response);
+                state.fh = response.fh();
+                states_.push_back(move(state));
+            }
+        }
+
+        // The server compresses replies under the same limits the bench's client uses
+        static ServerOptions serverOptions(const RpcBenchOptions& options) {
+            ServerOptions server;
+            server.compress_min_bytes   = options.compression.min_bytes;
+            server.compress_max_entropy = options.compression.max_entropy;
+            return server;
+        }
+
+    public:
+        explicit RpcBench(const RpcBenchOptions& options)
+            : options_(options), service_(options.storage_dir, serverOptions(options)), ops_(makeOps()) {
+            bool inproc = find(options.layers.begin(), options.layers.end(), Layer::InProcess) != options.layers.end();
+            bool tcp    = find(options.layers.begin(), options.layers.end(), Layer::Tcp) != options.layers.end();
+            if (!inproc && !tcp) {
+                return;
+            }
+
+            ServerBuilder builder;
+            int port = 0;
+            if (tcp) {
+                builder.AddListeningPort("127.0.0.1:0", InsecureServerCredentials(), &port);
+            }
+            builder.SetMaxReceiveMessageSize(-1); // Payloads larger than gRPC's 4 MiB default
+            builder.RegisterService(&service_);
+            server_ = builder.BuildAndStart();
+            if (!server_) {
+                throw runtime_error("cannot start the server");
+            }
+
+            grpc::ChannelArguments args;
+            args.SetMaxReceiveMessageSize(-1);
+            if (inproc) {
+                channels_[(int)Layer::InProcess] = server_->InProcessChannel(args);
+            }
+            if (tcp) {
+                channels_[(int)Layer::Tcp] = grpc::CreateCustomChannel("127.0.0.1:" + to_string(port),
+                                                                       grpc::InsecureChannelCredentials(), args);
+            }
+        }
+
+        ~RpcBench() {
+            for (ThreadState& state : states_) {
+                grpc_service::NfsReleaseRequest request;
+                grpc_service::NfsReleaseResponse response;
+                request.set_path(state.file);
+                request.set_fh(state.fh);
+                service_.NfsRelease(&setup_context_, &request, &response);
+            }
+            if (server_) {
+                server_->Shutdown();
+            }
+        }
+
+        RpcResult run(const string& op_name, uint64_t size, int threads, Layer layer) {
+            prepareStorage(threads);
+            const OpFunction& op = ops_.at(op_name);
+
+            RpcResult result;
+            result.op      = op_name;
+            result.size    = sized(op_name) ? size : 0;
+            result.threads = threads;
+            result.layer   = layer;
+
+            vector<bench::Samples> latency(threads);
+            vector<uint64_t> errors(threads, 0);
+            vector<unique_ptr<GrpcService::Stub>> stubs(threads);
+            for (int i = 0; i < threads; i++) {
+                latency[i].reserve(options_.iterations);
+                if (channels_[(int)layer]) {
+                    stubs[i] = GrpcService::NewStub(channels_[(int)layer]);
+                }
+            }
+
+            // A few untimed calls first, to connect and warm the caches
+            for (int i = 0; i < threads; i++) {
+                bench::Samples ignored;
+                uint64_t ignored_errors = 0;
+                Caller caller(layer, &service_, stubs[i].get(), options_.compression, &ignored, &ignored_errors);
+                for (int warm = 0; warm < 10; warm++) {
+                    op(caller, service_, states_[i], options_.iterations + warm, size);
+                }
+            }
+
+            double cpu_start = cpuSeconds();
+            auto start = chrono::steady_clock::now();
+            vector<thread> workers;
+            for (int i = 0; i < threads; i++) {
+                workers.emplace_back([&, i] {
+                    Caller caller(layer, &service_, stubs[i].get(), options_.compression, &latency[i], &errors[i]);
+                    for (int iteration = 0; iteration < options_.iterations; iteration++) {
+                        op(caller, service_, states_[i], iteration, size);
+                    }
+                });
+            }
+            for (thread& worker : workers) {
+                worker.join();
+            }
+            result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            result.cpu_seconds = cpuSeconds() - cpu_start;
+            for (int i = 0; i < threads; i++) {
+                result.latency.merge(latency[i]);
+                result.errors += errors[i];
+            }
+            result.latency.sort();
+            return result;
+        }
+};
+
+static const RpcResult* findLayer(const vector<RpcResult>& results, size_t first, size_t end, Layer layer) {
+    for (size_t i = first; i < end; i++) {
+        if (results[i].layer == layer) {
+            return &results[i];
+        }
+    }
+    return nullptr;
+}
+
+// What each layer adds to the median call, from adjacent layers that both ran
+static void writeBreakdown(ostream& out, const vector<RpcResult>& results, size_t first, size_t end) {
+    static const char* const kCosts[] = {"handler", "serialization", "grpc", "network"};
+    out << setw(25) << "" << "p50 cost:";
+    double below = 0;
+    bool have_below = true;
+    for (int layer = 0; layer < (int)Layer::Count; layer++) {
+        const RpcResult* result = findLayer(results, first, end, (Layer)layer);
+        if (result == nullptr) {
+            have_below = false;
+            continue;
+        }
+        double p50 = result->latency.percentile(0.5);
+        if (have_below) {
+            out << " " << kCosts[layer] << " " << p50 - below;
+        }
+        below = p50;
+        have_below = true;
+    }
+    out << endl;
+}
+
+static void writeResults(ostream& out, const RpcBenchOptions& options, const vector<RpcResult>& results) {
+    if (options.format == "json") {
+        out << fixed << setprecision(3);
+        out << "{\"label\": " << bench::jsonString(options.label) << ", \"iterations\": " << options.iterations
+            << ", \"entries\": " << options.entries << ", \"payload\": \"" << (options.text_payload ? "text" : "random")
+            << "\", \"compression\": \"" << nfscompress::algorithmName(options.compression.algorithm)
+            << "\", \"results\": [" << endl;
+        for (size_t i = 0; i < results.size(); i++) {
+            const RpcResult& result = results[i];
+            out << "  {\"op\": " << bench::jsonString(result.op) << ", \"size\": " << result.size
+                << ", \"threads\": " << result.threads << ", \"layer\": \"" << kLayerNames[(int)result.layer]
+                << "\", \"calls\": " << result.latency.count() << ", \"errors\": " << result.errors
+                << ", \"seconds\": " << result.seconds
+                << ", \"calls_per_s\": " << callsPerSecond(result) << ", \"mb_per_s\": " << megabytesPerSecond(result)
+                << ", \"cpu_us_per_call\": " << cpuUsPerCall(result) << ", \"mean_us\": " << result.latency.mean() << ", \"p50_us\": " << result.latency.percentile(0.5)
+                << ", \"p90_us\": " << result.latency.percentile(0.9) << ", \"p99_us\": " << result.latency.percentile(0.99)
+                << ", \"max_us\": " << result.latency.max() << "}" << (i + 1 < results.size() ? "," : "") << endl;
+        }
+        out << "]}" << endl;
+        return;
+    }
+
+    if (options.format == "csv") {
+        out << fixed << setprecision(3);
+        out << "op,size,threads,layer,calls,errors,seconds,calls_per_s,mb_per_s,cpu_us_per_call,mean_us,p50_us,p90_us,p99_us,max_us" << endl;
+        for (const RpcResult& result : results) {
+            out << result.op << "," << result.size << "," << result.threads << "," << kLayerNames[(int)result.layer] << ","
+                << result.latency.count() << "," << result.errors << "," << result.seconds << ","
+                << callsPerSecond(result) << "," << megabytesPerSecond(result) << "," << cpuUsPerCall(result) << ","
+                << result.latency.mean() << ","
+                << result.latency.percentile(0.5) << "," << result.latency.percentile(0.9) << ","
+                << result.latency.percentile(0.99) << "," << result.latency.max() << endl;
+        }
+        return;
+    }
+
+    out << options.iterations << " calls per thread, " << (options.text_payload ? "text" : "random") << " payload, compression "
+        << nfscompress::algorithmName(options.compression.algorithm);
+    if (!options.label.empty()) {
+        out << " (" << options.label << ")";
+    }
+    out << endl;
+    out << left << setw(12) << "op" << right << setw(8) << "size" << setw(8) << "threads" << "  " << left << setw(8)
+        << "layer" << right << setw(11) << "calls/s" << setw(9) << "MB/s" << setw(10) << "cpu/call";
+    for (const char* column : {"mean", "p50", "p90", "p99", "max"}) {
+        out << setw(10) << column;
+    }
+    out << "  (latency in us)" << endl;
+    out << fixed << setprecision(1);
+
+    // Rows of the same op, size and concurrency are adjacent, one per layer
+    for (size_t first = 0; first < results.size();) {
+        size_t end = first;
+        while (end < results.size() && results[end].op == results[first].op && results[end].size == results[first].size &&
+               results[end].threads == results[first].threads) {
+            const RpcResult& result = results[end];
+            out << left << setw(12) << result.op << right << setw(8) << (result.size ? to_string(result.size) : "-")
+                << setw(8) << result.threads << "  " << left << setw(8) << kLayerNames[(int)result.layer] << right
+                << setw(11) << callsPerSecond(result) << setw(9) << megabytesPerSecond(result) << setw(10) << cpuUsPerCall(result)
+                << setw(10) << result.latency.mean() << setw(10) << result.latency.percentile(0.5)
+                << setw(10) << result.latency.percentile(0.9) << setw(10) << result.latency.percentile(0.99)
+                << setw(10) << result.latency.max();
+            if (result.errors > 0) {
+                out << "  " << result.errors << " failed";
+            }
+            out << endl;
+            end++;
+        }
+        if (end - first > 1) {
+            writeBreakdown(out, results, first, end);
+        }
+        first = end;
+    }
+}
+
+static void usage(const char* program) {
+    cerr << "Usage: " << program << " [--ops=LIST] [--sizes=LIST] [--threads=LIST] [--layers=handler,serde,inproc,tcp]"
+         << " [--iterations=N] [--entries=N] [--payload=random|text] [--compression=none|gzip|deflate] [--compress_min_kb=N]"
+         << " [--compress_max_entropy=BITS] [--format=text|json|csv] [--output=FILE] [--label=TEXT] [storage_dir]" << endl;
+}
+
+int main(int argc, char** argv) {
+    RpcBenchOptions options;
+    try {
+        for (int i = 1; i < argc; i++) {
+            string arg = argv[i];
+            string name, value;
+            if (arg.compare(0, 2, "--") != 0) {
+                options.storage_dir = arg;
+                continue;
+            }
+            if (!bench::splitOption(arg, &name, &value)) {
+                throw invalid_argument(arg);
+            }
+            if (name == "ops") {
+                options.ops = bench::splitList(value);
+            } else if (name == "sizes") {
+                options.sizes.clear();
+                for (const string& size : bench::splitList(value)) {
+                    options.sizes.push_back(bench::parseSize(size));
+                }
+            } else if (name == "threads") {
+                options.threads.clear();
+                for (const string& threads : bench::splitList(value)) {
+                    options.threads.push_back(stoi(threads));
+                }
+            } else if (name == "layers") {
+                options.layers.clear();
+                for (const string& layer : bench::splitList(value)) {
+                    const char* const* known = find(begin(kLayerNames), end(kLayerNames), layer);
+                    if (known == end(kLayerNames)) {
+                        throw invalid_argument(layer);
+                    }
+                    options.layers.push_back((Layer)(known - begin(kLayerNames)));
+                }
+                sort(options.layers.begin(), options.layers.end());
+            } else if (name == "iterations") {
+                options.iterations = stoi(value);
+            } else if (name == "entries") {
+                options.entries = stoi(value);
+            } else if (name == "payload") {
+                if (value != "random" && value != "text") {
+                    throw invalid_argument(value);
+                }
+                options.text_payload = value == "text";
+            } else if (name == "compression") {
+                if (!nfscompress::parseAlgorithm(value, &options.compression.algorithm)) {
+                    throw invalid_argument(value);
+                }
+            } else if (name == "compress_min_kb") {
+                options.compression.min_bytes = stoull(value) * 1024;
+            } else if (name == "compress_max_entropy") {
+                options.compression.max_entropy = stod(value);
+            } else if (name == "format") {
+                if (value != "text" && value != "json" && value != "csv") {
+                    throw invalid_argument(value);
+                }
+                options.format = value;
+            } else if (name == "output") {
+                options.output = value;
+            } else if (name == "label") {
+                options.label = value;
+            } else if (name == "log_level") {
+                int level;
+                if (!nfslog::Logger::parseLevel(value, level)) {
+                    throw invalid_argument(value);
+                }
+                nfslog::Logger::instance().setLevel(level);
+            } else {
+                throw invalid_argument(arg);
+            }
+        }
+    } catch (const exception& e) {
+        cerr << "Bad option: " << e.what() << endl;
+        usage(argv[0]);
+        return 2;
+    }
+    if (options.ops.empty() || options.sizes.empty() || options.threads.empty() || options.layers.empty() ||
+        options.iterations <= 0 || options.entries < 0 ||
+        any_of(options.threads.begin(), options.threads.end(), [](int threads) { return threads <= 0; }) ||
+        any_of(options.sizes.begin(), options.sizes.end(), [](uint64_t size) { return size == 0; })) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    map<string, OpFunction> known_ops = makeOps();
+    for (const string& op : options.ops) {
+        if (known_ops.count(op) == 0) {
+            cerr << "Unknown op: " << op << endl;
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    bool scratch = options.storage_dir.empty();
+    if (scratch) {
+        char dir[] = "/tmp/rpc_bench.XXXXXX";
+        if (mkdtemp(dir) == nullptr) {
+            cerr << "mkdtemp: " << strerror(errno) << endl;
+            return 1;
+        }
+        options.storage_dir = dir;
+    }
+
+    vector<RpcResult> results;
+    {
+        unique_ptr<RpcBench> bench;
+        try {
+            bench.reset(new RpcBench(options));
+        } catch (const exception& e) {
+            cerr << "rpc_bench: " << e.what() << endl;
+            return 1;
+        }
+        for (const string& op : options.ops) {
+            vector<uint64_t> sizes = sized(op) ? options.sizes : vector<uint64_t>{0};
+            for (uint64_t size : sizes) {
+                for (int threads : options.threads) {
+                    for (Layer layer : options.layers) {
+                        results.push_back(bench->run(op, size, threads, layer));
+                    }
+                }
+            }
+        }
+    }
+    if (scratch) {
+        bench::removeTree(options.storage_dir);
+    }
+
+    ofstream file;
+    if (!options.output.empty()) {
+        file.open(options.output);
+        if (!file) {
+            cerr << "Cannot write " << options.output << endl;
+            return 1;
+        }
+    }
+    writeResults(options.output.empty() ? cout : file, options, results);
+    for (const RpcResult& result : results) {
+        if (result.errors > 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
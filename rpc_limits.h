@@ -0,0 +1,21 @@
+#ifndef NFS_RPC_LIMITS_H
+#define NFS_RPC_LIMITS_H
+
+// Message size limits the client and server must agree on. Neither side
+// raises gRPC's default 4 MiB receive limit, so every unary message has to
+// fit under it with its envelope: the other fields, their tags and lengths.
+
+#include <cstddef>
+
+namespace nfslimits {
+
+static const size_t kGrpcMaxMessage = 4 * 1024 * 1024; // gRPC's default receive limit
+static const size_t kEnvelopeBytes  = 64 * 1024;        // Room for everything but the payload, a path included
+
+// Largest NfsRead. The server rejects bigger ones with EINVAL and the client
+// splits them; ranges past the stream threshold go over NfsReadStream.
+static const size_t kMaxReadBytes = kGrpcMaxMessage - kEnvelopeBytes;
+
+} // namespace nfslimits
+
+#endif // NFS_RPC_LIMITS_H